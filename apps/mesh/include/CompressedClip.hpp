@@ -0,0 +1,75 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include <glm/glm.hpp>
+#include <glm/gtc/quaternion.hpp>
+
+// Keyframes of a single bone as imported, before compression.
+struct BoneClip {
+	// Index of the bone this clip relates to
+	int boneIndex;
+	// List of keyframes in ascending order of timeOffset
+	std::vector<std::pair<double, glm::vec3>> positionFrames;
+	std::vector<std::pair<double, glm::vec3>> scaleFrames;
+	std::vector<std::pair<double, glm::quat>> rotationFrames;
+};
+
+// Vector keyframes with each component stored as 16 bits relative to the range of the track.
+struct CompressedVectorTrack {
+	glm::vec3 minimum;
+	glm::vec3 range;
+	// Key times in seconds, ascending
+	std::vector<float> times;
+	// Three quantized components per key
+	std::vector<uint16_t> values;
+
+	glm::vec3 decode(int key) const;
+	// Interpolate at time t. The cursor caches the keyframe pair used by the previous call.
+	glm::vec3 sample(double t, int& cursor) const;
+};
+
+// Rotation keyframes stored with smallest-three quantization: the index of the largest component and the
+// other three components at 15 bits each, 48 bits per key.
+struct CompressedRotationTrack {
+	// Key times in seconds, ascending
+	std::vector<float> times;
+	// Three packed words per key
+	std::vector<uint16_t> values;
+
+	glm::quat decode(int key) const;
+	// Interpolate at time t. The cursor caches the keyframe pair used by the previous call.
+	glm::quat sample(double t, int& cursor) const;
+};
+
+struct CompressedBoneClip {
+	// Index of the bone this clip relates to
+	int boneIndex;
+	CompressedVectorTrack position;
+	CompressedVectorTrack scale;
+	CompressedRotationTrack rotation;
+};
+
+// Largest error allowed when removing a keyframe that can be interpolated from its neighbours.
+struct ClipCompressionSettings {
+	// In model units
+	float positionTolerance = 0.01f;
+	// Relative to a scale of 1
+	float scaleTolerance = 0.001f;
+	// Angle in radians
+	float rotationTolerance = 0.0005f;
+};
+
+// What compression did to a set of clips, for reporting.
+struct ClipCompressionStats {
+	size_t keysBefore = 0;
+	size_t keysAfter = 0;
+	size_t bytesBefore = 0;
+	size_t bytesAfter = 0;
+	float maxPositionError = 0.0f;
+	float maxScaleError = 0.0f;
+	float maxRotationError = 0.0f;
+};
+
+// Remove redundant keyframes and quantize the rest, measuring the error against the original keys.
+CompressedBoneClip compressClip(const BoneClip& clip, const ClipCompressionSettings& settings, ClipCompressionStats& stats);
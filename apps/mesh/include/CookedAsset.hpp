@@ -0,0 +1,115 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+// Arrays in cooked files start at multiples of this, so they can be used from a mapping as is
+constexpr size_t COOKED_ARRAY_ALIGNMENT = 16;
+
+// Every cooked file starts with these fields, so tools can tell whether it is up to date without parsing the rest.
+struct CookedHeader {
+	char magic[4];
+	uint32_t version;
+	// cookedSourceHash of the file it was made from
+	uint64_t sourceHash;
+};
+
+// Hash of a source file and the settings it is cooked with, such as the format version and import flags.
+uint64_t cookedSourceHash(const unsigned char* source, size_t size, uint64_t settings);
+
+// Whether the data starts with a header of the given format, version and source hash.
+bool cookedHeaderMatches(const unsigned char* data, size_t size, const char magic[4], uint32_t version, uint64_t sourceHash);
+
+// Replace the file at path with the bytes, creating its directory. The file is written under a temporary name and
+// renamed, so a reader never maps a half-written file.
+bool writeCookedFile(const std::string& path, const std::vector<unsigned char>& bytes);
+
+// Appends values to a cooked file in native byte order.
+// Strings are a 32-bit length followed by the characters, vectors a 32-bit count followed by the aligned elements.
+class CookedWriter {
+public:
+	template<typename T>
+	void write(const T& value) {
+		writeBytes(&value, sizeof(T));
+	}
+
+	void writeBytes(const void* data, size_t size) {
+		const unsigned char* bytes = (const unsigned char*)data;
+		mBuffer.insert(mBuffer.end(), bytes, bytes + size);
+	}
+
+	void writeString(const std::string& value) {
+		write<uint32_t>(value.size());
+		writeBytes(value.data(), value.size());
+	}
+
+	template<typename T>
+	void writeArray(const T* values, size_t count) {
+		mBuffer.resize((mBuffer.size() + COOKED_ARRAY_ALIGNMENT - 1) / COOKED_ARRAY_ALIGNMENT * COOKED_ARRAY_ALIGNMENT);
+		writeBytes(values, count * sizeof(T));
+	}
+
+	template<typename T>
+	void writeVector(const std::vector<T>& values) {
+		write<uint32_t>(values.size());
+		writeArray(values.data(), values.size());
+	}
+
+	const std::vector<unsigned char>& buffer() const { return mBuffer; }
+
+private:
+	std::vector<unsigned char> mBuffer;
+};
+
+// Reads back what CookedWriter wrote, failing instead of reading past the end.
+class CookedReader {
+public:
+	CookedReader(const unsigned char* data, size_t size) : mData(data), mSize(size) {}
+
+	template<typename T>
+	bool read(T& value) {
+		return readBytes(&value, sizeof(T));
+	}
+
+	bool readBytes(void* destination, size_t size) {
+		if (size > mSize - mOffset) return false;
+		memcpy(destination, mData + mOffset, size);
+		mOffset += size;
+		return true;
+	}
+
+	bool readString(std::string& value) {
+		uint32_t length;
+		if (!read(length) || length > mSize - mOffset) return false;
+		value.assign((const char*)mData + mOffset, length);
+		mOffset += length;
+		return true;
+	}
+
+	// Point at an array inside the data without copying it.
+	template<typename T>
+	bool view(const T*& values, size_t count) {
+		size_t start = (mOffset + COOKED_ARRAY_ALIGNMENT - 1) / COOKED_ARRAY_ALIGNMENT * COOKED_ARRAY_ALIGNMENT;
+		if (start > mSize || count > (mSize - start) / sizeof(T)) return false;
+		values = (const T*)(mData + start);
+		mOffset = start + count * sizeof(T);
+		return true;
+	}
+
+	template<typename T>
+	bool readVector(std::vector<T>& values) {
+		uint32_t count;
+		const T* source;
+		if (!read(count) || !view(source, count)) return false;
+		values.assign(source, source + count);
+		return true;
+	}
+
+private:
+	const unsigned char* mData;
+	size_t mSize;
+	size_t mOffset = 0;
+};
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+
+class FetchedData;
+
+// Version of the cooked texture format. Bump it whenever the layout or the mipmap filter changes.
+constexpr uint32_t COOKED_TEXTURE_VERSION = 2;
+constexpr char COOKED_TEXTURE_MAGIC[4] = { 'T', 'E', 'X', 'C' };
+
+// How the levels of a cooked texture are stored
+enum class CookedTextureFormat : uint32_t {
+	// Tightly packed rows of channels bytes per pixel
+	Raw,
+	// ETC2 RGB8 blocks, for 3 channels
+	Etc2Rgb,
+	// ETC2 RGBA8 blocks with EAC alpha, for 4 channels
+	Etc2Rgba,
+};
+
+// One mipmap level.
+struct CookedTextureLevel {
+	uint32_t width;
+	uint32_t height;
+	const unsigned char* pixels;
+	// In bytes
+	size_t size;
+};
+
+// Decoded image with its whole mipmap chain, so each level can be uploaded without processing.
+struct CookedTexture {
+	// Channels of the source image, from 1 to 4
+	uint32_t channels = 0;
+	CookedTextureFormat format = CookedTextureFormat::Raw;
+	// From the full size down to 1x1
+	std::vector<CookedTextureLevel> levels;
+	// Pixels of every level after cooking. After reading a cooked file they point into it instead.
+	std::vector<unsigned char> storage;
+	// Mapped cooked file the levels point into, if they were loaded from one
+	std::shared_ptr<FetchedData> cookedFile;
+};
+
+// Hash identifying a source image and the format version. A cooked file is only used if it was made from the same hash.
+uint64_t cookedTextureSourceHash(const unsigned char* source, size_t size);
+
+// Decode an image file and build its mipmaps with a box filter.
+bool cookTexture(const unsigned char* source, size_t size, CookedTexture& texture);
+
+// Compress every level of a raw RGB or RGBA texture to ETC2, which GLES 3.0 and WebGL2 can sample without decoding.
+// Other textures are left raw. Takes a few seconds for a 2K texture.
+void compressTexture(CookedTexture& texture);
+// Decode every level of an ETC2 texture back to raw pixels, for contexts without ETC2 support.
+bool decompressTexture(const CookedTexture& texture, CookedTexture& raw);
+
+bool writeCookedTexture(const std::string& path, const CookedTexture& texture, uint64_t sourceHash);
+
+// Fill the texture from the bytes of a cooked file, pointing into them. Without a hash, any source is accepted.
+bool readCookedTexture(const unsigned char* bytes, size_t size, std::optional<uint64_t> sourceHash, CookedTexture& texture);
+
+#ifndef __EMSCRIPTEN__
+// Load an image from its cooked file if it is up to date. Otherwise cook it and write the cooked file for the next
+// run, compressed if the context can sample ETC2. Without ETC2 support, compressed cooked files are decoded here and
+// new ones keep raw mipmaps rather than a lossy copy. An empty cookedPath always cooks in memory, without compressing.
+// Meant to run on a loader thread.
+bool loadTexture(const std::string& sourcePath, const std::string& cookedPath, bool etc2Supported, CookedTexture& texture);
+#endif
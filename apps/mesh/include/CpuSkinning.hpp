@@ -0,0 +1,30 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include <glm/glm.hpp>
+#include "SkinnedMeshData.hpp"
+
+// Floats per vertex written by skinVertices: object space position, normal and uv
+constexpr size_t CPU_SKINNED_VERTEX_FLOATS = 8;
+
+// Bind pose vertices with one array per component, so that skinning streams through each of them linearly.
+struct SkinningStreams {
+	std::vector<float> positionX, positionY, positionZ;
+	std::vector<float> normalX, normalY, normalZ;
+	std::vector<float> u, v;
+	// Influence i of every vertex: its matrix index and weight
+	std::vector<int32_t> bone[4];
+	std::vector<float> weight[4];
+
+	uint32_t vertexCount() const { return (uint32_t)positionX.size(); }
+	void append(const SkinnedVertex* vertices, uint32_t count);
+};
+
+// Blend the skinning matrices of vertices [begin, end) and transform them, writing CPU_SKINNED_VERTEX_FLOATS per vertex
+// to output, which is indexed from vertex 0. Normals are transformed like SkinnedMesh.vert does, without normalizing.
+// Uses AVX2 or SSE on x86 and SIMD128 on WebAssembly when the build enables them, otherwise plain floats.
+void skinVertices(const SkinningStreams& streams, const glm::mat4* skinningMatrices, uint32_t begin, uint32_t end, float* output);
+// Instruction set skinVertices was compiled for, to label benchmarks
+const char* skinningInstructionSet();
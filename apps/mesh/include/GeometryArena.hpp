@@ -0,0 +1,87 @@
+#pragma once
+
+#include "opengl.hpp"
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <optional>
+
+// First-fit allocator of element ranges in [0, capacity). Freed ranges merge with their free neighbours.
+class FreeListAllocator {
+public:
+	explicit FreeListAllocator(uint32_t capacity = 0);
+	// Offset of a free range of count elements starting at a multiple of alignment, or nothing if no free range is
+	// large enough.
+	std::optional<uint32_t> allocate(uint32_t count, uint32_t alignment = 1);
+	void free(uint32_t offset, uint32_t count);
+	// Raise the capacity, adding the new elements to the free range at the end.
+	void grow(uint32_t capacity);
+	// Length of the free range reaching the end, which grow extends
+	uint32_t freeAtEnd() const;
+	uint32_t capacity() const { return mCapacity; }
+	uint32_t used() const { return mUsed; }
+private:
+	// Length of each free range, by offset
+	std::map<uint32_t, uint32_t> mFree;
+	uint32_t mCapacity = 0;
+	uint32_t mUsed = 0;
+};
+
+// Where a mesh's vertices and indices live in a GeometryArena.
+struct GeometryAllocation {
+	// In vertices from the start of the vertex buffer
+	uint32_t firstVertex = 0;
+	uint32_t vertexCount = 0;
+	// GL_UNSIGNED_SHORT or GL_UNSIGNED_INT
+	GLenum indexType = GL_UNSIGNED_INT;
+	// In indices of indexType from the start of the index buffer
+	uint32_t firstIndex = 0;
+	uint32_t indexCount = 0;
+};
+
+// Vertices and indices of many meshes in one vertex buffer and one index buffer, suballocated with free lists, with a
+// single vertex array for all of them. The buffers grow by copying when a mesh doesn't fit. Meshes can mix 16 and
+// 32-bit indices, since the index buffer is allocated in 16-bit units.
+// Draws add firstVertex to the indices with glDrawElementsInstancedBaseVertex where the context has it. Otherwise, as
+// on WebGL, firstVertex is added to the indices when they are written instead, widening 16-bit indices that would
+// overflow.
+class GeometryArena {
+public:
+	// Every vertex is vertexSize bytes. setVertexLayout points the attributes of the bound vertex array at the bound
+	// GL_ARRAY_BUFFER, and is called again whenever the vertex buffer is replaced.
+	GeometryArena(GLsizei vertexSize, std::function<void()> setVertexLayout);
+	~GeometryArena();
+	GeometryArena(const GeometryArena&) = delete;
+	GeometryArena& operator=(const GeometryArena&) = delete;
+
+	// Copy a mesh into the arena. indexType is GL_UNSIGNED_SHORT or GL_UNSIGNED_INT. Returns nothing if the buffers
+	// would have to grow past their maximum size.
+	std::optional<GeometryAllocation> allocate(const void* vertices, uint32_t vertexCount, const void* indices, uint32_t indexCount, GLenum indexType);
+	// Make the ranges of a mesh available to later allocations.
+	void free(const GeometryAllocation& allocation);
+
+	// Bind the vertex array shared by every mesh of the arena.
+	void bind() const;
+	GLuint vertexArray() const { return mVertexArray; }
+	// Draw the triangles of a mesh, or of a range of its indices. The arena must be bound.
+	void drawInstanced(const GeometryAllocation& allocation, GLsizei instanceCount) const;
+	void drawInstanced(const GeometryAllocation& allocation, uint32_t firstIndex, uint32_t indexCount, GLsizei instanceCount) const;
+
+	uint32_t usedVertices() const { return mVertices.used(); }
+	// In 16-bit units
+	uint32_t usedIndexUnits() const { return mIndexUnits.used(); }
+private:
+	// Reserve count aligned elements in a buffer, replacing it with a larger copy if no free range fits. Returns nothing
+	// if the copy would exceed the maximum buffer size.
+	std::optional<uint32_t> reserve(GLuint& buffer, FreeListAllocator& allocator, GLsizeiptr elementSize, uint32_t count, uint32_t alignment, uint32_t minimumCapacity);
+
+	GLsizei mVertexSize;
+	std::function<void()> mSetVertexLayout;
+	bool mBaseVertex;
+	GLuint mVertexArray = 0;
+	GLuint mVertexBuffer = 0;
+	GLuint mIndexBuffer = 0;
+	FreeListAllocator mVertices;
+	// 16-bit units, with 32-bit indices taking two aligned units each
+	FreeListAllocator mIndexUnits;
+};
@@ -4,17 +4,127 @@
 #include <unordered_map>
 #include <string>
 #include <memory>
-#include <assimp/texture.h>
-#include <stb_image.h>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
 
+struct CookedTexture;
+
+// Index of a texture in the MaterialManager, resolved from its path once at load time.
+typedef uint32_t TextureHandle;
+constexpr TextureHandle NO_TEXTURE = UINT32_MAX;
+
+// Where a texture is sampled from: a layer of a GL_TEXTURE_2D_ARRAY
+struct TextureLayer {
+	GLuint array = 0;
+	int layer = 0;
+};
+
+// Textures by path, packed as layers of texture arrays shared by textures of the same size, format and mipmap count,
+// so that draws switching between them only change a layer index. A finished load that needs a new array waits for
+// the other loads in flight, so that the array gets a layer for each texture of its shape. Textures are loaded in the
+// background and kept within a memory budget. Each use stamps the texture with the current frame, and once the
+// texture arrays exceed the budget the least recently used arrays are evicted, to be loaded again the next time their
+// textures are used. Until a texture is resident a placeholder is returned in its place.
 class MaterialManager {
 public:
-	GLuint getTexture(std::string path);
-	void addTexture(std::string path, const aiTexture* texture);
+	// Handle of an image, starting its load. An empty path gives NO_TEXTURE, which always uses the placeholder.
+	TextureHandle textureHandle(const std::string& path);
+	// Layer to sample a texture from this frame, starting its load again if it was evicted.
+	TextureLayer useTexture(TextureHandle handle);
+	// Keep an image file held in memory, such as a texture embedded in a model, and load it under the given path.
+	void addTexture(std::string path, const unsigned char* data, size_t size);
+	// Free every texture. Handles stay valid and load their texture again when used.
 	void unloadTextures();
 
+	// Start a frame, evicting arrays none of whose textures were used last frame while the arrays exceed the budget.
+	void beginFrame();
+	// Bytes that texture arrays may take, mipmaps included. 0 means no limit.
+	void setBudget(size_t bytes) { mBudget = bytes; }
+	size_t budget() const { return mBudget; }
+	size_t residentBytes() const { return mResidentBytes; }
+	// Texture arrays holding resident textures
+	size_t arrayCount() const;
+
 private:
-	std::unordered_map<std::string, GLuint> mTextures;
+	// Failed textures use the placeholder without trying again until their data is replaced
+	enum class TextureState { Unloaded, Loading, Resident, Failed };
+
+	// What textures sharing an array have in common
+	struct TextureShape {
+		// Compressed format, or the format of raw pixels
+		GLenum format = 0;
+		bool compressed = false;
+		uint32_t width = 0;
+		uint32_t height = 0;
+		// 0 until known
+		uint32_t levels = 0;
+
+		bool operator==(const TextureShape& other) const {
+			return format == other.format && compressed == other.compressed &&
+				width == other.width && height == other.height && levels == other.levels;
+		}
+	};
+
+	struct Texture {
+		std::string path;
+		TextureState state = TextureState::Unloaded;
+		// Index in mArrays while resident
+		int array = -1;
+		int layer = 0;
+		// Of its last load, known once a load finishes
+		TextureShape shape;
+		uint64_t lastUsedFrame = 0;
+		// Incremented by evictions, so that loads started before one are dropped
+		uint32_t generation = 0;
+		// Encoded image of a texture that has no file, to decode it again after an eviction
+		std::shared_ptr<const std::vector<unsigned char>> embedded;
+	};
+
+	// Fixed number of layers of the same shape. Deleted once no layer is used.
+	struct TextureArray {
+		GLuint id = 0;
+		TextureShape shape;
+		size_t bytes = 0;
+		std::vector<bool> usedLayers;
+	};
+
+	// Finished load waiting for others of its shape before a new array is made for them
+	struct ParkedLoad {
+		TextureHandle handle;
+		uint32_t generation;
+		std::shared_ptr<const CookedTexture> cooked;
+		uint64_t frame;
+	};
+
+	void load(TextureHandle handle);
+	// Whether a load is still wanted, as the texture wasn't evicted or unloaded since it started.
+	bool isCurrentLoad(TextureHandle handle, uint32_t generation) const;
+	// Copy a load that finished into a free layer, or park it until a new array can be sized for its shape.
+	void finishLoad(TextureHandle handle, uint32_t generation, std::shared_ptr<const CookedTexture> cooked);
+	void failLoad(TextureHandle handle, uint32_t generation);
+	// Give each shape of parked loads an array once no other load may still match it, or once they waited too long.
+	void placeParkedLoads();
+	// Upload a texture into a free layer of the array.
+	void placeTexture(TextureHandle handle, int arrayIndex, const CookedTexture& cooked);
+	// Index in mArrays of an array with a free layer for textures of this shape, or -1.
+	int findArray(const TextureShape& shape) const;
+	// Array of the given number of layers, with the level sizes of cooked. Returns its index in mArrays.
+	int createArray(const TextureShape& shape, const CookedTexture& cooked, int layers);
+	void evict(Texture& texture);
+	// 1x1 grey single layer array used in place of textures still loading
+	GLuint placeholder();
+
+	std::vector<Texture> mTextures;
+	std::unordered_map<std::string, TextureHandle> mHandles;
+	// Slots of deleted arrays have a zero id and get reused
+	std::vector<TextureArray> mArrays;
+	std::vector<ParkedLoad> mParkedLoads;
+	GLuint mPlaceholder = 0;
+	uint64_t mFrame = 1;
+	size_t mBudget = 0;
+	size_t mResidentBytes = 0;
+	bool mOverBudgetReported = false;
 };
 
 extern MaterialManager* globalMaterialManager;
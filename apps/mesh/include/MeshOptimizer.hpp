@@ -0,0 +1,25 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// Entries of the FIFO post-transform vertex cache the optimizations target and the ACMR is measured with
+constexpr int VERTEX_CACHE_SIZE = 16;
+
+// Average cache miss ratio: vertex shader invocations per triangle with a FIFO cache. 3 is the worst, and around 0.6
+// is typical of well ordered meshes.
+float computeACMR(const uint32_t* indices, size_t indexCount, uint32_t vertexCount, int cacheSize = VERTEX_CACHE_SIZE);
+
+// Reorder triangles for post-transform vertex cache reuse with Tipsify (Sander, Nehab and Barczak 2007), fanning
+// around recently used vertices.
+void optimizeVertexCache(uint32_t* indices, size_t indexCount, uint32_t vertexCount, int cacheSize = VERTEX_CACHE_SIZE);
+
+// Reorder clusters of triangles so that those facing away from the center are drawn first and occlude the rest.
+// Clusters are split where the cache is cold, and further as long as their ACMR stays within threshold times that of
+// the cache optimized order. Positions are read as 3 floats every positionStride bytes.
+void optimizeOverdraw(uint32_t* indices, size_t indexCount, const void* positions, size_t positionStride, uint32_t vertexCount,
+	float threshold = 1.05f, int cacheSize = VERTEX_CACHE_SIZE);
+
+// Reorder vertices by first use in the index buffer, so that vertex fetches walk memory forwards, and rewrite the
+// indices to match. Unreferenced vertices are dropped. Returns the new vertex count.
+uint32_t optimizeVertexFetch(uint32_t* indices, size_t indexCount, void* vertices, uint32_t vertexCount, size_t vertexSize);
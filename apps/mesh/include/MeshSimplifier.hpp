@@ -0,0 +1,14 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// Simplify a triangle list by collapsing edges in order of quadric error (Garland and Heckbert 1997), until at most
+// targetIndexCount indices remain or no collapse stays under maxError.
+// A collapse moves a vertex onto one of its neighbours rather than to a new position, so the result indexes the same
+// vertices and needs no attribute interpolation, which keeps bone weights exact. Vertices with a nonzero locked entry
+// are never moved. Collapses that would flip a triangle are skipped.
+// Positions are read as 3 floats every positionStride bytes. Returns the number of indices written to destination,
+// which must hold indexCount, and the largest error in position units through resultError.
+size_t simplifyMesh(uint32_t* destination, const uint32_t* indices, size_t indexCount, const void* positions, size_t positionStride,
+	uint32_t vertexCount, const uint8_t* locked, size_t targetIndexCount, float maxError, float& resultError);
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <glm/glm.hpp>
+#include <glm/gtc/quaternion.hpp>
+
+struct Bone {
+	// Indicates the geometric parent index.
+	// Always smaller than the current bone so that computation of the whole skeleton can be done with a linear pass.
+	int parent;
+	// Indicates where to put the matrix relative to the armature when building the vertex shader uniform data.
+	int matrixIndex;
+	// Rest matrix relative to the parent bone, or the armature in case of the root bone.
+	glm::mat4 relativeMatrix;
+	// Matrix the bone is actually offset from the emulated child node position.
+	glm::mat4 offsetMatrix;
+	// Name of the bone
+	std::string name;
+};
+
+// Local transforms of every bone in separate arrays, without matrices. Used as a scratch buffer to blend
+// several clips before the result is set on a SkeletonPose.
+struct LocalPose {
+	std::vector<glm::vec3> translations;
+	std::vector<glm::quat> rotations;
+	std::vector<glm::vec3> scales;
+	// Total weight blended into each bone
+	std::vector<float> weights;
+
+	void resize(size_t boneCount);
+};
+
+// Local transforms of a skeleton kept as separate translation, rotation and scale arrays, plus the matrices derived from them.
+// evaluate() only recomputes bones whose local transform changed and their descendants.
+class SkeletonPose {
+public:
+	// Size the pose for the skeleton and put every bone at its rest transform.
+	void reset(const std::vector<Bone>& bones);
+	// Set the local transform of a bone. Setting the same values again doesn't mark the bone dirty.
+	void setLocal(int bone, const glm::vec3& translation, const glm::quat& rotation, const glm::vec3& scale);
+	// Recompute the matrices of dirty bones and their descendants. Returns true if any skinning matrix changed.
+	bool evaluate(const std::vector<Bone>& bones);
+
+	const glm::vec3& translation(int bone) const { return mTranslations[bone]; }
+	const glm::quat& rotation(int bone) const { return mRotations[bone]; }
+	const glm::vec3& scale(int bone) const { return mScales[bone]; }
+	// Matrices taking bind pose vertices to the posed armature space, indexed by Bone::matrixIndex.
+	const std::vector<glm::mat4>& skinningMatrices() const { return mSkinningMatrices; }
+	// Incremented every time evaluate() changes the skinning matrices.
+	uint64_t version() const { return mVersion; }
+
+private:
+	std::vector<glm::vec3> mTranslations;
+	std::vector<glm::quat> mRotations;
+	std::vector<glm::vec3> mScales;
+	std::vector<uint8_t> mDirty;
+
+	std::vector<glm::mat4> mLocalMatrices;
+	std::vector<glm::mat4> mGlobalMatrices;
+	std::vector<glm::mat4> mSkinningMatrices;
+	glm::mat4 mGlobalInverse;
+	uint64_t mVersion = 0;
+};
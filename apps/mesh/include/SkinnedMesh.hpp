@@ -4,81 +4,281 @@
 #include <memory>
 #include <string>
 #include <unordered_map>
-#include <assimp/scene.h>
 #include <glm/glm.hpp>
 #include <glm/gtc/quaternion.hpp>
 #include "shader.hpp"
+#include "CompressedClip.hpp"
+#include "CpuSkinning.hpp"
+#include "GeometryArena.hpp"
+#include "MaterialManager.hpp"
+#include "SkeletonPose.hpp"
+#include "SkinnedMeshData.hpp"
 
-struct SkinnedVertex {
-    glm::vec3 position;
-    glm::vec3 normal;
-    glm::vec2 uv;
-    glm::ivec4 bone;
-    glm::vec4 influence;
+struct Mesh {
+	// Range of the arena of the mesh's vertex format
+	GeometryAllocation geometry;
+	// Index ranges within the geometry, from the full mesh to the coarsest
+	std::vector<SkinnedMeshLod> lods;
+	// Boxes of the bones influencing the sub-mesh, to cull it in its pose
+	std::vector<SkinnedBoneBounds> boneBounds;
+	// Resolved from the texture paths when the mesh is loaded
+	TextureHandle diffuseTexture = NO_TEXTURE;
+	TextureHandle specularTexture = NO_TEXTURE;
+	// Where the sub-mesh starts in the skinned vertex cache and its index buffer
+	uint32_t cachedFirstVertex = 0;
+	uint32_t cachedFirstIndex = 0;
 };
 
-struct Mesh {
-    GLuint vertexArray;
-	GLuint numIndices;
-    std::string diffuseTexture;
-    std::string specularTexture;
+// How SkinnedMesh::draw skins the vertices of the mesh's own instance
+enum class SkinningMode {
+	// In the vertex shader of every draw
+	PerDraw,
+	// Into a buffer through transform feedback once per pose, which draws then read with a shader that doesn't skin,
+	// so extra passes over the character don't pay for skinning again
+	SkinOnce,
+	// On the CPU across the job threads into the same buffer as SkinOnce, for software rasterizers where vertex
+	// shaders are the slowest part. Also keeps the skinned vertices readable with cpuSkinnedVertices.
+	Cpu,
 };
 
-struct Bone {
-	// Indicates the geometric parent index.
-	// Always smaller than the current bone so that computation of the whole skeleton can be done with a linear pass.
-	int parent;
-	// Indicates where to put the matrix relative to the armature when building the vertex shader uniform data.
-	int matrixIndex;
-	// Matrix relative to the parent bone, or the armature in case of the root bone.
-	glm::mat4 relativeMatrix;
-	// Matrix the bone is actually offset from the emulated child node position.
-	glm::mat4 offsetMatrix;
-	// Name of the bone
-	std::string name;
+// Keyframe indices last used when sampling a CompressedBoneClip, so that forward playback doesn't search from the start.
+struct BoneClipCursor {
+	int position = 0;
+	int scale = 0;
+	int rotation = 0;
 };
 
-struct BoneClip {
-	// Index of the bone this clip relates to
-	int boneIndex;
-	// List of keyframes in ascending order of timeOffset
-	std::vector<std::pair<double, glm::vec3>> positionFrames;
-	std::vector<std::pair<double, glm::vec3>> scaleFrames;
-	std::vector<std::pair<double, glm::quat>> rotationFrames;
+enum class AnimationBlendMode {
+	// Weighted average with the other override layers
+	Override,
+	// Offset from the clip's first frame, applied on top of the override layers
+	Additive
 };
 
-struct SkinnedMeshAnimation {
-	double duration;
-	std::vector<BoneClip> clips;
+// Animation playing on an instance, with a weight that can fade over time.
+struct AnimationLayer {
+	std::string animationName;
+	// Resolved from the name once the mesh is loaded
+	const SkinnedMeshAnimation* animation = nullptr;
+	// Playback cursor for each clip of the animation
+	std::vector<BoneClipCursor> cursors;
+	AnimationBlendMode mode = AnimationBlendMode::Override;
+	float weight = 0.0f;
+	// Weight the layer fades towards, and how much it changes per second
+	float targetWeight = 0.0f;
+	float fadeSpeed = 0.0f;
+	// Animation time at which the clip starts from its first frame
+	double startTime = 0.0;
+	// Free the layer once it has faded out, used by cross-fades
+	bool removeWhenFaded = false;
+	bool active = false;
+};
+
+class SkinnedMesh;
+struct DrawPacket;
+
+// Lightweight character sharing the geometry, skeleton and animations of a SkinnedMesh.
+// Holds its own playback state and pose, so thousands of them can be drawn with SkinnedMesh::drawInstances.
+// Several animations can play at once in layers, blended per bone in translation/rotation/scale form into
+// buffers allocated when the mesh loads, so animating doesn't allocate.
+class SkinnedMeshInstance {
+public:
+	SkinnedMeshInstance(SkinnedMesh& mesh);
+	// Play a single animation, replacing every layer. Can be called before the mesh has finished loading.
+	void setAnimation(std::string name);
+	// Fade the override layers out and the given animation in, starting from its first frame.
+	void crossFade(std::string name, double duration);
+	// Start playing an animation in a free layer and return the layer index.
+	int addLayer(std::string name, float weight, AnimationBlendMode mode = AnimationBlendMode::Override);
+	// Move the weight of a layer to the given value over the duration in seconds, or at once when it is 0.
+	void setLayerWeight(int layer, float weight, double duration = 0.0);
+	void removeLayer(int layer);
+	// Update the layers and blend them into the pose.
+	void animate(double t);
+	// Recompute the skinning matrices of bones whose pose changed since the last call.
+	void evaluatePose();
+
+	SkinnedMesh& mesh() const { return *mMesh; }
+	const SkeletonPose& pose() const { return mPose; }
+	const std::vector<AnimationLayer>& layers() const { return mLayers; }
+	// Whether the last draw found the instance outside the view. Its animation can be skipped until it is drawn
+	// again, at the cost of culling with the last pose it was animated to.
+	bool culled() const { return mCulled; }
+
+	// Object matrix used by SkinnedMesh::drawInstances
+	glm::mat4 matrix = glm::mat4(1.0f);
+
+private:
+	friend class SkinnedMesh;
+
+	// Size the buffers and resolve the layer animations once the mesh is loaded. Returns false while it is still loading.
+	bool prepare();
+	void resolveLayer(AnimationLayer& layer);
+	void advanceFades(double dt);
+	// Sample the clips of a layer and add them to the blend buffer.
+	void accumulateLayer(AnimationLayer& layer, double t);
+	// Turn the accumulated override layers into a normalized pose, filling missing weight with the rest pose.
+	void resolveBlend();
+	void applyAdditiveLayer(AnimationLayer& layer, double t);
+
+	SkinnedMesh* mMesh;
+	std::vector<AnimationLayer> mLayers;
+	SkeletonPose mPose;
+	LocalPose mRestPose;
+	LocalPose mBlendPose;
+	// t of the previous animate call, to advance fades
+	double mLastTime = 0.0;
+	bool mAnimated = false;
+	bool mPrepared = false;
+	bool mCulled = false;
 };
 
 // Object class that contains a set of meshes that are deformed by some bones.
-// It can be loaded from any file format that Assimp can extract an armature and bones from.
+// It can be loaded from any file format that Assimp can extract an armature and bones from. Natively the import result
+// is cooked into COOKED_ASSETS_DIR, and later runs load that file instead as long as the source hasn't changed.
+// The meshes, skeleton and animations are shared by every SkinnedMeshInstance created from it. The mesh also has a
+// built-in instance used by setAnimation, animate and draw.
 class SkinnedMesh {
 public:
-	// Load from the given file.
-	SkinnedMesh(std::string filename);
+	// Load from the given file, relative to the assets directory. The packed vertex format falls back to the full
+	// one if the skeleton has too many bones for it.
+	SkinnedMesh(std::string filename, SkinnedVertexFormat vertexFormat = SkinnedVertexFormat::Full);
+	~SkinnedMesh();
 	// Set the currently active animation.
 	void setAnimation(std::string name);
+	// Fade from the current animation to another one.
+	void crossFade(std::string name, double duration);
 	// Update the currently active animation.
 	void animate(double t);
-	// Draw each deformed mesh using OpenGL.
-    void draw(glm::mat4 projection, glm::mat4 cameraInverse, glm::mat4 matrix);
+	// Recompute the skinning matrices of bones whose pose changed since the last call. Done by draw when needed.
+	void evaluatePose();
+	// Draw each deformed mesh using OpenGL, with the camera of globalFrameUniforms. The draws are queued on
+	// globalRenderQueue and read the palette when it is flushed, so a mesh is drawn at most once per flush.
+	// Nothing is drawn or uploaded if the posed bounds are outside the view, and sub-meshes outside it are skipped.
+    void draw(glm::mat4 matrix);
+	// Draw many instances of this mesh, packing their bone palettes into one texture and queuing one
+	// instanced draw per sub-mesh and level of detail. Crowds larger than the palette flush the queue between batches.
+	// Instances whose posed bounds are outside the view are left out of the palette.
+	void drawInstances(const std::vector<SkinnedMeshInstance*>& instances);
+	// Instances the last drawInstances drew, after culling
+	size_t drawnInstanceCount() const { return mSortedInstances.size(); }
+	// Level of detail to draw with an object matrix: the coarsest whose error projects to at most LOD_SCREEN_ERROR
+	// with the camera of globalFrameUniforms. 0 is the full mesh.
+	int selectLod(const glm::mat4& matrix) const;
+	int lodCount() const { return mLodErrors.size(); }
 	// Get a reference to a bone by its name.
 	Bone& getBone(std::string name);
+
+	// Whether the file has been parsed. Loading can be asynchronous.
+	bool isLoaded() const { return mLoaded; }
+	const std::vector<Bone>& getBones() const { return mBones; }
+	SkinnedVertexFormat vertexFormat() const { return mVertexFormat; }
+	// Only affects draw, as a crowd would need a skinned copy of the vertices per instance.
+	void setSkinningMode(SkinningMode mode);
+	SkinningMode skinningMode() const { return mSkinningMode; }
+	// Vertices of the last draw in SkinningMode::Cpu, CPU_SKINNED_VERTEX_FLOATS each in object space, sub-mesh after
+	// sub-mesh, e.g. for picking and collision. Empty in the other modes.
+	const std::vector<float>& cpuSkinnedVertices() const { return mCpuSkinnedVertices; }
+	// Find an animation by name, or return null.
+	const SkinnedMeshAnimation* findAnimation(const std::string& name) const;
 private:
-	void parse(const std::string assetPath, const aiScene* scene);
-	void parse(std::string assetPath, const aiScene* scene, const aiMesh* mesh, const std::vector<std::vector<std::pair<float, int>>>& sortedWeights);
-    void createBoneMatrices(int parentIndex, const aiNode* currentBone, std::unordered_map<const aiNode*, const aiBone*>& nodeBones, std::unordered_map<const aiNode*, int>& boneMatrixIndices);
+	// Create the GL objects and take the skeleton and animations. Textures are relative to assetPath.
+	void upload(const std::string& assetPath, SkinnedMeshData& data);
+	void uploadSubMesh(const std::string& assetPath, const SkinnedSubMeshData& subMesh);
+	// Point the attributes of the bound vertex array at the bound vertex buffer, laid out in a vertex format.
+	static void setVertexLayout(SkinnedVertexFormat vertexFormat);
+	// Program for a vertex format, compiled on first use and shared by every mesh.
+	static Shader& shader(SkinnedVertexFormat vertexFormat);
+	// Buffers holding the sub-meshes of every mesh in a vertex format, created on first use.
+	static GeometryArena& arena(SkinnedVertexFormat vertexFormat);
+	// Program writing the skinned vertices of a vertex format to the skinned vertex cache, compiled on first use
+	static Shader& skinShader(SkinnedVertexFormat vertexFormat);
+	// Program drawing from the skinned vertex cache, compiled on first use
+	static Shader& cachedShader();
 
-	void parseAnimation(const aiScene* scene);
+	// Store the object matrix and skinning matrices of an instance in a row of the palette. The palette data must already hold the row.
+	void writePaletteRow(int row, const SkinnedMeshInstance& instance);
+	// Send the first rows of the palette to the texture, growing it when needed.
+	void uploadPalette(int rows);
+	// Distance from the camera of globalFrameUniforms to the bounds with an object matrix, to sort draws by
+	float viewDistance(const glm::mat4& matrix) const;
+	// Box around bone boxes moved by a pose, in the space of the skinning matrices. Returns false if there are no boxes
+	// or the pose isn't sized for them yet.
+	bool posedBounds(const std::vector<SkinnedBoneBounds>& bounds, const SkeletonPose& pose, glm::vec3& minimum, glm::vec3& maximum) const;
+	// Whether bone boxes moved by a pose are outside the view of globalFrameUniforms with an object matrix.
+	bool isCulled(const std::vector<SkinnedBoneBounds>& bounds, const SkeletonPose& pose, const glm::mat4& matrix) const;
+	// Queue the sub-meshes at a level of detail for the palette rows from firstInstance on.
+	void drawSubMeshes(int lod, int firstInstance, int instanceCount, float depth);
+	// Add the textures of each sub-mesh to a packet and queue it.
+	void submitSubMeshes(DrawPacket& packet, float depth);
+	// Draw function of the packets of drawSubMeshes
+	static void drawPacket(const DrawPacket& packet);
+	// Skin the mesh's own instance into the skinned vertex cache, unless the cache already holds its pose.
+	void updateSkinnedCache();
+	// Skin the mesh's own instance with skinVertices and upload the result to the skinned vertex cache.
+	void skinOnCpu();
+	// Queue the sub-meshes at a level of detail from the skinned vertex cache.
+	void drawCachedSubMeshes(int lod, float depth);
+	static void drawCachedPacket(const DrawPacket& packet);
 
 	std::vector<Bone> mBones;
-	std::vector<glm::mat4> mBoneNodeMatrices;
-	std::vector<glm::mat4> mBoneMatrices;
     std::vector<Mesh> mSkinnedMeshes;
 	std::unordered_map<std::string, SkinnedMeshAnimation> mAnimations;
-	std::string mCurrentAnimation;
+	bool mLoaded = false;
+	SkinnedMeshInstance mDefaultInstance;
+	SkinnedVertexFormat mVertexFormat;
+	Shader* mShader;
+	Uniform<int> mFirstInstanceUniform;
+	Uniform<int> mDiffuseLayerUniform;
+	Uniform<int> mCachedDiffuseLayerUniform;
+	Uniform<glm::mat4> mCachedObjectMatrixUniform;
+	SkinningMode mSkinningMode = SkinningMode::PerDraw;
+	// Sphere around the meshes in the bind pose
+	glm::vec3 mBoundsCenter = glm::vec3(0.0f);
+	float mBoundsRadius = 0.0f;
+	// Boxes of every sub-mesh merged per bone, to cull whole instances
+	std::vector<SkinnedBoneBounds> mBoneBounds;
+	// Inverse offset matrix of each bone by matrix index, which turns a skinning matrix into the bone's transform
+	std::vector<glm::mat4> mInverseOffsetMatrices;
+	// Sub-meshes to draw, filled by draw and drawInstances
+	std::vector<uint8_t> mSubMeshVisible;
+	// Largest simplification error of any sub-mesh at each level of detail
+	std::vector<float> mLodErrors;
+	// Instances of drawInstances sorted by level of detail, and where each level starts
+	std::vector<SkinnedMeshInstance*> mSortedInstances;
+	std::vector<uint8_t> mInstanceVisible;
+	std::vector<int> mInstanceLods;
+	std::vector<size_t> mLodStarts;
+
+	// Float texture with one row per instance: the object matrix followed by the skinning matrices, four texels each.
+	GLuint mPaletteTexture = 0;
+	int mPaletteRows = 0;
+	// Instances a batch can have, one palette row each. GL_MAX_TEXTURE_SIZE, queried once at upload.
+	int mMaxPaletteRows = 1;
+	// Matrices per row
+	int mPaletteRowLength = 1;
+	std::vector<glm::mat4> mPaletteData;
+	// What row 0 of the palette currently holds, so drawing the same instance and pose again skips the upload.
+	const SkinnedMeshInstance* mUploadedInstance = nullptr;
+	uint64_t mUploadedPoseVersion = 0;
+	glm::mat4 mUploadedMatrix;
+
+	// Object space position, normal and uv of every vertex of every sub-mesh, in sub-mesh order, written by
+	// transform feedback. It has indices of its own, since the arena's can be offset by a base vertex.
+	GLuint mCachedVertexBuffer = 0;
+	GLuint mCachedIndexBuffer = 0;
+	GLuint mCachedVertexArray = 0;
+	uint32_t mCachedVertexCount = 0;
+	// Pose version of the mesh's own instance in the cache, if it holds one. Changing the skinning mode empties it.
+	bool mCacheFilled = false;
+	uint64_t mCachedPoseVersion = 0;
+	// Bind pose of every sub-mesh, in the order of the cache
+	SkinningStreams mSkinningStreams;
+	std::vector<float> mCpuSkinnedVertices;
 
-	inline static std::unique_ptr<Shader> mShader;
+	// Indexed by SkinnedVertexFormat
+	inline static std::unique_ptr<Shader> mShaders[2];
+	inline static std::unique_ptr<Shader> mSkinShaders[2];
+	inline static std::unique_ptr<Shader> mCachedShader;
+	inline static std::unique_ptr<GeometryArena> mArenas[2];
 };
@@ -0,0 +1,158 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <assimp/postprocess.h>
+#include <assimp/scene.h>
+#include <glm/glm.hpp>
+#include "CompressedClip.hpp"
+#include "SkeletonPose.hpp"
+
+class FetchedData;
+namespace Assimp {
+class Importer;
+}
+
+struct SkinnedVertex {
+	glm::vec3 position;
+	glm::vec3 normal;
+	glm::vec2 uv;
+	glm::ivec4 bone;
+	glm::vec4 influence;
+};
+
+// The same vertex in 28 bytes rather than 64, for meshes whose skeleton has at most 256 matrix indices.
+struct PackedSkinnedVertex {
+	glm::vec3 position;
+	// Signed normalized x, y and z in 10 bits each, read as GL_INT_2_10_10_10_REV
+	uint32_t normal;
+	// Two half floats, u in the low bits
+	uint32_t uv;
+	uint8_t bone[4];
+	// Unsigned normalized, summing to 255
+	uint8_t influence[4];
+};
+
+enum class SkinnedVertexFormat {
+	// SkinnedVertex
+	Full,
+	// PackedSkinnedVertex
+	Packed
+};
+
+struct SkinnedMeshAnimation {
+	double duration;
+	std::vector<CompressedBoneClip> clips;
+};
+
+// Texture used by the material of a sub-mesh.
+struct SkinnedMeshTexture {
+	// Path relative to the model file, or the name of a texture embedded in it. Empty if there is none.
+	std::string name;
+	bool embedded = false;
+};
+
+// Range of a sub-mesh's indices drawing it at one level of detail. Every level uses the same vertices.
+struct SkinnedMeshLod {
+	uint32_t firstIndex;
+	uint32_t indexCount;
+	// Largest distance the simplification moved the surface, in model units. 0 for the full level.
+	float error;
+};
+
+// Box around the bind pose vertices of a sub-mesh that a bone influences, in the space of the bone: after its offset
+// matrix. Moved by the posed bone, it bounds those vertices in any pose, including where they blend with other bones.
+struct SkinnedBoneBounds {
+	int32_t matrixIndex;
+	glm::vec3 minimum;
+	glm::vec3 maximum;
+};
+
+// Geometry and textures of one sub-mesh, in the layout the GPU buffers use.
+struct SkinnedSubMeshData {
+	// Point into the storage below after an import, or straight into the cooked file after loading one
+	const SkinnedVertex* vertices = nullptr;
+	uint32_t vertexCount = 0;
+	// Same vertices in the packed format, or null if they don't fit in it
+	const PackedSkinnedVertex* packedVertices = nullptr;
+	// 16-bit indices when the sub-mesh has fewer than 65536 vertices, so the largest index is never the 0xffff
+	// primitive restart index of WebGL. Otherwise 32-bit indices. The other pointer is null.
+	const uint32_t* indices = nullptr;
+	const uint16_t* shortIndices = nullptr;
+	uint32_t indexCount = 0;
+	// From the full mesh to the coarsest simplification, each a range of the indices above
+	std::vector<SkinnedMeshLod> lods;
+	// One box per bone influencing the sub-mesh
+	std::vector<SkinnedBoneBounds> boneBounds;
+	SkinnedMeshTexture diffuse;
+	SkinnedMeshTexture specular;
+
+	std::vector<SkinnedVertex> vertexStorage;
+	std::vector<PackedSkinnedVertex> packedVertexStorage;
+	std::vector<uint32_t> indexStorage;
+	std::vector<uint16_t> shortIndexStorage;
+};
+
+// Everything a SkinnedMesh is made of, without GL objects, so it can be built on a loader thread.
+struct SkinnedMeshData {
+	std::vector<Bone> bones;
+	std::vector<SkinnedSubMeshData> meshes;
+	std::unordered_map<std::string, SkinnedMeshAnimation> animations;
+	// Image files embedded in the model, still compressed, by name
+	std::unordered_map<std::string, std::vector<unsigned char>> embeddedTextures;
+	// Files besides the model that Assimp read to import it, like glTF buffers, relative to the model's directory
+	std::vector<std::string> sourceDependencies;
+	// Mapped cooked file the sub-meshes point into, if they were loaded from one
+	std::shared_ptr<FetchedData> cookedFile;
+};
+
+// Version of the cooked format. Bump it whenever the layout or the import changes, so old files get rebuilt.
+constexpr uint32_t COOKED_MESH_VERSION = 6;
+constexpr char COOKED_MESH_MAGIC[4] = { 'S', 'K', 'M', 'C' };
+
+// Assimp post-processing used for skinned meshes, by the app and the asset cooker alike.
+constexpr unsigned int SKINNED_MESH_IMPORT_FLAGS =
+	aiProcessPreset_TargetRealtime_MaxQuality |
+	aiProcess_OptimizeGraph |
+	aiProcess_FlipUVs |
+	aiProcess_PopulateArmatureData;
+
+// Quantize vertices to the packed format. Returns false if a bone index doesn't fit in 8 bits.
+bool packSkinnedVertices(const SkinnedVertex* vertices, size_t count, PackedSkinnedVertex* packed);
+
+// Build the skeleton, sub-meshes and compressed animations from an imported scene. Triangles are reordered for the
+// vertex cache and overdraw, and vertices for fetch locality. Simplified levels of detail keep borders, UV seams and
+// boundaries between bones in place. Returns false if it has no armature.
+bool importSkinnedMesh(const aiScene* scene, SkinnedMeshData& data);
+
+// Store the data in a cooked file. Vertex and index arrays are aligned so they can be used from a mapping directly.
+bool writeCookedMesh(const std::string& path, const SkinnedMeshData& data, uint64_t sourceHash);
+
+// Fill the data from the bytes of a cooked file. The sub-mesh arrays point into the bytes, so they must outlive the data
+// or be kept in SkinnedMeshData::cookedFile. Returns false if the file is truncated, of another version, or made from
+// another source. Without a hash, any source is accepted, for builds where the asset cooker already checked it.
+bool readCookedMesh(const unsigned char* bytes, size_t size, std::optional<uint64_t> sourceHash, SkinnedMeshData& data);
+
+#ifndef __EMSCRIPTEN__
+// Read a model file with Assimp, listing the other files it opened in dependencies, relative to the model's directory.
+// sourceHash is what cookedMeshSourceHash gives for the bytes Assimp read, or nothing if a file changed while read.
+const aiScene* readSkinnedMeshFile(Assimp::Importer& loader, const std::string& sourcePath, std::vector<std::string>& dependencies,
+	std::optional<uint64_t>& sourceHash);
+
+// Hash identifying a source model, the files it depends on, the import flags and the format version. A cooked file is
+// only used if it was made from the same hash. Returns nothing if one of the files can't be read.
+std::optional<uint64_t> cookedMeshSourceHash(const std::string& sourcePath, const std::vector<std::string>& dependencies);
+
+// Hash the sources of a cooked mesh have now: the model and the dependencies recorded in the cooked file. Returns
+// nothing if the cooked file is of another version or a source is missing, so it needs cooking again.
+std::optional<uint64_t> currentCookedMeshSourceHash(const unsigned char* cooked, size_t size, const std::string& sourcePath);
+
+// Load a model from its cooked file if it is up to date. Otherwise import it with Assimp and write the cooked file
+// for the next run. An empty cookedPath always imports. Meant to run on a loader thread.
+bool loadSkinnedMesh(const std::string& sourcePath, const std::string& cookedPath, SkinnedMeshData& data);
+#endif
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// Bytes of each 4x4 block of ETC2 RGB8 and ETC2 RGBA8, which is an EAC alpha block followed by an RGB8 block
+constexpr size_t ETC2_RGB_BLOCK_SIZE = 8;
+constexpr size_t ETC2_RGBA_BLOCK_SIZE = 16;
+
+// Encode a 4x4 block of RGBA pixels, given row by row, as ETC2 RGB8. Only the individual and differential modes ETC2
+// shares with ETC1 are searched, which leaves out the T, H and planar modes at some cost in quality.
+void encodeEtc2RgbBlock(const uint8_t pixels[64], uint8_t block[ETC2_RGB_BLOCK_SIZE]);
+// Encode the alpha of a 4x4 block of RGBA pixels as an EAC block.
+void encodeEacAlphaBlock(const uint8_t pixels[64], uint8_t block[8]);
+
+// Write the colors of an ETC2 RGB8 block to a 4x4 block of RGBA pixels, leaving alpha alone. Returns false for the
+// T, H and planar modes, which the encoder never produces.
+bool decodeEtc2RgbBlock(const uint8_t block[ETC2_RGB_BLOCK_SIZE], uint8_t pixels[64]);
+// Write the alpha of an EAC block to a 4x4 block of RGBA pixels.
+void decodeEacAlphaBlock(const uint8_t block[8], uint8_t pixels[64]);
+
+// Size of an image with 3 or 4 channels once compressed, in rows of blocks covering it
+size_t etc2ImageSize(uint32_t width, uint32_t height, uint32_t channels);
+// Compress tightly packed RGB or RGBA pixels into ETC2 RGB8 or RGBA8 blocks. Blocks past the right or bottom edge
+// repeat the last column or row.
+void compressEtc2Image(const uint8_t* pixels, uint32_t width, uint32_t height, uint32_t channels, uint8_t* blocks);
+// Decompress ETC2 RGB8 or RGBA8 blocks into tightly packed RGB or RGBA pixels.
+bool decompressEtc2Image(const uint8_t* blocks, uint32_t width, uint32_t height, uint32_t channels, uint8_t* pixels);
@@ -2,7 +2,9 @@
 
 precision highp float;
 
-uniform sampler2D diffuse;
+// Texture array holding the sub-mesh's diffuse texture, and its layer
+uniform mediump sampler2DArray diffuse;
+uniform int diffuseLayer;
 
 in vec2 TexCoord;
 in vec3 worldNormal;
@@ -11,6 +13,6 @@ in vec3 weightColor;
 out vec4 FragColor;
 
 void main() {
-    FragColor = texture(diffuse, TexCoord);
+    FragColor = texture(diffuse, vec3(TexCoord, float(diffuseLayer)));
     // FragColor = vec4(weightColor, 1.0);
 }
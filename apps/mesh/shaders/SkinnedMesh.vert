@@ -1,35 +1,80 @@
 #version 300 es
 
-in vec3 position;
-in vec3 normal;
-in vec2 uv;
-in ivec4 bone;
-in vec4 influence;
+// Fixed locations, as the draw and SKIN_TO_BUFFER programs are linked separately but share the arena's vertex layout
+layout(location = 0) in vec3 position;
+layout(location = 1) in vec3 normal;
+layout(location = 2) in vec2 uv;
+#ifdef PACKED_VERTICES
+// PackedSkinnedVertex has 8-bit bone indices
+layout(location = 3) in uvec4 bone;
+#else
+layout(location = 3) in ivec4 bone;
+#endif
+layout(location = 4) in vec4 influence;
 
 out vec2 TexCoord;
 out vec3 worldNormal;
 out vec3 weightColor;
 
-const int MAX_BONES = 200;
+#ifdef SKIN_TO_BUFFER
+// Captured by transform feedback, in object space, to be drawn by SkinnedMeshCached.vert
+out vec3 skinnedPosition;
+out vec3 skinnedNormal;
+out vec2 skinnedUv;
+#endif
 
-uniform mat4 projectionMatrix;
-uniform mat4 cameraInverseMatrix;
-uniform mat4 objectMatrix;
-uniform mat4 boneMatrices[MAX_BONES];
+// Camera of the frame, shared by every program. See uniforms.hpp.
+layout(std140) uniform FrameBlock {
+    mat4 projectionMatrix;
+    mat4 cameraInverseMatrix;
+    mat4 viewProjectionMatrix;
+    vec4 cameraPosition;
+};
+
+// One row per instance: the object matrix followed by the bone matrices, each matrix stored as four texels.
+uniform highp sampler2D bonePalette;
+// Palette row of the first instance of the draw, as draws of different levels of detail share the palette
+uniform int firstInstance;
+
+mat4 paletteMatrix(int index)
+{
+    int x = index * 4;
+    int row = firstInstance + gl_InstanceID;
+    return mat4(
+        texelFetch(bonePalette, ivec2(x, row), 0),
+        texelFetch(bonePalette, ivec2(x + 1, row), 0),
+        texelFetch(bonePalette, ivec2(x + 2, row), 0),
+        texelFetch(bonePalette, ivec2(x + 3, row), 0));
+}
 
 void main()
 {
 
-    mat4 gWVP = projectionMatrix * cameraInverseMatrix * objectMatrix;
+    mat4 objectMatrix = paletteMatrix(0);
+    mat4 gWVP = viewProjectionMatrix * objectMatrix;
 
-    mat4 BoneTransform = boneMatrices[bone[0]] * influence[0];
-    BoneTransform     += boneMatrices[bone[1]] * influence[1];
-    BoneTransform     += boneMatrices[bone[2]] * influence[2];
-    BoneTransform     += boneMatrices[bone[3]] * influence[3];
+#ifdef PACKED_VERTICES
+    ivec4 boneIndex = ivec4(bone);
+    vec4 weight = influence / max(dot(influence, vec4(1.0)), 1e-6);
+#else
+    ivec4 boneIndex = bone;
+    vec4 weight = influence;
+#endif
+
+    mat4 BoneTransform = paletteMatrix(1 + boneIndex[0]) * weight[0];
+    BoneTransform     += paletteMatrix(1 + boneIndex[1]) * weight[1];
+    BoneTransform     += paletteMatrix(1 + boneIndex[2]) * weight[2];
+    BoneTransform     += paletteMatrix(1 + boneIndex[3]) * weight[3];
 
     vec4 PosL = BoneTransform * vec4(position, 1.0);
     gl_Position = gWVP * PosL;
     TexCoord = uv;
     worldNormal = mat3(gWVP * BoneTransform) * normal;
     weightColor = vec3(0.5);
-}
\ No newline at end of file
+
+#ifdef SKIN_TO_BUFFER
+    skinnedPosition = PosL.xyz;
+    skinnedNormal = mat3(BoneTransform) * normal;
+    skinnedUv = uv;
+#endif
+}
@@ -0,0 +1,29 @@
+#version 300 es
+
+// Vertices skinned beforehand by SkinnedMesh.vert with SKIN_TO_BUFFER, in object space
+layout(location = 0) in vec3 position;
+layout(location = 1) in vec3 normal;
+layout(location = 2) in vec2 uv;
+
+out vec2 TexCoord;
+out vec3 worldNormal;
+out vec3 weightColor;
+
+// Camera of the frame, shared by every program. See uniforms.hpp.
+layout(std140) uniform FrameBlock {
+    mat4 projectionMatrix;
+    mat4 cameraInverseMatrix;
+    mat4 viewProjectionMatrix;
+    vec4 cameraPosition;
+};
+
+uniform mat4 objectMatrix;
+
+void main()
+{
+    mat4 gWVP = viewProjectionMatrix * objectMatrix;
+    gl_Position = gWVP * vec4(position, 1.0);
+    TexCoord = uv;
+    worldNormal = mat3(gWVP) * normal;
+    weightColor = vec3(0.5);
+}
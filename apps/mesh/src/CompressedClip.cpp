@@ -0,0 +1,218 @@
+#include "CompressedClip.hpp"
+#include <algorithm>
+#include <cmath>
+
+// Number of keyframes the cursor may step forward before falling back to a binary search.
+constexpr int MAX_CURSOR_STEPS = 4;
+constexpr float VECTOR_QUANTIZATION_STEPS = 65535.0f;
+constexpr float ROTATION_QUANTIZATION_STEPS = 32767.0f;
+// Bound of the three smallest components of a unit quaternion.
+constexpr float ROTATION_COMPONENT_BOUND = 0.70710678f;
+
+// Find the index i such that keyframes i and i + 1 enclose t, clamped to the first and last pair.
+// The cursor holds the previous result: forward playback only steps it ahead, seeks and loops binary search.
+int findKeyframe(const std::vector<float>& times, double t, int& cursor) {
+	int last = (int)times.size() - 2;
+	int i = std::min(cursor, last);
+
+	// Every pair before the cursor ends at or before t, so the answer can't be behind it.
+	if (i == 0 || times[i] <= t) {
+		for (int steps = 0; i < last && times[i + 1] <= t; steps++) {
+			if (steps == MAX_CURSOR_STEPS) {
+				i = -1;
+				break;
+			}
+			i++;
+		}
+	}
+	else {
+		i = -1;
+	}
+
+	if (i < 0) {
+		auto after = std::upper_bound(times.begin(), times.end(), t, [](double time, float key) { return time < key; });
+		i = glm::clamp((int)(after - times.begin()) - 1, 0, last);
+	}
+
+	cursor = i;
+	return i;
+}
+
+float keyframeFactor(double start, double end, double t) {
+	if (end <= start) return t >= end ? 1.0f : 0.0f;
+	return glm::clamp((t - start) / (end - start), 0.0, 1.0);
+}
+
+glm::vec3 CompressedVectorTrack::decode(int key) const {
+	const uint16_t* v = &values[key * 3];
+	return minimum + range * (glm::vec3(v[0], v[1], v[2]) / VECTOR_QUANTIZATION_STEPS);
+}
+
+glm::vec3 CompressedVectorTrack::sample(double t, int& cursor) const {
+	if (times.size() <= 1) return minimum;
+
+	int i = findKeyframe(times, t, cursor);
+	float fac = keyframeFactor(times[i], times[i + 1], t);
+	return (1.0f - fac) * decode(i) + fac * decode(i + 1);
+}
+
+glm::quat CompressedRotationTrack::decode(int key) const {
+	const uint16_t* v = &values[key * 3];
+	int largest = ((v[0] >> 15) << 1) | (v[1] >> 15);
+
+	float small[3];
+	float sumOfSquares = 0.0f;
+	for (int j = 0; j < 3; j++) {
+		small[j] = ((v[j] & 0x7fff) / ROTATION_QUANTIZATION_STEPS * 2.0f - 1.0f) * ROTATION_COMPONENT_BOUND;
+		sumOfSquares += small[j] * small[j];
+	}
+
+	float components[4];
+	for (int i = 0, j = 0; i < 4; i++) {
+		components[i] = i == largest ? std::sqrt(std::max(0.0f, 1.0f - sumOfSquares)) : small[j++];
+	}
+
+	return glm::quat(components[3], components[0], components[1], components[2]);
+}
+
+glm::quat CompressedRotationTrack::sample(double t, int& cursor) const {
+	if (times.empty()) return glm::quat(1, 0, 0, 0);
+	if (times.size() == 1) return decode(0);
+
+	int i = findKeyframe(times, t, cursor);
+	float fac = keyframeFactor(times[i], times[i + 1], t);
+	return glm::slerp(decode(i), decode(i + 1), fac);
+}
+
+void encodeRotation(glm::quat q, uint16_t* out) {
+	q = glm::normalize(q);
+	float components[4] = { q.x, q.y, q.z, q.w };
+
+	int largest = 0;
+	for (int i = 1; i < 4; i++) {
+		if (std::abs(components[i]) > std::abs(components[largest])) largest = i;
+	}
+
+	// q and -q are the same rotation, so flip the sign to make the dropped component positive.
+	float sign = components[largest] < 0.0f ? -1.0f : 1.0f;
+
+	uint16_t small[3];
+	for (int i = 0, j = 0; i < 4; i++) {
+		if (i == largest) continue;
+		float normalized = (sign * components[i] / ROTATION_COMPONENT_BOUND + 1.0f) * 0.5f;
+		small[j++] = (uint16_t)std::lround(glm::clamp(normalized, 0.0f, 1.0f) * ROTATION_QUANTIZATION_STEPS);
+	}
+
+	out[0] = small[0] | ((largest >> 1) << 15);
+	out[1] = small[1] | ((largest & 1) << 15);
+	out[2] = small[2];
+}
+
+// Angle between two rotations. Uses the chord length, since acos of the dot product is too imprecise near zero.
+float rotationDistance(const glm::quat& a, glm::quat b) {
+	if (glm::dot(a, b) < 0.0f) b = -b;
+	float chord = std::sqrt((a.x - b.x) * (a.x - b.x) + (a.y - b.y) * (a.y - b.y) + (a.z - b.z) * (a.z - b.z) + (a.w - b.w) * (a.w - b.w));
+	return 4.0f * std::asin(glm::min(1.0f, 0.5f * chord));
+}
+
+// Greedily pick the keys to keep so that interpolating between kept keys reproduces every dropped key within the tolerance.
+template<typename T, typename Interpolate, typename Distance>
+std::vector<int> reduceKeyframes(const std::vector<std::pair<double, T>>& frames, float tolerance, Interpolate interpolate, Distance distance) {
+	std::vector<int> kept;
+	int count = (int)frames.size();
+	if (count == 0) return kept;
+
+	kept.push_back(0);
+
+	bool constant = true;
+	for (int k = 1; k < count && constant; k++) {
+		constant = distance(frames[k].second, frames[0].second) <= tolerance;
+	}
+	if (constant) return kept;
+
+	int start = 0;
+	for (int end = 2; end < count; end++) {
+		for (int k = start + 1; k < end; k++) {
+			float fac = keyframeFactor(frames[start].first, frames[end].first, frames[k].first);
+			if (distance(interpolate(frames[start].second, frames[end].second, fac), frames[k].second) > tolerance) {
+				kept.push_back(end - 1);
+				start = end - 1;
+				break;
+			}
+		}
+	}
+
+	kept.push_back(count - 1);
+	return kept;
+}
+
+CompressedVectorTrack compressVectorTrack(const std::vector<std::pair<double, glm::vec3>>& frames, float tolerance, glm::vec3 emptyValue, ClipCompressionStats& stats, float& maxError) {
+	CompressedVectorTrack track{ emptyValue, glm::vec3(0.0f) };
+
+	std::vector<int> kept = reduceKeyframes(frames, tolerance,
+		[](const glm::vec3& a, const glm::vec3& b, float fac) { return (1.0f - fac) * a + fac * b; },
+		[](const glm::vec3& a, const glm::vec3& b) { return glm::length(a - b); });
+
+	if (!kept.empty()) {
+		glm::vec3 maximum = frames[kept[0]].second;
+		track.minimum = maximum;
+		for (int k : kept) {
+			track.minimum = glm::min(track.minimum, frames[k].second);
+			maximum = glm::max(maximum, frames[k].second);
+		}
+		track.range = maximum - track.minimum;
+	}
+
+	for (int k : kept) {
+		track.times.push_back((float)frames[k].first);
+		for (int c = 0; c < 3; c++) {
+			float normalized = track.range[c] > 0.0f ? (frames[k].second[c] - track.minimum[c]) / track.range[c] : 0.0f;
+			track.values.push_back((uint16_t)std::lround(glm::clamp(normalized, 0.0f, 1.0f) * VECTOR_QUANTIZATION_STEPS));
+		}
+	}
+
+	int cursor = 0;
+	for (const auto& frame : frames) {
+		maxError = glm::max(maxError, glm::length(track.sample(frame.first, cursor) - frame.second));
+	}
+
+	stats.keysBefore += frames.size();
+	stats.keysAfter += track.times.size();
+	stats.bytesBefore += frames.size() * sizeof(frames[0]);
+	stats.bytesAfter += sizeof(track.minimum) + sizeof(track.range) + track.times.size() * sizeof(float) + track.values.size() * sizeof(uint16_t);
+	return track;
+}
+
+CompressedRotationTrack compressRotationTrack(const std::vector<std::pair<double, glm::quat>>& frames, float tolerance, ClipCompressionStats& stats, float& maxError) {
+	CompressedRotationTrack track;
+
+	std::vector<int> kept = reduceKeyframes(frames, tolerance,
+		[](const glm::quat& a, const glm::quat& b, float fac) { return glm::slerp(a, b, fac); },
+		rotationDistance);
+
+	for (int k : kept) {
+		track.times.push_back((float)frames[k].first);
+		track.values.resize(track.values.size() + 3);
+		encodeRotation(frames[k].second, &track.values[track.values.size() - 3]);
+	}
+
+	int cursor = 0;
+	for (const auto& frame : frames) {
+		maxError = glm::max(maxError, rotationDistance(track.sample(frame.first, cursor), glm::normalize(frame.second)));
+	}
+
+	stats.keysBefore += frames.size();
+	stats.keysAfter += track.times.size();
+	stats.bytesBefore += frames.size() * sizeof(frames[0]);
+	stats.bytesAfter += track.times.size() * sizeof(float) + track.values.size() * sizeof(uint16_t);
+	return track;
+}
+
+CompressedBoneClip compressClip(const BoneClip& clip, const ClipCompressionSettings& settings, ClipCompressionStats& stats) {
+	return {
+		clip.boneIndex,
+		compressVectorTrack(clip.positionFrames, settings.positionTolerance, glm::vec3(0.0f), stats, stats.maxPositionError),
+		compressVectorTrack(clip.scaleFrames, settings.scaleTolerance, glm::vec3(1.0f), stats, stats.maxScaleError),
+		compressRotationTrack(clip.rotationFrames, settings.rotationTolerance, stats, stats.maxRotationError)
+	};
+}
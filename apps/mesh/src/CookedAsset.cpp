@@ -0,0 +1,69 @@
+#include "CookedAsset.hpp"
+
+#include <atomic>
+#include <filesystem>
+#include <fstream>
+#include <spdlog/spdlog.h>
+
+#ifdef _WIN32
+#include <process.h>
+#define getpid _getpid
+#else
+#include <unistd.h>
+#endif
+
+// FNV-1a over 64-bit words rather than bytes, which is fast enough to hash large sources on every load.
+uint64_t cookedSourceHash(const unsigned char* source, size_t size, uint64_t settings) {
+	uint64_t hash = 14695981039346656037ull;
+	auto add = [&hash](uint64_t word) {
+		hash = (hash ^ word) * 1099511628211ull;
+	};
+
+	add(settings);
+	add(size);
+
+	size_t words = size / sizeof(uint64_t);
+	for (size_t i = 0; i < words; i++) {
+		uint64_t word;
+		memcpy(&word, source + i * sizeof(uint64_t), sizeof(word));
+		add(word);
+	}
+	for (size_t i = words * sizeof(uint64_t); i < size; i++) {
+		add(source[i]);
+	}
+
+	return hash;
+}
+
+bool cookedHeaderMatches(const unsigned char* data, size_t size, const char magic[4], uint32_t version, uint64_t sourceHash) {
+	CookedHeader header;
+	if (size < sizeof(header)) return false;
+	memcpy(&header, data, sizeof(header));
+	return memcmp(header.magic, magic, sizeof(header.magic)) == 0 && header.version == version && header.sourceHash == sourceHash;
+}
+
+bool writeCookedFile(const std::string& path, const std::vector<unsigned char>& bytes) {
+	std::error_code error;
+	std::filesystem::create_directories(std::filesystem::path(path).parent_path(), error);
+
+	// Unique per process and write, since the cooker and a running app, or two loader threads, may cook the same asset
+	// at once.
+	static std::atomic<uint32_t> writeCount{ 0 };
+	std::string temporaryPath = fmt::format("{}.{}.{}.tmp", path, (long)getpid(), writeCount++);
+	{
+		std::ofstream file(temporaryPath, std::ios::binary);
+		file.write((const char*)bytes.data(), bytes.size());
+		if (file.fail()) {
+			spdlog::warn("Cannot write cooked file {}", path);
+			return false;
+		}
+	}
+
+	std::filesystem::rename(temporaryPath, path, error);
+	if (error) {
+		spdlog::warn("Cannot write cooked file {}: {}", path, error.message());
+		std::filesystem::remove(temporaryPath, error);
+		return false;
+	}
+	return true;
+}
@@ -0,0 +1,230 @@
+#include "CookedTexture.hpp"
+
+#include <algorithm>
+#include <spdlog/spdlog.h>
+#include <stb_image.h>
+
+#include "CookedAsset.hpp"
+#include "fetch.hpp"
+#include "TextureCompression.hpp"
+
+// Layout of a cooked texture, after the header: the size of each level, then the aligned pixels or blocks of each level.
+struct CookedTextureHeader {
+	CookedHeader common;
+	uint32_t channels;
+	uint32_t format;
+	uint32_t levelCount;
+};
+
+// Bytes of a level in a format
+static size_t levelSize(CookedTextureFormat format, uint32_t channels, uint32_t width, uint32_t height) {
+	if (format == CookedTextureFormat::Raw) return (size_t)width * height * channels;
+	return etc2ImageSize(width, height, channels);
+}
+
+uint64_t cookedTextureSourceHash(const unsigned char* source, size_t size) {
+	return cookedSourceHash(source, size, COOKED_TEXTURE_VERSION);
+}
+
+// Average 2x2 blocks of the previous level. Odd sizes repeat the last row or column.
+static void downsample(const CookedTextureLevel& source, const CookedTextureLevel& destination, uint32_t channels, unsigned char* pixels) {
+	for (uint32_t y = 0; y < destination.height; y++) {
+		uint32_t y0 = std::min(y * 2, source.height - 1);
+		uint32_t y1 = std::min(y * 2 + 1, source.height - 1);
+		for (uint32_t x = 0; x < destination.width; x++) {
+			uint32_t x0 = std::min(x * 2, source.width - 1);
+			uint32_t x1 = std::min(x * 2 + 1, source.width - 1);
+			for (uint32_t c = 0; c < channels; c++) {
+				uint32_t sum =
+					source.pixels[(y0 * source.width + x0) * channels + c] +
+					source.pixels[(y0 * source.width + x1) * channels + c] +
+					source.pixels[(y1 * source.width + x0) * channels + c] +
+					source.pixels[(y1 * source.width + x1) * channels + c];
+				pixels[(y * destination.width + x) * channels + c] = (sum + 2) / 4;
+			}
+		}
+	}
+}
+
+bool cookTexture(const unsigned char* source, size_t size, CookedTexture& texture) {
+	int width, height, channels;
+	stbi_uc* image = stbi_load_from_memory(source, size, &width, &height, &channels, 0);
+	if (image == nullptr) {
+		spdlog::critical("Failed to decode image: {}", stbi_failure_reason());
+		return false;
+	}
+
+	texture = CookedTexture();
+	texture.channels = channels;
+
+	// Size every level first, so the storage doesn't move once the levels point into it.
+	std::vector<size_t> offsets;
+	size_t total = 0;
+	uint32_t levelWidth = width, levelHeight = height;
+	while (true) {
+		size_t size = (size_t)levelWidth * levelHeight * channels;
+		texture.levels.push_back({ levelWidth, levelHeight, nullptr, size });
+		offsets.push_back(total);
+		total += size;
+		if (levelWidth == 1 && levelHeight == 1) break;
+		levelWidth = std::max(1u, levelWidth / 2);
+		levelHeight = std::max(1u, levelHeight / 2);
+	}
+
+	texture.storage.resize(total);
+	std::copy(image, image + (size_t)width * height * channels, texture.storage.begin());
+	stbi_image_free(image);
+
+	for (size_t i = 0; i < texture.levels.size(); i++) {
+		texture.levels[i].pixels = texture.storage.data() + offsets[i];
+		if (i > 0) {
+			downsample(texture.levels[i - 1], texture.levels[i], channels, texture.storage.data() + offsets[i]);
+		}
+	}
+
+	return true;
+}
+
+// Lay out levels of the same sizes in a new format in one storage, then fill each from the matching source level.
+// The destination can be the source, which is only replaced once every level is converted.
+template <typename Convert>
+static void convertLevels(const CookedTexture& source, CookedTextureFormat format, CookedTexture& destination, Convert convert) {
+	std::vector<CookedTextureLevel> levels = source.levels;
+	size_t total = 0;
+	for (CookedTextureLevel& level : levels) {
+		level.size = levelSize(format, source.channels, level.width, level.height);
+		total += level.size;
+	}
+
+	std::vector<unsigned char> storage(total);
+	size_t offset = 0;
+	for (size_t i = 0; i < levels.size(); i++) {
+		levels[i].pixels = storage.data() + offset;
+		convert(source.levels[i], storage.data() + offset);
+		offset += levels[i].size;
+	}
+
+	destination.channels = source.channels;
+	destination.format = format;
+	destination.levels = std::move(levels);
+	destination.storage = std::move(storage);
+	destination.cookedFile.reset();
+}
+
+void compressTexture(CookedTexture& texture) {
+	if (texture.format != CookedTextureFormat::Raw || texture.channels < 3) return;
+
+	uint32_t channels = texture.channels;
+	CookedTextureFormat format = channels == 4 ? CookedTextureFormat::Etc2Rgba : CookedTextureFormat::Etc2Rgb;
+	convertLevels(texture, format, texture, [channels](const CookedTextureLevel& level, unsigned char* blocks) {
+		compressEtc2Image(level.pixels, level.width, level.height, channels, blocks);
+	});
+}
+
+bool decompressTexture(const CookedTexture& texture, CookedTexture& raw) {
+	if (texture.format == CookedTextureFormat::Raw) return false;
+
+	bool decoded = true;
+	uint32_t channels = texture.channels;
+	convertLevels(texture, CookedTextureFormat::Raw, raw, [channels, &decoded](const CookedTextureLevel& level, unsigned char* pixels) {
+		decoded = decompressEtc2Image(level.pixels, level.width, level.height, channels, pixels) && decoded;
+	});
+	return decoded;
+}
+
+bool writeCookedTexture(const std::string& path, const CookedTexture& texture, uint64_t sourceHash) {
+	CookedWriter writer;
+
+	CookedTextureHeader header{};
+	memcpy(header.common.magic, COOKED_TEXTURE_MAGIC, sizeof(header.common.magic));
+	header.common.version = COOKED_TEXTURE_VERSION;
+	header.common.sourceHash = sourceHash;
+	header.channels = texture.channels;
+	header.format = (uint32_t)texture.format;
+	header.levelCount = texture.levels.size();
+	writer.write(header);
+
+	for (const CookedTextureLevel& level : texture.levels) {
+		writer.write(level.width);
+		writer.write(level.height);
+	}
+	for (const CookedTextureLevel& level : texture.levels) {
+		writer.writeArray(level.pixels, level.size);
+	}
+
+	return writeCookedFile(path, writer.buffer());
+}
+
+bool readCookedTexture(const unsigned char* bytes, size_t size, std::optional<uint64_t> sourceHash, CookedTexture& texture) {
+	CookedReader reader(bytes, size);
+
+	CookedTextureHeader header;
+	if (!reader.read(header) ||
+		memcmp(header.common.magic, COOKED_TEXTURE_MAGIC, sizeof(header.common.magic)) != 0 ||
+		header.common.version != COOKED_TEXTURE_VERSION ||
+		(sourceHash && header.common.sourceHash != *sourceHash) ||
+		header.channels < 1 || header.channels > 4 || header.levelCount > 32) {
+		return false;
+	}
+
+	CookedTextureFormat format = (CookedTextureFormat)header.format;
+	bool formatMatches =
+		format == CookedTextureFormat::Raw ||
+		(format == CookedTextureFormat::Etc2Rgb && header.channels == 3) ||
+		(format == CookedTextureFormat::Etc2Rgba && header.channels == 4);
+	if (!formatMatches) return false;
+
+	texture = CookedTexture();
+	texture.channels = header.channels;
+	texture.format = format;
+	texture.levels.resize(header.levelCount);
+	for (CookedTextureLevel& level : texture.levels) {
+		if (!reader.read(level.width) || !reader.read(level.height)) return false;
+		level.size = levelSize(format, header.channels, level.width, level.height);
+	}
+	for (CookedTextureLevel& level : texture.levels) {
+		if (!reader.view(level.pixels, level.size)) return false;
+	}
+
+	return !texture.levels.empty();
+}
+
+#ifndef __EMSCRIPTEN__
+
+bool loadTexture(const std::string& sourcePath, const std::string& cookedPath, bool etc2Supported, CookedTexture& texture) {
+	FetchedData source;
+	if (!source.map(sourcePath)) {
+		spdlog::critical("File {} not found!", sourcePath);
+		return false;
+	}
+	uint64_t sourceHash = cookedTextureSourceHash(source.data(), source.size());
+
+	if (!cookedPath.empty()) {
+		auto cooked = std::make_shared<FetchedData>();
+		if (cooked->map(cookedPath) && readCookedTexture(cooked->data(), cooked->size(), sourceHash, texture)) {
+			texture.cookedFile = cooked;
+			if (etc2Supported || texture.format == CookedTextureFormat::Raw) return true;
+
+			// Made by the asset cooker for contexts with ETC2. Decoding here keeps it off the frame.
+			CookedTexture raw;
+			if (decompressTexture(texture, raw)) {
+				texture = std::move(raw);
+				return true;
+			}
+			spdlog::warn("Failed to decompress cooked texture {}, cooking it again", cookedPath);
+		}
+	}
+
+	if (!cookTexture(source.data(), source.size(), texture)) {
+		spdlog::critical("Failed to load image {}", sourcePath);
+		return false;
+	}
+
+	if (!cookedPath.empty()) {
+		if (etc2Supported) compressTexture(texture);
+		if (writeCookedTexture(cookedPath, texture, sourceHash)) spdlog::info("Wrote cooked texture {}", cookedPath);
+	}
+	return true;
+}
+
+#endif
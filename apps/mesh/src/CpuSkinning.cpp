@@ -0,0 +1,120 @@
+#include "CpuSkinning.hpp"
+
+#include <cstring>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__wasm_simd128__)
+#include <wasm_simd128.h>
+#endif
+
+// Four floats, one matrix column or one transformed vector. Each vertex blends its four matrices column by column, as
+// every vertex reads different matrices and gathering them across vertices would cost more than it saves.
+#if defined(__SSE2__)
+using Vec4 = __m128;
+static inline Vec4 load4(const float* p) { return _mm_loadu_ps(p); }
+static inline void store4(float* p, Vec4 a) { _mm_storeu_ps(p, a); }
+static inline Vec4 splat(float x) { return _mm_set1_ps(x); }
+static inline Vec4 add(Vec4 a, Vec4 b) { return _mm_add_ps(a, b); }
+static inline Vec4 mul(Vec4 a, Vec4 b) { return _mm_mul_ps(a, b); }
+#elif defined(__wasm_simd128__)
+using Vec4 = v128_t;
+static inline Vec4 load4(const float* p) { return wasm_v128_load(p); }
+static inline void store4(float* p, Vec4 a) { wasm_v128_store(p, a); }
+static inline Vec4 splat(float x) { return wasm_f32x4_splat(x); }
+static inline Vec4 add(Vec4 a, Vec4 b) { return wasm_f32x4_add(a, b); }
+static inline Vec4 mul(Vec4 a, Vec4 b) { return wasm_f32x4_mul(a, b); }
+#else
+using Vec4 = glm::vec4;
+static inline Vec4 load4(const float* p) { Vec4 a; memcpy(&a, p, sizeof(a)); return a; }
+static inline void store4(float* p, Vec4 a) { memcpy(p, &a, sizeof(a)); }
+static inline Vec4 splat(float x) { return Vec4(x); }
+static inline Vec4 add(Vec4 a, Vec4 b) { return a + b; }
+static inline Vec4 mul(Vec4 a, Vec4 b) { return a * b; }
+#endif
+
+// Columns of the weighted sum of the four skinning matrices of a vertex
+struct BlendedMatrix {
+	Vec4 columns[4];
+};
+
+static inline BlendedMatrix blendMatrices(const SkinningStreams& streams, const glm::mat4* skinningMatrices, uint32_t vertex) {
+	BlendedMatrix blended;
+#if defined(__AVX2__)
+	// Two columns per register halves the multiplies and adds of the blend.
+	__m256 columns01 = _mm256_setzero_ps(), columns23 = _mm256_setzero_ps();
+	for (int i = 0; i < 4; i++) {
+		const float* matrix = &skinningMatrices[streams.bone[i][vertex]][0][0];
+		__m256 weight = _mm256_set1_ps(streams.weight[i][vertex]);
+#if defined(__FMA__)
+		columns01 = _mm256_fmadd_ps(_mm256_loadu_ps(matrix), weight, columns01);
+		columns23 = _mm256_fmadd_ps(_mm256_loadu_ps(matrix + 8), weight, columns23);
+#else
+		columns01 = _mm256_add_ps(columns01, _mm256_mul_ps(_mm256_loadu_ps(matrix), weight));
+		columns23 = _mm256_add_ps(columns23, _mm256_mul_ps(_mm256_loadu_ps(matrix + 8), weight));
+#endif
+	}
+	blended.columns[0] = _mm256_castps256_ps128(columns01);
+	blended.columns[1] = _mm256_extractf128_ps(columns01, 1);
+	blended.columns[2] = _mm256_castps256_ps128(columns23);
+	blended.columns[3] = _mm256_extractf128_ps(columns23, 1);
+#else
+	for (int c = 0; c < 4; c++) blended.columns[c] = splat(0.0f);
+	for (int i = 0; i < 4; i++) {
+		const float* matrix = &skinningMatrices[streams.bone[i][vertex]][0][0];
+		Vec4 weight = splat(streams.weight[i][vertex]);
+		for (int c = 0; c < 4; c++) blended.columns[c] = add(blended.columns[c], mul(load4(matrix + 4 * c), weight));
+	}
+#endif
+	return blended;
+}
+
+void SkinningStreams::append(const SkinnedVertex* vertices, uint32_t count) {
+	for (uint32_t i = 0; i < count; i++) {
+		const SkinnedVertex& vertex = vertices[i];
+		positionX.push_back(vertex.position.x);
+		positionY.push_back(vertex.position.y);
+		positionZ.push_back(vertex.position.z);
+		normalX.push_back(vertex.normal.x);
+		normalY.push_back(vertex.normal.y);
+		normalZ.push_back(vertex.normal.z);
+		u.push_back(vertex.uv.x);
+		v.push_back(vertex.uv.y);
+		for (int k = 0; k < 4; k++) {
+			bone[k].push_back(vertex.bone[k]);
+			weight[k].push_back(vertex.influence[k]);
+		}
+	}
+}
+
+void skinVertices(const SkinningStreams& streams, const glm::mat4* skinningMatrices, uint32_t begin, uint32_t end, float* output) {
+	for (uint32_t vertex = begin; vertex < end; vertex++) {
+		BlendedMatrix m = blendMatrices(streams, skinningMatrices, vertex);
+
+		Vec4 position = add(add(mul(m.columns[0], splat(streams.positionX[vertex])), mul(m.columns[1], splat(streams.positionY[vertex]))),
+			add(mul(m.columns[2], splat(streams.positionZ[vertex])), m.columns[3]));
+		Vec4 normal = add(add(mul(m.columns[0], splat(streams.normalX[vertex])), mul(m.columns[1], splat(streams.normalY[vertex]))),
+			mul(m.columns[2], splat(streams.normalZ[vertex])));
+
+		// Each store writes a fourth float that the next one replaces.
+		float* destination = output + (size_t)vertex * CPU_SKINNED_VERTEX_FLOATS;
+		store4(destination, position);
+		store4(destination + 3, normal);
+		destination[6] = streams.u[vertex];
+		destination[7] = streams.v[vertex];
+	}
+}
+
+const char* skinningInstructionSet() {
+#if defined(__AVX2__)
+	return "AVX2";
+#elif defined(__SSE2__)
+	return "SSE2";
+#elif defined(__wasm_simd128__)
+	return "WASM SIMD128";
+#else
+	return "scalar";
+#endif
+}
@@ -0,0 +1,209 @@
+#include "GeometryArena.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <vector>
+#include <spdlog/spdlog.h>
+
+// Smallest buffers an arena creates, so that loading a few small meshes doesn't grow them every time
+constexpr uint32_t MIN_ARENA_VERTICES = 1 << 16;
+constexpr uint32_t MIN_ARENA_INDEX_UNITS = 1 << 19;
+// Largest buffer an arena grows to, in bytes. Well within what drivers allow, and small enough that element counts
+// stay in 32 bits.
+constexpr uint64_t MAX_ARENA_BUFFER_SIZE = 1ull << 30;
+
+FreeListAllocator::FreeListAllocator(uint32_t capacity) : mCapacity(capacity) {
+	if (capacity > 0) mFree[0] = capacity;
+}
+
+std::optional<uint32_t> FreeListAllocator::allocate(uint32_t count, uint32_t alignment) {
+	if (count == 0) return 0;
+
+	for (auto range = mFree.begin(); range != mFree.end(); ++range) {
+		uint32_t offset = range->first, length = range->second;
+		uint32_t aligned = (offset + alignment - 1) / alignment * alignment;
+		if (length < aligned - offset + count) continue;
+
+		// The padding before the aligned offset and the rest after the range stay free.
+		mFree.erase(range);
+		if (aligned > offset) mFree[offset] = aligned - offset;
+		uint32_t remaining = offset + length - (aligned + count);
+		if (remaining > 0) mFree[aligned + count] = remaining;
+		mUsed += count;
+		return aligned;
+	}
+	return std::nullopt;
+}
+
+void FreeListAllocator::free(uint32_t offset, uint32_t count) {
+	if (count == 0) return;
+	mUsed -= count;
+
+	auto next = mFree.lower_bound(offset);
+	if (next != mFree.end() && offset + count == next->first) {
+		count += next->second;
+		next = mFree.erase(next);
+	}
+	if (next != mFree.begin()) {
+		auto previous = std::prev(next);
+		if (previous->first + previous->second == offset) {
+			previous->second += count;
+			return;
+		}
+	}
+	mFree[offset] = count;
+}
+
+void FreeListAllocator::grow(uint32_t capacity) {
+	if (capacity <= mCapacity) return;
+
+	uint32_t end = freeAtEnd();
+	mFree[mCapacity - end] = end + capacity - mCapacity;
+	mCapacity = capacity;
+}
+
+uint32_t FreeListAllocator::freeAtEnd() const {
+	if (mFree.empty()) return 0;
+	auto last = std::prev(mFree.end());
+	return last->first + last->second == mCapacity ? last->second : 0;
+}
+
+GeometryArena::GeometryArena(GLsizei vertexSize, std::function<void()> setVertexLayout) :
+	mVertexSize(vertexSize), mSetVertexLayout(std::move(setVertexLayout)) {
+#ifdef __EMSCRIPTEN__
+	mBaseVertex = false;
+#else
+	mBaseVertex = GLAD_GL_VERSION_3_2 || GLAD_GL_ARB_draw_elements_base_vertex;
+#endif
+	glGenVertexArrays(1, &mVertexArray);
+}
+
+GeometryArena::~GeometryArena() {
+	glDeleteVertexArrays(1, &mVertexArray);
+	glDeleteBuffers(1, &mVertexBuffer);
+	glDeleteBuffers(1, &mIndexBuffer);
+}
+
+std::optional<uint32_t> GeometryArena::reserve(GLuint& buffer, FreeListAllocator& allocator, GLsizeiptr elementSize, uint32_t count, uint32_t alignment, uint32_t minimumCapacity) {
+	if (std::optional<uint32_t> offset = allocator.allocate(count, alignment)) return offset;
+
+	// Double until the free range at the end fits, so a stream of loads grows the buffer a logarithmic number of times.
+	// Sizes are 64-bit so that a large request can't wrap around.
+	uint64_t oldCapacity = allocator.capacity();
+	uint64_t needed = (uint64_t)count + alignment - 1;
+	uint64_t capacity = std::max<uint64_t>(oldCapacity, minimumCapacity);
+	while (allocator.freeAtEnd() + (capacity - oldCapacity) < needed) capacity *= 2;
+
+	uint64_t maxCapacity = MAX_ARENA_BUFFER_SIZE / elementSize;
+	if (capacity > maxCapacity) {
+		capacity = maxCapacity;
+		if (allocator.freeAtEnd() + (capacity - oldCapacity) < needed) {
+			spdlog::critical("Geometry arena can't fit {} more elements of {} bytes within {} MB", count, elementSize, MAX_ARENA_BUFFER_SIZE >> 20);
+			return std::nullopt;
+		}
+	}
+
+	// The copy targets leave the arena's vertex array and whatever else is bound untouched.
+	GLuint grown;
+	glGenBuffers(1, &grown);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, grown);
+	glBufferData(GL_COPY_WRITE_BUFFER, capacity * elementSize, nullptr, GL_STATIC_DRAW);
+	if (buffer != 0) {
+		glBindBuffer(GL_COPY_READ_BUFFER, buffer);
+		glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, oldCapacity * elementSize);
+		glDeleteBuffers(1, &buffer);
+	}
+	buffer = grown;
+
+	allocator.grow(capacity);
+	spdlog::info("Geometry arena buffer grown to {} KB", capacity * elementSize / 1024);
+	return allocator.allocate(count, alignment);
+}
+
+std::optional<GeometryAllocation> GeometryArena::allocate(const void* vertices, uint32_t vertexCount, const void* indices, uint32_t indexCount, GLenum indexType) {
+	GLuint vertexBuffer = mVertexBuffer, indexBuffer = mIndexBuffer;
+
+	GeometryAllocation allocation;
+	allocation.vertexCount = vertexCount;
+	std::optional<uint32_t> firstVertex = reserve(mVertexBuffer, mVertices, mVertexSize, vertexCount, 1, MIN_ARENA_VERTICES);
+	if (!firstVertex) return std::nullopt;
+	allocation.firstVertex = *firstVertex;
+
+	// Without base vertex draws the first vertex is added to the indices here, as 32-bit if 16 bits can't hold them.
+	// 0xffff stays out of 16-bit indices, as WebGL always treats it as a primitive restart.
+	std::vector<uint32_t> rebased;
+	std::vector<uint16_t> rebasedShort;
+	if (!mBaseVertex && allocation.firstVertex > 0) {
+		rebased.resize(indexCount);
+		for (uint32_t i = 0; i < indexCount; i++) {
+			uint32_t index = indexType == GL_UNSIGNED_SHORT ? ((const uint16_t*)indices)[i] : ((const uint32_t*)indices)[i];
+			rebased[i] = index + allocation.firstVertex;
+		}
+		if (indexType == GL_UNSIGNED_SHORT && allocation.firstVertex + vertexCount <= 0xffff) {
+			rebasedShort.assign(rebased.begin(), rebased.end());
+			indices = rebasedShort.data();
+		}
+		else {
+			indexType = GL_UNSIGNED_INT;
+			indices = rebased.data();
+		}
+	}
+
+	uint32_t unitsPerIndex = indexType == GL_UNSIGNED_SHORT ? 1 : 2;
+	allocation.indexType = indexType;
+	allocation.indexCount = indexCount;
+	std::optional<uint32_t> firstIndexUnit;
+	if ((uint64_t)indexCount * unitsPerIndex <= UINT32_MAX) {
+		firstIndexUnit = reserve(mIndexBuffer, mIndexUnits, sizeof(uint16_t), indexCount * unitsPerIndex, unitsPerIndex, MIN_ARENA_INDEX_UNITS);
+	}
+
+	// A replaced buffer has to be attached to the vertex array again, even if the indices didn't fit.
+	if (mVertexBuffer != vertexBuffer || mIndexBuffer != indexBuffer) {
+		glBindVertexArray(mVertexArray);
+		glBindBuffer(GL_ARRAY_BUFFER, mVertexBuffer);
+		mSetVertexLayout();
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mIndexBuffer);
+		glBindVertexArray(0);
+	}
+
+	if (!firstIndexUnit) {
+		mVertices.free(allocation.firstVertex, vertexCount);
+		return std::nullopt;
+	}
+	allocation.firstIndex = *firstIndexUnit / unitsPerIndex;
+
+	glBindBuffer(GL_COPY_WRITE_BUFFER, mVertexBuffer);
+	glBufferSubData(GL_COPY_WRITE_BUFFER, (GLintptr)allocation.firstVertex * mVertexSize, (GLsizeiptr)vertexCount * mVertexSize, vertices);
+
+	GLsizeiptr indexSize = unitsPerIndex * sizeof(uint16_t);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, mIndexBuffer);
+	glBufferSubData(GL_COPY_WRITE_BUFFER, (GLintptr)allocation.firstIndex * indexSize, (GLsizeiptr)indexCount * indexSize, indices);
+
+	return allocation;
+}
+
+void GeometryArena::free(const GeometryAllocation& allocation) {
+	uint32_t unitsPerIndex = allocation.indexType == GL_UNSIGNED_SHORT ? 1 : 2;
+	mVertices.free(allocation.firstVertex, allocation.vertexCount);
+	mIndexUnits.free(allocation.firstIndex * unitsPerIndex, allocation.indexCount * unitsPerIndex);
+}
+
+void GeometryArena::bind() const {
+	glBindVertexArray(mVertexArray);
+}
+
+void GeometryArena::drawInstanced(const GeometryAllocation& allocation, GLsizei instanceCount) const {
+	drawInstanced(allocation, 0, allocation.indexCount, instanceCount);
+}
+
+void GeometryArena::drawInstanced(const GeometryAllocation& allocation, uint32_t firstIndex, uint32_t indexCount, GLsizei instanceCount) const {
+	size_t indexSize = allocation.indexType == GL_UNSIGNED_SHORT ? sizeof(uint16_t) : sizeof(uint32_t);
+	const void* offset = (const void*)((uintptr_t)(allocation.firstIndex + firstIndex) * indexSize);
+#ifndef __EMSCRIPTEN__
+	if (mBaseVertex) {
+		glDrawElementsInstancedBaseVertex(GL_TRIANGLES, indexCount, allocation.indexType, offset, instanceCount, allocation.firstVertex);
+		return;
+	}
+#endif
+	glDrawElementsInstanced(GL_TRIANGLES, indexCount, allocation.indexType, offset, instanceCount);
+}
@@ -1,79 +1,428 @@
 #include "MaterialManager.hpp"
 
 #include <fetch.hpp>
+#include <algorithm>
+#include <memory>
 #include <unordered_map>
 #include <string>
+#include <vector>
 #include <spdlog/spdlog.h>
 
+#include "CookedTexture.hpp"
+
+// Core in GLES 3.0 and desktop GL 4.3, and in WebGL2 through WEBGL_compressed_texture_etc
+#ifndef GL_COMPRESSED_RGB8_ETC2
+#define GL_COMPRESSED_RGB8_ETC2 0x9274
+#endif
+#ifndef GL_COMPRESSED_RGBA8_ETC2_EAC
+#define GL_COMPRESSED_RGBA8_ETC2_EAC 0x9278
+#endif
+
 MaterialManager* globalMaterialManager;
 
-GLuint MaterialManager::getTexture(std::string path) {
-	if (mTextures.find(path) == mTextures.end()) {
-		GLuint texture;
-
-		// Write texture to the GPU
-		glGenTextures(1, &texture);
-		mTextures[path] = texture;
-
-		// This should happen between two frames in an async runtime, and will be synchronous in native.
-		fetch_image("", path, [texture](unsigned char* data, int width, int height, int channels) {
-			GLenum format;
-
-			// Set the Correct Channel Format
-			switch (channels)
-			{
-			case 1: format = GL_ALPHA;     break;
-			case 2: format = GL_LUMINANCE; break;
-			case 3: format = GL_RGB;       break;
-			case 4: format = GL_RGBA;      break;
+// Frames a finished load waits for other loads of possibly the same shape, before getting an array without them
+constexpr uint64_t MAX_PARKED_FRAMES = 30;
+
+static GLenum channelFormat(int channels) {
+	GLenum format = GL_RGBA;
+
+	// Set the Correct Channel Format
+	switch (channels)
+	{
+	case 1: format = GL_ALPHA;     break;
+	case 2: format = GL_LUMINANCE; break;
+	case 3: format = GL_RGB;       break;
+	case 4: format = GL_RGBA;      break;
+	}
+
+	return format;
+}
+
+// Whether the context lists a compressed format as supported. Desktop drivers often decompress ETC2 themselves, and
+// browsers only list it where the extension is available, so a missing format means decoding on the CPU instead.
+static bool compressedFormatSupported(GLenum format) {
+	static bool queried = false;
+	static std::vector<GLint> formats;
+	if (!queried) {
+		GLint count = 0;
+		glGetIntegerv(GL_NUM_COMPRESSED_TEXTURE_FORMATS, &count);
+		formats.resize(count);
+		if (count > 0) glGetIntegerv(GL_COMPRESSED_TEXTURE_FORMATS, formats.data());
+		queried = true;
+	}
+	return std::find(formats.begin(), formats.end(), (GLint)format) != formats.end();
+}
+
+// Cooked file of an image in the assets directory, or an empty string for images elsewhere.
+static std::string cookedTexturePath(const std::string& path) {
+#ifdef COOKED_ASSETS_DIR
+	std::string assetsDirectory = COMMON_ASSETS_DIR;
+	if (path.compare(0, assetsDirectory.size(), assetsDirectory) == 0) {
+		return COOKED_ASSETS_DIR + path.substr(assetsDirectory.size()) + ".tex";
+	}
+#endif
+	return "";
+}
+
+TextureHandle MaterialManager::textureHandle(const std::string& path) {
+	if (path.empty()) return NO_TEXTURE;
+
+	auto [found, added] = mHandles.try_emplace(path, (TextureHandle)mTextures.size());
+	if (added) {
+		mTextures.emplace_back();
+		mTextures.back().path = path;
+		mTextures.back().lastUsedFrame = mFrame;
+		load(found->second);
+	}
+	return found->second;
+}
+
+TextureLayer MaterialManager::useTexture(TextureHandle handle) {
+	if (handle == NO_TEXTURE) return { placeholder(), 0 };
+
+	Texture& texture = mTextures[handle];
+	texture.lastUsedFrame = mFrame;
+	if (texture.state == TextureState::Unloaded) load(handle);
+	if (texture.state != TextureState::Resident) return { placeholder(), 0 };
+	return { mArrays[texture.array].id, texture.layer };
+}
+
+void MaterialManager::addTexture(std::string path, const unsigned char* data, size_t size) {
+	auto [found, added] = mHandles.try_emplace(path, (TextureHandle)mTextures.size());
+	if (added) {
+		mTextures.emplace_back();
+		mTextures.back().path = path;
+	}
+
+	Texture& texture = mTextures[found->second];
+	evict(texture);
+	texture.embedded = std::make_shared<const std::vector<unsigned char>>(data, data + size);
+	texture.lastUsedFrame = mFrame;
+	load(found->second);
+}
+
+void MaterialManager::load(TextureHandle handle) {
+	Texture& texture = mTextures[handle];
+	texture.state = TextureState::Loading;
+	uint32_t generation = texture.generation;
+
+	// The image is decoded in the background, then uploaded between two frames.
+	if (texture.embedded) {
+		std::shared_ptr<const std::vector<unsigned char>> embedded = texture.embedded;
+#ifndef __EMSCRIPTEN__
+		fetch_task([this, handle, generation, embedded]() -> std::function<void()> {
+			auto cooked = std::make_shared<CookedTexture>();
+			if (!cookTexture(embedded->data(), embedded->size(), *cooked)) return [this, handle, generation] { failLoad(handle, generation); };
+			return [this, handle, generation, cooked] { finishLoad(handle, generation, cooked); };
+		});
+#else
+		// There are no loader threads on the web.
+		auto cooked = std::make_shared<CookedTexture>();
+		if (cookTexture(embedded->data(), embedded->size(), *cooked)) finishLoad(handle, generation, cooked);
+		else failLoad(handle, generation);
+#endif
+		return;
+	}
+
+	std::string path = texture.path;
+	std::string cookedPath = cookedTexturePath(path);
+#ifndef __EMSCRIPTEN__
+	// Decoded and mipmapped once, then read from the cooked file by later runs. The format is chosen here, where GL
+	// can be queried, so that the loader thread decodes what the context can't sample instead of the frame.
+	bool etc2Supported = compressedFormatSupported(GL_COMPRESSED_RGB8_ETC2) && compressedFormatSupported(GL_COMPRESSED_RGBA8_ETC2_EAC);
+	fetch_task([this, handle, path, cookedPath, etc2Supported, generation]() -> std::function<void()> {
+		auto cooked = std::make_shared<CookedTexture>();
+		if (!loadTexture(path, cookedPath, etc2Supported, *cooked)) return [this, handle, generation] { failLoad(handle, generation); };
+		return [this, handle, generation, cooked] { finishLoad(handle, generation, cooked); };
+	});
+#else
+	if (!cookedPath.empty()) {
+		// Cooked by the asset cooker at build time.
+		fetch_data("", cookedPath, [this, handle, cookedPath, generation](const FetchedData& file) {
+			auto cooked = std::make_shared<CookedTexture>();
+			if (!readCookedTexture(file.data(), file.size(), std::nullopt, *cooked)) {
+				spdlog::critical("Cooked texture {} is invalid, run the asset cooker again", cookedPath);
+				failLoad(handle, generation);
+				return;
 			}
+			finishLoad(handle, generation, cooked);
+		});
+		return;
+	}
+
+	// Mipmapped on the CPU, as glGenerateMipmap would regenerate every layer of the array.
+	fetch_data("", path, [this, handle, path, generation](const FetchedData& file) {
+		auto cooked = std::make_shared<CookedTexture>();
+		if (!cookTexture(file.data(), file.size(), *cooked)) {
+			spdlog::critical("Failed to load image {}", path);
+			failLoad(handle, generation);
+			return;
+		}
+		finishLoad(handle, generation, cooked);
+	});
+#endif
+}
+
+bool MaterialManager::isCurrentLoad(TextureHandle handle, uint32_t generation) const {
+	return handle < mTextures.size() && mTextures[handle].state == TextureState::Loading && mTextures[handle].generation == generation;
+}
+
+void MaterialManager::failLoad(TextureHandle handle, uint32_t generation) {
+	if (isCurrentLoad(handle, generation)) mTextures[handle].state = TextureState::Failed;
+}
+
+// The texture itself if it owns its pixels, or else a copy that does, for levels pointing into a fetched file that
+// only lives as long as its callback.
+static std::shared_ptr<const CookedTexture> ownedTexture(std::shared_ptr<const CookedTexture> texture) {
+	if (!texture->storage.empty() || texture->cookedFile) return texture;
+
+	auto owned = std::make_shared<CookedTexture>();
+	owned->channels = texture->channels;
+	owned->format = texture->format;
+	owned->levels = texture->levels;
+	size_t total = 0;
+	for (const CookedTextureLevel& level : texture->levels) total += level.size;
+	owned->storage.resize(total);
+	size_t offset = 0;
+	for (CookedTextureLevel& level : owned->levels) {
+		std::copy(level.pixels, level.pixels + level.size, owned->storage.begin() + offset);
+		level.pixels = owned->storage.data() + offset;
+		offset += level.size;
+	}
+	return owned;
+}
+
+void MaterialManager::finishLoad(TextureHandle handle, uint32_t generation, std::shared_ptr<const CookedTexture> cooked) {
+	if (!isCurrentLoad(handle, generation)) return;
+	Texture& texture = mTextures[handle];
+
+	bool compressed = cooked->format != CookedTextureFormat::Raw;
+	GLenum format = compressed ?
+		(cooked->format == CookedTextureFormat::Etc2Rgba ? GL_COMPRESSED_RGBA8_ETC2_EAC : GL_COMPRESSED_RGB8_ETC2) :
+		channelFormat(cooked->channels);
+	if (compressed && !compressedFormatSupported(format)) {
+		// Only for cooked files fetched on the web, where there are no loader threads to decode them
+		auto raw = std::make_shared<CookedTexture>();
+		if (!decompressTexture(*cooked, *raw)) {
+			spdlog::critical("Failed to decompress texture {}", texture.path);
+			texture.state = TextureState::Failed;
+			return;
+		}
+		finishLoad(handle, generation, raw);
+		return;
+	}
 
-			glBindTexture(GL_TEXTURE_2D, texture);
-			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_NEAREST);
-			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-			glTexImage2D(GL_TEXTURE_2D, 0, format,
-				width, height, 0, format, GL_UNSIGNED_BYTE, data);
-			glGenerateMipmap(GL_TEXTURE_2D);
+	texture.shape = { format, compressed, cooked->levels[0].width, cooked->levels[0].height, (uint32_t)cooked->levels.size() };
+	int arrayIndex = findArray(texture.shape);
+	if (arrayIndex >= 0) {
+		placeTexture(handle, arrayIndex, *cooked);
+		return;
+	}
+
+	// A new array is needed, and arrays can't grow without copying through the GPU. Other textures of this shape may
+	// still be loading, so the load waits for them to share an array with a layer for each.
+	mParkedLoads.push_back({ handle, generation, ownedTexture(cooked), mFrame });
+	placeParkedLoads();
+}
+
+void MaterialManager::placeParkedLoads() {
+	mParkedLoads.erase(std::remove_if(mParkedLoads.begin(), mParkedLoads.end(), [this](const ParkedLoad& load) {
+		return !isCurrentLoad(load.handle, load.generation);
+	}), mParkedLoads.end());
+
+	std::vector<bool> parked(mTextures.size(), false);
+	for (const ParkedLoad& load : mParkedLoads) parked[load.handle] = true;
+
+	size_t next = 0;
+	while (next < mParkedLoads.size()) {
+		const TextureShape shape = mTextures[mParkedLoads[next].handle].shape;
+
+		// Loads of unknown shape may turn out to match. Waiting for them is bounded, as a load that never completes,
+		// like a missing file on the web, would otherwise hold the others forever.
+		uint64_t parkedFrame = mFrame;
+		for (const ParkedLoad& load : mParkedLoads) {
+			if (mTextures[load.handle].shape == shape) parkedFrame = std::min(parkedFrame, load.frame);
+		}
+		int layers = 0;
+		bool waiting = false;
+		for (size_t t = 0; t < mTextures.size(); t++) {
+			const Texture& texture = mTextures[t];
+			if (texture.state != TextureState::Loading) continue;
+			if (texture.shape == shape) layers++;
+			if (!parked[t] && (texture.shape.levels == 0 || texture.shape == shape)) waiting = true;
+		}
+		if (waiting && parkedFrame + MAX_PARKED_FRAMES > mFrame) {
+			// Try the next shape
+			while (next < mParkedLoads.size() && mTextures[mParkedLoads[next].handle].shape == shape) next++;
+			continue;
+		}
+
+		int arrayIndex = createArray(shape, *mParkedLoads[next].cooked, layers);
+		std::vector<ParkedLoad> placed;
+		auto matching = std::stable_partition(mParkedLoads.begin(), mParkedLoads.end(), [this, &shape](const ParkedLoad& load) {
+			return !(mTextures[load.handle].shape == shape);
 		});
+		placed.assign(std::make_move_iterator(matching), std::make_move_iterator(mParkedLoads.end()));
+		mParkedLoads.erase(matching, mParkedLoads.end());
+		for (const ParkedLoad& load : placed) {
+			parked[load.handle] = false;
+			placeTexture(load.handle, arrayIndex, *load.cooked);
+		}
+		next = 0;
 	}
+}
+
+void MaterialManager::placeTexture(TextureHandle handle, int arrayIndex, const CookedTexture& cooked) {
+	Texture& texture = mTextures[handle];
+	TextureArray& array = mArrays[arrayIndex];
+	int layer = std::find(array.usedLayers.begin(), array.usedLayers.end(), false) - array.usedLayers.begin();
+	array.usedLayers[layer] = true;
+
+	// Rows are tightly packed, which matters for RGB levels with odd widths.
+	glBindTexture(GL_TEXTURE_2D_ARRAY, array.id);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	for (size_t i = 0; i < cooked.levels.size(); i++) {
+		const CookedTextureLevel& level = cooked.levels[i];
+		if (array.shape.compressed) {
+			glCompressedTexSubImage3D(GL_TEXTURE_2D_ARRAY, i, 0, 0, layer,
+				level.width, level.height, 1, array.shape.format, level.size, level.pixels);
+		}
+		else {
+			glTexSubImage3D(GL_TEXTURE_2D_ARRAY, i, 0, 0, layer,
+				level.width, level.height, 1, array.shape.format, GL_UNSIGNED_BYTE, level.pixels);
+		}
+	}
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
 
-	return mTextures[path];
+	texture.array = arrayIndex;
+	texture.layer = layer;
+	texture.state = TextureState::Resident;
 }
 
-void MaterialManager::addTexture(std::string path, const aiTexture* texture) {
-	GLuint id, format;
-	glGenTextures(1, &id);
-	mTextures[path] = id;
-	if (texture->CheckFormat(texture->achFormatHint)) {
-		int width; int height; int channels;
-		unsigned char* tex = stbi_load_from_memory((unsigned char*)texture->pcData, texture->mWidth, &width, &height, &channels, 0);
+int MaterialManager::findArray(const TextureShape& shape) const {
+	for (size_t i = 0; i < mArrays.size(); i++) {
+		const TextureArray& array = mArrays[i];
+		if (array.id != 0 && array.shape == shape && std::find(array.usedLayers.begin(), array.usedLayers.end(), false) != array.usedLayers.end()) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+int MaterialManager::createArray(const TextureShape& shape, const CookedTexture& cooked, int layers) {
+	layers = std::max(layers, 1);
+	int slot = std::find_if(mArrays.begin(), mArrays.end(), [](const TextureArray& array) { return array.id == 0; }) - mArrays.begin();
+	if (slot == (int)mArrays.size()) mArrays.emplace_back();
+
+	TextureArray& array = mArrays[slot];
+	array.shape = shape;
+	array.usedLayers.assign(layers, false);
+	array.bytes = 0;
 
-		// Set the Correct Channel Format
-		switch (channels)
-		{
-		case 1: format = GL_ALPHA;     break;
-		case 2: format = GL_LUMINANCE; break;
-		case 3: format = GL_RGB;       break;
-		case 4: format = GL_RGBA;      break;
+	glGenTextures(1, &array.id);
+	glBindTexture(GL_TEXTURE_2D_ARRAY, array.id);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_REPEAT);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_REPEAT);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAX_LEVEL, shape.levels - 1);
+
+	// WebGL requires data for compressed images, so those start zeroed.
+	std::vector<unsigned char> zeros;
+	for (size_t i = 0; i < cooked.levels.size(); i++) {
+		const CookedTextureLevel& level = cooked.levels[i];
+		size_t size = level.size * layers;
+		array.bytes += size;
+		if (shape.compressed) {
+			zeros.assign(size, 0);
+			glCompressedTexImage3D(GL_TEXTURE_2D_ARRAY, i, shape.format,
+				level.width, level.height, layers, 0, size, zeros.data());
+		}
+		else {
+			glTexImage3D(GL_TEXTURE_2D_ARRAY, i, shape.format,
+				level.width, level.height, layers, 0, shape.format, GL_UNSIGNED_BYTE, nullptr);
 		}
+	}
 
-		glBindTexture(GL_TEXTURE_2D, id);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_NEAREST);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-		glTexImage2D(GL_TEXTURE_2D, 0, format,
-			width, height, 0, format, GL_UNSIGNED_BYTE, tex);
-		glGenerateMipmap(GL_TEXTURE_2D);
+	mResidentBytes += array.bytes;
+	return slot;
+}
+
+void MaterialManager::evict(Texture& texture) {
+	// Loads in flight finish with an old generation and are dropped.
+	texture.generation++;
+	if (texture.state == TextureState::Resident) {
+		TextureArray& array = mArrays[texture.array];
+		array.usedLayers[texture.layer] = false;
+		if (std::find(array.usedLayers.begin(), array.usedLayers.end(), true) == array.usedLayers.end()) {
+			glDeleteTextures(1, &array.id);
+			array.id = 0;
+			mResidentBytes -= array.bytes;
+		}
 	}
+	texture.array = -1;
+	texture.layer = 0;
+	texture.state = TextureState::Unloaded;
 }
 
-void MaterialManager::unloadTextures() {
-	for (std::pair<std::string, GLuint> kvp : mTextures) {
-		glDeleteTextures(1, &kvp.second);
+size_t MaterialManager::arrayCount() const {
+	return std::count_if(mArrays.begin(), mArrays.end(), [](const TextureArray& array) { return array.id != 0; });
+}
+
+void MaterialManager::beginFrame() {
+	mFrame++;
+	if (!mParkedLoads.empty()) placeParkedLoads();
+	if (mBudget == 0 || mResidentBytes <= mBudget) {
+		mOverBudgetReported = false;
+		return;
+	}
+
+	// Memory is only returned once every layer of an array is evicted, so whole arrays are evicted, least recently used
+	// first. Arrays with a texture used last frame are kept even over budget, since evicting it would only reload it
+	// right away.
+	std::vector<std::vector<Texture*>> arrayTextures(mArrays.size());
+	std::vector<uint64_t> arrayLastUsedFrames(mArrays.size(), 0);
+	for (Texture& texture : mTextures) {
+		if (texture.state != TextureState::Resident) continue;
+		arrayTextures[texture.array].push_back(&texture);
+		arrayLastUsedFrames[texture.array] = std::max(arrayLastUsedFrames[texture.array], texture.lastUsedFrame);
 	}
+	std::vector<int> candidates;
+	for (size_t i = 0; i < mArrays.size(); i++) {
+		if (!arrayTextures[i].empty() && arrayLastUsedFrames[i] + 1 < mFrame) candidates.push_back(i);
+	}
+	std::sort(candidates.begin(), candidates.end(), [&arrayLastUsedFrames](int a, int b) { return arrayLastUsedFrames[a] < arrayLastUsedFrames[b]; });
+	for (int array : candidates) {
+		if (mResidentBytes <= mBudget) break;
+		for (Texture* texture : arrayTextures[array]) {
+			evict(*texture);
+		}
+	}
+
+	if (mResidentBytes > mBudget && !mOverBudgetReported) {
+		spdlog::warn("Textures used by one frame take {} MB, over the budget of {} MB", mResidentBytes >> 20, mBudget >> 20);
+		mOverBudgetReported = true;
+	}
+}
 
-	mTextures.clear();
+GLuint MaterialManager::placeholder() {
+	if (mPlaceholder == 0) {
+		const unsigned char grey[4] = { 128, 128, 128, 255 };
+		glGenTextures(1, &mPlaceholder);
+		glBindTexture(GL_TEXTURE_2D_ARRAY, mPlaceholder);
+		glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_RGBA, 1, 1, 1, 0, GL_RGBA, GL_UNSIGNED_BYTE, grey);
+	}
+	return mPlaceholder;
+}
+
+void MaterialManager::unloadTextures() {
+	for (Texture& texture : mTextures) {
+		evict(texture);
+	}
+	mParkedLoads.clear();
+	glDeleteTextures(1, &mPlaceholder);
+	mPlaceholder = 0;
+	mArrays.clear();
 }
@@ -0,0 +1,227 @@
+#include "MeshOptimizer.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <vector>
+#include <glm/glm.hpp>
+
+// FIFO cache simulated with insertion times: a vertex is cached while fewer than cacheSize others were inserted after it.
+class VertexCache {
+public:
+	VertexCache(uint32_t vertexCount, int cacheSize) : mInserted(vertexCount, 0), mTime(cacheSize + 1), mCacheSize(cacheSize) {}
+
+	// Use a vertex, returning whether it missed.
+	bool touch(uint32_t vertex) {
+		if (cached(vertex)) return false;
+		mInserted[vertex] = mTime++;
+		return true;
+	}
+	bool cached(uint32_t vertex) const { return mTime - mInserted[vertex] <= (uint32_t)mCacheSize; }
+	// Entries pushed after the vertex, or more than the cache size if it isn't cached
+	uint32_t age(uint32_t vertex) const { return mTime - mInserted[vertex]; }
+	// Empty the cache.
+	void flush() { mTime += mCacheSize + 1; }
+private:
+	std::vector<uint32_t> mInserted;
+	uint32_t mTime;
+	int mCacheSize;
+};
+
+static int triangleMisses(VertexCache& cache, const uint32_t* triangle) {
+	return cache.touch(triangle[0]) + cache.touch(triangle[1]) + cache.touch(triangle[2]);
+}
+
+float computeACMR(const uint32_t* indices, size_t indexCount, uint32_t vertexCount, int cacheSize) {
+	size_t triangleCount = indexCount / 3;
+	if (triangleCount == 0) return 0.0f;
+
+	VertexCache cache(vertexCount, cacheSize);
+	size_t misses = 0;
+	for (size_t t = 0; t < triangleCount; t++) {
+		misses += triangleMisses(cache, &indices[t * 3]);
+	}
+	return (float)misses / triangleCount;
+}
+
+void optimizeVertexCache(uint32_t* indices, size_t indexCount, uint32_t vertexCount, int cacheSize) {
+	size_t triangleCount = indexCount / 3;
+	if (triangleCount == 0) return;
+
+	// Triangles of each vertex, in one array with an offset per vertex
+	std::vector<uint32_t> liveTriangles(vertexCount, 0);
+	for (size_t i = 0; i < triangleCount * 3; i++) liveTriangles[indices[i]]++;
+	std::vector<uint32_t> adjacencyOffsets(vertexCount + 1, 0);
+	for (uint32_t v = 0; v < vertexCount; v++) adjacencyOffsets[v + 1] = adjacencyOffsets[v] + liveTriangles[v];
+	std::vector<uint32_t> adjacency(adjacencyOffsets.back());
+	std::vector<uint32_t> filled(adjacencyOffsets.begin(), adjacencyOffsets.end() - 1);
+	for (size_t i = 0; i < triangleCount * 3; i++) adjacency[filled[indices[i]]++] = i / 3;
+
+	VertexCache cache(vertexCount, cacheSize);
+	std::vector<bool> emitted(triangleCount, false);
+	std::vector<uint32_t> output;
+	output.reserve(triangleCount * 3);
+	// Recently used vertices to go back to when fanning reaches a dead end
+	std::vector<uint32_t> deadEnds;
+	std::vector<uint32_t> candidates;
+	uint32_t cursor = 0;
+
+	// Most recent dead end with triangles left, or else the next such vertex in input order.
+	auto skipDeadEnd = [&]() -> int64_t {
+		while (!deadEnds.empty()) {
+			uint32_t vertex = deadEnds.back();
+			deadEnds.pop_back();
+			if (liveTriangles[vertex] > 0) return vertex;
+		}
+		for (; cursor < vertexCount; cursor++) {
+			if (liveTriangles[cursor] > 0) return cursor;
+		}
+		return -1;
+	};
+
+	int64_t fanning = skipDeadEnd();
+	while (fanning >= 0) {
+		candidates.clear();
+		for (uint32_t a = adjacencyOffsets[fanning]; a < adjacencyOffsets[fanning + 1]; a++) {
+			uint32_t triangle = adjacency[a];
+			if (emitted[triangle]) continue;
+			emitted[triangle] = true;
+
+			for (int k = 0; k < 3; k++) {
+				uint32_t vertex = indices[triangle * 3 + k];
+				output.push_back(vertex);
+				deadEnds.push_back(vertex);
+				candidates.push_back(vertex);
+				liveTriangles[vertex]--;
+				cache.touch(vertex);
+			}
+		}
+
+		// Prefer the candidate that entered the cache longest ago while still being in it after its remaining
+		// triangles are emitted.
+		fanning = -1;
+		int64_t bestPriority = -1;
+		for (uint32_t vertex : candidates) {
+			if (liveTriangles[vertex] == 0) continue;
+
+			int64_t priority = 0;
+			if (cache.age(vertex) + 2 * liveTriangles[vertex] <= (uint32_t)cacheSize) {
+				priority = cache.age(vertex);
+			}
+			if (priority > bestPriority) {
+				bestPriority = priority;
+				fanning = vertex;
+			}
+		}
+		if (fanning < 0) fanning = skipDeadEnd();
+	}
+
+	std::copy(output.begin(), output.end(), indices);
+}
+
+void optimizeOverdraw(uint32_t* indices, size_t indexCount, const void* positions, size_t positionStride, uint32_t vertexCount,
+	float threshold, int cacheSize) {
+	size_t triangleCount = indexCount / 3;
+	if (triangleCount == 0) return;
+
+	auto position = [positions, positionStride](uint32_t vertex) {
+		glm::vec3 p;
+		memcpy(&p, (const unsigned char*)positions + vertex * positionStride, sizeof(p));
+		return p;
+	};
+
+	// Hard boundaries: triangles whose three vertices all miss, so nothing is lost by starting a cluster there.
+	std::vector<size_t> hardStarts;
+	VertexCache cache(vertexCount, cacheSize);
+	for (size_t t = 0; t < triangleCount; t++) {
+		if (triangleMisses(cache, &indices[t * 3]) == 3) hardStarts.push_back(t);
+	}
+	hardStarts.push_back(triangleCount);
+
+	// Soft boundaries: cut a cluster as soon as its first part is nearly as cache friendly as the whole of it.
+	std::vector<size_t> starts;
+	for (size_t c = 0; c + 1 < hardStarts.size(); c++) {
+		size_t begin = hardStarts[c], end = hardStarts[c + 1];
+		// Flushing the shared cache is constant time, where a fresh cache per cluster would cost the whole vertex count
+		cache.flush();
+		size_t clusterMisses = 0;
+		for (size_t t = begin; t < end; t++) {
+			clusterMisses += triangleMisses(cache, &indices[t * 3]);
+		}
+		float clusterACMR = (float)clusterMisses / (end - begin);
+
+		cache.flush();
+		starts.push_back(begin);
+		size_t misses = 0;
+		for (size_t t = begin; t < end; t++) {
+			misses += triangleMisses(cache, &indices[t * 3]);
+			if (t + 1 < end && misses <= threshold * clusterACMR * (t + 1 - starts.back())) {
+				starts.push_back(t + 1);
+				misses = 0;
+				cache.flush();
+			}
+		}
+	}
+	starts.push_back(triangleCount);
+
+	struct Cluster {
+		size_t begin;
+		size_t end;
+		glm::vec3 centroid;
+		// Sum of the triangle normals weighted by area
+		glm::vec3 normal;
+		float area;
+		float sortKey;
+	};
+	std::vector<Cluster> clusters(starts.size() - 1);
+	glm::vec3 meshCentroid(0.0f);
+	float meshArea = 0.0f;
+	for (size_t c = 0; c < clusters.size(); c++) {
+		Cluster& cluster = clusters[c];
+		cluster = { starts[c], starts[c + 1], glm::vec3(0.0f), glm::vec3(0.0f), 0.0f, 0.0f };
+		for (size_t t = cluster.begin; t < cluster.end; t++) {
+			glm::vec3 p0 = position(indices[t * 3]), p1 = position(indices[t * 3 + 1]), p2 = position(indices[t * 3 + 2]);
+			glm::vec3 normal = glm::cross(p1 - p0, p2 - p0);
+			float area = glm::length(normal);
+			cluster.centroid += (p0 + p1 + p2) * (area / 3.0f);
+			cluster.normal += normal;
+			cluster.area += area;
+		}
+		if (cluster.area > 0.0f) cluster.centroid /= cluster.area;
+		meshCentroid += cluster.centroid * cluster.area;
+		meshArea += cluster.area;
+	}
+	if (meshArea > 0.0f) meshCentroid /= meshArea;
+
+	for (Cluster& cluster : clusters) {
+		float length = glm::length(cluster.normal);
+		cluster.sortKey = length > 0.0f ? glm::dot(cluster.centroid - meshCentroid, cluster.normal / length) : 0.0f;
+	}
+	std::stable_sort(clusters.begin(), clusters.end(), [](const Cluster& a, const Cluster& b) { return a.sortKey > b.sortKey; });
+
+	std::vector<uint32_t> output;
+	output.reserve(triangleCount * 3);
+	for (const Cluster& cluster : clusters) {
+		output.insert(output.end(), indices + cluster.begin * 3, indices + cluster.end * 3);
+	}
+	std::copy(output.begin(), output.end(), indices);
+}
+
+uint32_t optimizeVertexFetch(uint32_t* indices, size_t indexCount, void* vertices, uint32_t vertexCount, size_t vertexSize) {
+	constexpr uint32_t UNUSED = UINT32_MAX;
+	std::vector<uint32_t> remap(vertexCount, UNUSED);
+	std::vector<unsigned char> reordered((size_t)vertexCount * vertexSize);
+	unsigned char* source = (unsigned char*)vertices;
+
+	uint32_t next = 0;
+	for (size_t i = 0; i < indexCount; i++) {
+		uint32_t& target = remap[indices[i]];
+		if (target == UNUSED) {
+			memcpy(&reordered[(size_t)next * vertexSize], source + (size_t)indices[i] * vertexSize, vertexSize);
+			target = next++;
+		}
+		indices[i] = target;
+	}
+
+	memcpy(vertices, reordered.data(), (size_t)next * vertexSize);
+	return next;
+}
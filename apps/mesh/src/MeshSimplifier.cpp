@@ -0,0 +1,168 @@
+#include "MeshSimplifier.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <vector>
+#include <glm/glm.hpp>
+
+// Passes over the whole mesh before giving up on reaching the target
+constexpr int MAX_SIMPLIFY_PASSES = 64;
+
+// Sum of squared distances to a set of planes, weighted by the area of the triangles they come from.
+struct Quadric {
+	double a2 = 0, ab = 0, ac = 0, ad = 0;
+	double b2 = 0, bc = 0, bd = 0;
+	double c2 = 0, cd = 0;
+	double d2 = 0;
+	double weight = 0;
+
+	void addPlane(glm::dvec3 normal, double distance, double area) {
+		a2 += area * normal.x * normal.x; ab += area * normal.x * normal.y; ac += area * normal.x * normal.z; ad += area * normal.x * distance;
+		b2 += area * normal.y * normal.y; bc += area * normal.y * normal.z; bd += area * normal.y * distance;
+		c2 += area * normal.z * normal.z; cd += area * normal.z * distance;
+		d2 += area * distance * distance;
+		weight += area;
+	}
+
+	Quadric& operator+=(const Quadric& q) {
+		a2 += q.a2; ab += q.ab; ac += q.ac; ad += q.ad;
+		b2 += q.b2; bc += q.bc; bd += q.bd;
+		c2 += q.c2; cd += q.cd;
+		d2 += q.d2;
+		weight += q.weight;
+		return *this;
+	}
+
+	// Root mean squared distance from the point to the planes
+	double error(glm::dvec3 p) const {
+		double sum =
+			a2 * p.x * p.x + 2 * ab * p.x * p.y + 2 * ac * p.x * p.z + 2 * ad * p.x +
+			b2 * p.y * p.y + 2 * bc * p.y * p.z + 2 * bd * p.y +
+			c2 * p.z * p.z + 2 * cd * p.z +
+			d2;
+		return weight > 0 ? std::sqrt(std::max(sum, 0.0) / weight) : 0.0;
+	}
+};
+
+struct Collapse {
+	uint32_t from;
+	uint32_t to;
+	double error;
+};
+
+size_t simplifyMesh(uint32_t* destination, const uint32_t* indices, size_t indexCount, const void* positions, size_t positionStride,
+	uint32_t vertexCount, const uint8_t* locked, size_t targetIndexCount, float maxError, float& resultError) {
+	resultError = 0.0f;
+	std::vector<uint32_t> result(indices, indices + indexCount / 3 * 3);
+
+	auto position = [positions, positionStride](uint32_t vertex) {
+		glm::vec3 p;
+		memcpy(&p, (const unsigned char*)positions + vertex * positionStride, sizeof(p));
+		return glm::dvec3(p);
+	};
+
+	std::vector<Quadric> quadrics(vertexCount);
+	for (size_t t = 0; t < result.size(); t += 3) {
+		glm::dvec3 p0 = position(result[t]), p1 = position(result[t + 1]), p2 = position(result[t + 2]);
+		glm::dvec3 normal = glm::cross(p1 - p0, p2 - p0);
+		double length = glm::length(normal);
+		if (length == 0.0) continue;
+
+		normal /= length;
+		double distance = -glm::dot(normal, p0);
+		for (int k = 0; k < 3; k++) {
+			quadrics[result[t + k]].addPlane(normal, distance, length * 0.5);
+		}
+	}
+
+	std::vector<uint32_t> adjacencyOffsets(vertexCount + 1);
+	std::vector<uint32_t> adjacency;
+	std::vector<Collapse> collapses;
+	std::vector<uint32_t> remap(vertexCount);
+	std::vector<bool> touched(vertexCount);
+
+	for (int pass = 0; pass < MAX_SIMPLIFY_PASSES && result.size() > targetIndexCount; pass++) {
+		// Triangles of each vertex
+		std::fill(adjacencyOffsets.begin(), adjacencyOffsets.end(), 0);
+		for (uint32_t vertex : result) adjacencyOffsets[vertex + 1]++;
+		for (uint32_t v = 0; v < vertexCount; v++) adjacencyOffsets[v + 1] += adjacencyOffsets[v];
+		adjacency.resize(result.size());
+		std::vector<uint32_t> filled(adjacencyOffsets.begin(), adjacencyOffsets.end() - 1);
+		for (size_t i = 0; i < result.size(); i++) adjacency[filled[result[i]]++] = i / 3;
+
+		collapses.clear();
+		for (size_t t = 0; t < result.size(); t += 3) {
+			for (int k = 0; k < 3; k++) {
+				uint32_t a = result[t + k], b = result[t + (k + 1) % 3];
+				for (auto [from, to] : { std::pair(a, b), std::pair(b, a) }) {
+					if (locked && locked[from]) continue;
+					Quadric merged = quadrics[from];
+					merged += quadrics[to];
+					double error = merged.error(position(to));
+					if (error <= maxError) collapses.push_back({ from, to, error });
+				}
+			}
+		}
+		if (collapses.empty()) break;
+		std::sort(collapses.begin(), collapses.end(), [](const Collapse& x, const Collapse& y) { return x.error < y.error; });
+
+		// Cheapest first, each touching vertices no other collapse of this pass touched, so the adjacency stays valid.
+		for (uint32_t v = 0; v < vertexCount; v++) remap[v] = v;
+		std::fill(touched.begin(), touched.end(), false);
+		size_t trianglesToRemove = (result.size() - targetIndexCount + 2) / 3;
+		size_t removed = 0;
+		bool collapsed = false;
+		for (const Collapse& collapse : collapses) {
+			if (removed >= trianglesToRemove) break;
+			if (touched[collapse.from] || touched[collapse.to]) continue;
+
+			glm::dvec3 target = position(collapse.to);
+			bool flips = false;
+			size_t shared = 0;
+			for (uint32_t a = adjacencyOffsets[collapse.from]; a < adjacencyOffsets[collapse.from + 1] && !flips; a++) {
+				const uint32_t* triangle = &result[adjacency[a] * 3];
+				if (triangle[0] == collapse.to || triangle[1] == collapse.to || triangle[2] == collapse.to) {
+					shared++;
+					continue;
+				}
+
+				glm::dvec3 before[3], after[3];
+				for (int k = 0; k < 3; k++) {
+					before[k] = position(triangle[k]);
+					after[k] = triangle[k] == collapse.from ? target : before[k];
+				}
+				glm::dvec3 normalBefore = glm::cross(before[1] - before[0], before[2] - before[0]);
+				glm::dvec3 normalAfter = glm::cross(after[1] - after[0], after[2] - after[0]);
+				flips = glm::dot(normalBefore, normalAfter) <= 0.0;
+			}
+			if (flips) continue;
+
+			remap[collapse.from] = collapse.to;
+			quadrics[collapse.to] += quadrics[collapse.from];
+			resultError = std::max(resultError, (float)collapse.error);
+			removed += shared;
+			collapsed = true;
+
+			for (uint32_t a = adjacencyOffsets[collapse.from]; a < adjacencyOffsets[collapse.from + 1]; a++) {
+				const uint32_t* triangle = &result[adjacency[a] * 3];
+				touched[triangle[0]] = touched[triangle[1]] = touched[triangle[2]] = true;
+			}
+		}
+		if (!collapsed) break;
+
+		// Apply the collapses and drop the triangles that became degenerate.
+		size_t written = 0;
+		for (size_t t = 0; t < result.size(); t += 3) {
+			uint32_t a = remap[result[t]], b = remap[result[t + 1]], c = remap[result[t + 2]];
+			if (a == b || b == c || c == a) continue;
+			result[written++] = a;
+			result[written++] = b;
+			result[written++] = c;
+		}
+		result.resize(written);
+	}
+
+	std::copy(result.begin(), result.end(), destination);
+	return result.size();
+}
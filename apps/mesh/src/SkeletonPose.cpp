@@ -0,0 +1,106 @@
+#include "SkeletonPose.hpp"
+#include "simd.hpp"
+#include <algorithm>
+#include <glm/gtc/type_ptr.hpp>
+
+// The bone's own transform changed, so its local matrix has to be rebuilt.
+constexpr uint8_t LOCAL_DIRTY = 1;
+// An ancestor changed, so only the global matrix has to be rebuilt.
+constexpr uint8_t GLOBAL_DIRTY = 2;
+
+glm::mat4 composeTransform(const glm::vec3& translation, const glm::quat& rotation, const glm::vec3& scale) {
+	glm::mat3 r = glm::mat3_cast(rotation);
+	return glm::mat4(
+		glm::vec4(r[0] * scale.x, 0.0f),
+		glm::vec4(r[1] * scale.y, 0.0f),
+		glm::vec4(r[2] * scale.z, 0.0f),
+		glm::vec4(translation, 1.0f));
+}
+
+// Split a matrix without shear into translation, rotation and scale.
+void decomposeTransform(const glm::mat4& m, glm::vec3& translation, glm::quat& rotation, glm::vec3& scale) {
+	translation = glm::vec3(m[3]);
+	scale = glm::vec3(glm::length(glm::vec3(m[0])), glm::length(glm::vec3(m[1])), glm::length(glm::vec3(m[2])));
+
+	glm::mat3 r(glm::vec3(m[0]) / scale.x, glm::vec3(m[1]) / scale.y, glm::vec3(m[2]) / scale.z);
+	if (glm::determinant(r) < 0.0f) {
+		scale.x = -scale.x;
+		r[0] = -r[0];
+	}
+	rotation = glm::quat_cast(r);
+}
+
+void LocalPose::resize(size_t boneCount) {
+	translations.resize(boneCount);
+	rotations.resize(boneCount);
+	scales.resize(boneCount);
+	weights.resize(boneCount);
+}
+
+void SkeletonPose::reset(const std::vector<Bone>& bones) {
+	size_t count = bones.size();
+	mTranslations.resize(count);
+	mRotations.resize(count);
+	mScales.resize(count);
+	mDirty.assign(count, 0);
+	mLocalMatrices.resize(count);
+	mGlobalMatrices.resize(count);
+
+	int matrixCount = 0;
+	for (const Bone& bone : bones) {
+		matrixCount = std::max(matrixCount, bone.matrixIndex + 1);
+	}
+	mSkinningMatrices.resize(matrixCount);
+
+	for (size_t i = 0; i < count; i++) {
+		// Keep the rest matrix itself so bones that never animate aren't affected by the decomposition's rounding.
+		mLocalMatrices[i] = bones[i].relativeMatrix;
+		decomposeTransform(bones[i].relativeMatrix, mTranslations[i], mRotations[i], mScales[i]);
+	}
+
+	if (count > 0) {
+		mDirty[0] = GLOBAL_DIRTY;
+	}
+}
+
+void SkeletonPose::setLocal(int bone, const glm::vec3& translation, const glm::quat& rotation, const glm::vec3& scale) {
+	if (mTranslations[bone] == translation && mRotations[bone] == rotation && mScales[bone] == scale) return;
+
+	mTranslations[bone] = translation;
+	mRotations[bone] = rotation;
+	mScales[bone] = scale;
+	mDirty[bone] |= LOCAL_DIRTY;
+}
+
+bool SkeletonPose::evaluate(const std::vector<Bone>& bones) {
+	bool changed = false;
+
+	for (size_t i = 0; i < bones.size(); i++) {
+		// Parents come before their children, so their flags are final by the time a child is visited.
+		if (i > 0 && mDirty[bones[i].parent] != 0) {
+			mDirty[i] |= GLOBAL_DIRTY;
+		}
+		if (mDirty[i] == 0) continue;
+
+		if (mDirty[i] & LOCAL_DIRTY) {
+			mLocalMatrices[i] = composeTransform(mTranslations[i], mRotations[i], mScales[i]);
+		}
+
+		if (i == 0) {
+			mGlobalMatrices[0] = mLocalMatrices[0];
+			mGlobalInverse = glm::inverse(mLocalMatrices[0]);
+		}
+		else {
+			mat4Multiply(glm::value_ptr(mGlobalMatrices[bones[i].parent]), glm::value_ptr(mLocalMatrices[i]), glm::value_ptr(mGlobalMatrices[i]));
+		}
+
+		float* skinning = glm::value_ptr(mSkinningMatrices[bones[i].matrixIndex]);
+		mat4Multiply(glm::value_ptr(mGlobalInverse), glm::value_ptr(mGlobalMatrices[i]), skinning);
+		mat4Multiply(skinning, glm::value_ptr(bones[i].offsetMatrix), skinning);
+		changed = true;
+	}
+
+	std::fill(mDirty.begin(), mDirty.end(), 0);
+	if (changed) mVersion++;
+	return changed;
+}
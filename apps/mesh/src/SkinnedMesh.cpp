@@ -2,145 +2,246 @@
 
 #include <vector>
 #include <stack>
+#include <algorithm>
+#include <limits>
 #include <iostream>
 
-#include <assimp/postprocess.h>
 #include <spdlog/spdlog.h>
 #include <glm/ext/matrix_transform.hpp>
-#include <glm/gtc/type_ptr.hpp>
 
 #include "MaterialManager.hpp"
 #include "fetch.hpp"
+#include "profiler.hpp"
+#include "jobs.hpp"
+#include "renderqueue.hpp"
 #include "shaders.hpp"
+#include "uniforms.hpp"
+
+// Texture unit the bone palette is bound to. Units 0 and 1 hold the material textures.
+constexpr int PALETTE_TEXTURE_UNIT = 2;
+static_assert(PALETTE_TEXTURE_UNIT < MAX_PACKET_TEXTURES, "Draw packets must bind the palette");
+// Arguments of the draw packets of a sub-mesh
+enum SubMeshPacketArgument { PACKET_SUB_MESH, PACKET_LOD, PACKET_FIRST_INSTANCE, PACKET_INSTANCE_COUNT, PACKET_DIFFUSE_LAYER };
+// Instances per job when evaluating poses and filling the palette in parallel
+constexpr int PALETTE_JOB_GRAIN = 16;
+// Largest simplification error a level of detail may show, as a fraction of the viewport height. About a pixel at 1080p.
+constexpr float LOD_SCREEN_ERROR = 0.001f;
+// Closest distance used to project the error, so that a camera inside the bounds picks the full mesh
+constexpr float LOD_MIN_DISTANCE = 1e-3f;
+// Position, normal and uv as floats, in the order of the transform feedback varyings and of skinVertices
+constexpr GLsizeiptr CACHED_VERTEX_SIZE = CPU_SKINNED_VERTEX_FLOATS * sizeof(float);
+// Vertices per job when skinning on the CPU, enough that scheduling costs little next to the skinning
+constexpr int CPU_SKINNING_JOB_GRAIN = 4096;
+// Attribute locations set by the layout qualifiers of SkinnedMesh.vert and SkinnedMeshCached.vert
+enum VertexAttributeLocation { POSITION_LOCATION, NORMAL_LOCATION, UV_LOCATION, BONE_LOCATION, INFLUENCE_LOCATION };
+
+SkinnedMesh::SkinnedMesh(std::string filename, SkinnedVertexFormat vertexFormat) :
+    mDefaultInstance(*this), mVertexFormat(vertexFormat), mShader(&shader(vertexFormat)) {
+    mFirstInstanceUniform = mShader->uniform<int>("firstInstance");
+    mDiffuseLayerUniform = mShader->uniform<int>("diffuseLayer");
+    mCachedDiffuseLayerUniform = cachedShader().uniform<int>("diffuseLayer");
+    mCachedObjectMatrixUniform = cachedShader().uniform<glm::mat4>("objectMatrix");
+    std::string sourcePath = std::string(COMMON_ASSETS_DIR) + filename;
+    std::string assetPath = sourcePath.substr(0, sourcePath.find_last_of('/'));
+
+#if defined(__EMSCRIPTEN__) && defined(COOKED_ASSETS_DIR)
+    // The asset cooker made this file at build time, so the model itself is never downloaded.
+    fetch_data(COOKED_ASSETS_DIR, filename + ".skm", [this, filename, assetPath](const FetchedData& file) {
+        SkinnedMeshData data;
+        if (!readCookedMesh(file.data(), file.size(), std::nullopt, data)) {
+            spdlog::critical("Cooked mesh for {} is invalid, run the asset cooker again", filename);
+            return;
+        }
+        upload(assetPath, data);
+    });
+#elif defined(__EMSCRIPTEN__)
+    fetch_assimp_scene(COMMON_ASSETS_DIR, filename, SKINNED_MESH_IMPORT_FLAGS, [this](std::string assetPath, const aiScene* scene) {
+        SkinnedMeshData data;
+        if (importSkinnedMesh(scene, data)) upload(assetPath, data);
+    });
+#else
+    std::string cookedPath;
+#ifdef COOKED_ASSETS_DIR
+    cookedPath = std::string(COOKED_ASSETS_DIR) + filename + ".skm";
+#endif
+
+    fetch_task([this, sourcePath, assetPath, cookedPath]() -> std::function<void()> {
+        auto data = std::make_shared<SkinnedMeshData>();
+        if (!loadSkinnedMesh(sourcePath, cookedPath, *data)) return {};
+        return [this, data, assetPath] { upload(assetPath, *data); };
+    });
+#endif
+}
 
-constexpr auto BONES_PER_VERTEX = 4;
+Shader& SkinnedMesh::shader(SkinnedVertexFormat vertexFormat) {
+    std::unique_ptr<Shader>& shader = mShaders[(int)vertexFormat];
+    if (shader == nullptr) {
+        std::vector<std::string> defines;
+        if (vertexFormat == SkinnedVertexFormat::Packed) defines.push_back("PACKED_VERTICES");
+
+        shader = std::make_unique<Shader>();
+        shader->addSource("SkinnedMesh.vert", GL_VERTEX_SHADER, SkinnedMesh_vert_count, SkinnedMesh_vert, SkinnedMesh_vert_lens, defines);
+        shader->addSource("SkinnedMesh.frag", GL_FRAGMENT_SHADER, SkinnedMesh_frag_count, SkinnedMesh_frag, SkinnedMesh_frag_lens);
+        shader->link();
+        shader->use();
+        shader->uniform<int>("bonePalette").set(PALETTE_TEXTURE_UNIT);
+        shader->uniform<int>("diffuse").set(0);
+    }
+    return *shader;
+}
 
-struct WeightSmallerComparator
-{
-    bool operator()(const std::pair<float, int>& s1, std::pair<float, int>& s2)
-    {
-        return s1.first < s2.first && s1.second == s2.second;
+Shader& SkinnedMesh::skinShader(SkinnedVertexFormat vertexFormat) {
+    std::unique_ptr<Shader>& shader = mSkinShaders[(int)vertexFormat];
+    if (shader == nullptr) {
+        std::vector<std::string> defines = { "SKIN_TO_BUFFER" };
+        if (vertexFormat == SkinnedVertexFormat::Packed) defines.push_back("PACKED_VERTICES");
+
+        // GLSL ES needs a fragment shader even though rasterization is discarded.
+        shader = std::make_unique<Shader>();
+        shader->addSource("SkinnedMesh.vert", GL_VERTEX_SHADER, SkinnedMesh_vert_count, SkinnedMesh_vert, SkinnedMesh_vert_lens, defines);
+        shader->addSource("SkinnedMesh.frag", GL_FRAGMENT_SHADER, SkinnedMesh_frag_count, SkinnedMesh_frag, SkinnedMesh_frag_lens);
+        shader->setTransformFeedbackVaryings({ "skinnedPosition", "skinnedNormal", "skinnedUv" });
+        shader->link();
+        shader->use();
+        shader->uniform<int>("bonePalette").set(PALETTE_TEXTURE_UNIT);
+        shader->uniform<int>("firstInstance").set(0);
     }
-};
+    return *shader;
+}
 
-glm::mat4 convertMatrix(const aiMatrix4x4& aiMat)
-{
-    return {
-    aiMat.a1, aiMat.b1, aiMat.c1, aiMat.d1,
-    aiMat.a2, aiMat.b2, aiMat.c2, aiMat.d2,
-    aiMat.a3, aiMat.b3, aiMat.c3, aiMat.d3,
-    aiMat.a4, aiMat.b4, aiMat.c4, aiMat.d4
-    };
+Shader& SkinnedMesh::cachedShader() {
+    if (mCachedShader == nullptr) {
+        mCachedShader = std::make_unique<Shader>();
+        mCachedShader->addSource("SkinnedMeshCached.vert", GL_VERTEX_SHADER, SkinnedMeshCached_vert_count, SkinnedMeshCached_vert, SkinnedMeshCached_vert_lens);
+        mCachedShader->addSource("SkinnedMesh.frag", GL_FRAGMENT_SHADER, SkinnedMesh_frag_count, SkinnedMesh_frag, SkinnedMesh_frag_lens);
+        mCachedShader->link();
+        mCachedShader->use();
+        mCachedShader->uniform<int>("diffuse").set(0);
+    }
+    return *mCachedShader;
 }
 
-SkinnedMesh::SkinnedMesh(std::string filename) {
-    if (mShader == nullptr) {
-        mShader = std::make_unique<Shader>();
-        mShader->addSource("SkinnedMesh.vert", GL_VERTEX_SHADER, SkinnedMesh_vert_count, SkinnedMesh_vert, SkinnedMesh_vert_lens);
-        mShader->addSource("SkinnedMesh.frag", GL_FRAGMENT_SHADER, SkinnedMesh_frag_count, SkinnedMesh_frag, SkinnedMesh_frag_lens);
-        mShader->link();
-    }
-
-    fetch_assimp_scene(
-        COMMON_ASSETS_DIR,
-        filename,
-        aiProcessPreset_TargetRealtime_MaxQuality |
-        aiProcess_OptimizeGraph |
-        aiProcess_FlipUVs |
-        aiProcess_PopulateArmatureData,
-        [this](std::string assetPath, const aiScene* scene) { parse(assetPath, scene); }
-    );
-}
-
-void SkinnedMesh::parse(std::string assetPath, const aiScene* scene) {
-    aiNode* armature = nullptr;
-    std::vector<aiMesh*> meshesToParse{};
-    std::unordered_map<const aiNode*, int> boneMatrixIndices;
-    std::unordered_map<const aiNode*, const aiBone*> nodeBones;
-    std::vector<aiBone*> foundBones;
-    int boneMatrixCounter = 0;
-    for (int i = 0; i < scene->mNumMeshes; i++) {
-        aiMesh* mesh = scene->mMeshes[i];
-        bool alreadyListed = false;
-
-        if (armature == nullptr && mesh->HasBones()) {
-            armature = scene->mMeshes[i]->mBones[0]->mArmature;
-        }
+GeometryArena& SkinnedMesh::arena(SkinnedVertexFormat vertexFormat) {
+    std::unique_ptr<GeometryArena>& arena = mArenas[(int)vertexFormat];
+    if (arena == nullptr) {
+        GLsizei vertexSize = vertexFormat == SkinnedVertexFormat::Packed ? sizeof(PackedSkinnedVertex) : sizeof(SkinnedVertex);
+        arena = std::make_unique<GeometryArena>(vertexSize, [vertexFormat] { setVertexLayout(vertexFormat); });
+    }
+    return *arena;
+}
 
-        for (int b = 0; b < mesh->mNumBones; b++) {
-            aiBone* bone = mesh->mBones[b];
-            if (armature == mesh->mBones[b]->mArmature) {
-                if (!alreadyListed) {
-                    meshesToParse.push_back(mesh);
-                    alreadyListed = true;
-                }
+SkinnedMesh::~SkinnedMesh() {
+    for (const Mesh& mesh : mSkinnedMeshes) {
+        arena(mVertexFormat).free(mesh.geometry);
+    }
+    glDeleteTextures(1, &mPaletteTexture);
+    glDeleteVertexArrays(1, &mCachedVertexArray);
+    glDeleteBuffers(1, &mCachedVertexBuffer);
+    glDeleteBuffers(1, &mCachedIndexBuffer);
+}
 
-                if (boneMatrixIndices.find(bone->mNode) == boneMatrixIndices.end()) {
-                    boneMatrixIndices[bone->mNode] = boneMatrixCounter++;
-                    foundBones.push_back(bone);
-                    nodeBones[bone->mNode] = bone;
-                }
-            }
+void SkinnedMesh::upload(const std::string& assetPath, SkinnedMeshData& data) {
+    for (const auto& [name, bytes] : data.embeddedTextures) {
+        globalMaterialManager->addTexture(name, bytes.data(), bytes.size());
+    }
+
+    if (mVertexFormat == SkinnedVertexFormat::Packed) {
+        bool packed = std::all_of(data.meshes.begin(), data.meshes.end(), [](const SkinnedSubMeshData& subMesh) { return subMesh.packedVertices != nullptr; });
+        if (!packed) {
+            spdlog::warn("Bone indices don't fit in packed vertices, using the full vertex format");
+            mVertexFormat = SkinnedVertexFormat::Full;
+            mShader = &shader(mVertexFormat);
+            // Locations in the packed program don't apply to this one
+            mFirstInstanceUniform = mShader->uniform<int>("firstInstance");
+            mDiffuseLayerUniform = mShader->uniform<int>("diffuseLayer");
         }
     }
 
-    if (armature == nullptr) {
-        spdlog::warn("No armature was found. Object will be empty.");
-        return;
+    size_t vertexCount = 0;
+    for (const SkinnedSubMeshData& subMesh : data.meshes) {
+        uploadSubMesh(assetPath, subMesh);
+        vertexCount += subMesh.vertexCount;
     }
 
-    for (aiBone* foundBone : foundBones) {
-        aiNode* currentNode = foundBone->mNode;
-        while (currentNode != nullptr) {
-            if (boneMatrixIndices.find(currentNode) == boneMatrixIndices.end()) {
-                boneMatrixIndices[currentNode] = boneMatrixCounter++;
-                nodeBones[currentNode] = foundBone;
-            }
-            if (currentNode == armature) {
-                break;
-            }
-            currentNode = currentNode->mParent;
+    // Indices of the skinned vertex cache, which packs the sub-meshes one after the other. They are only kept on the
+    // GPU, as the mesh data is gone by the time a draw first skins once.
+    std::vector<uint32_t> cachedIndices;
+    mCachedVertexCount = 0;
+    for (size_t i = 0; i < data.meshes.size(); i++) {
+        const SkinnedSubMeshData& subMesh = data.meshes[i];
+        Mesh& mesh = mSkinnedMeshes[i];
+        mesh.cachedFirstVertex = mCachedVertexCount;
+        mesh.cachedFirstIndex = cachedIndices.size();
+        for (uint32_t index = 0; index < subMesh.indexCount; index++) {
+            uint32_t vertex = subMesh.shortIndices ? subMesh.shortIndices[index] : subMesh.indices[index];
+            cachedIndices.push_back(mCachedVertexCount + vertex);
         }
+        mSkinningStreams.append(subMesh.vertices, subMesh.vertexCount);
+        mCachedVertexCount += subMesh.vertexCount;
+    }
+    GLint maxTextureSize = 0;
+    glGetIntegerv(GL_MAX_TEXTURE_SIZE, &maxTextureSize);
+    mMaxPaletteRows = std::max(maxTextureSize, 1);
+
+    glGenBuffers(1, &mCachedIndexBuffer);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, mCachedIndexBuffer);
+    glBufferData(GL_COPY_WRITE_BUFFER, cachedIndices.size() * sizeof(uint32_t), cachedIndices.data(), GL_STATIC_DRAW);
+
+    // Animated poses stay close to the bind pose, which is good enough to project the LOD error.
+    glm::vec3 minimum(std::numeric_limits<float>::max()), maximum(-std::numeric_limits<float>::max());
+    for (const SkinnedSubMeshData& subMesh : data.meshes) {
+        for (uint32_t v = 0; v < subMesh.vertexCount; v++) {
+            minimum = glm::min(minimum, subMesh.vertices[v].position);
+            maximum = glm::max(maximum, subMesh.vertices[v].position);
+        }
+    }
+    if (vertexCount > 0) {
+        mBoundsCenter = 0.5f * (minimum + maximum);
+        mBoundsRadius = 0.5f * glm::length(maximum - minimum);
     }
 
-    mBoneMatrices.resize(boneMatrixCounter);
-    mBoneNodeMatrices.resize(boneMatrixCounter);
-    createBoneMatrices(0, armature, nodeBones, boneMatrixIndices);
-
-    for (int i = 0; i < meshesToParse.size(); i++) {
-        aiMesh* mesh = scene->mMeshes[i];
+    // A sub-mesh with fewer levels uses its coarsest one for the levels it lacks.
+    mLodErrors.assign(1, 0.0f);
+    for (const Mesh& mesh : mSkinnedMeshes) {
+        if (mesh.lods.size() > mLodErrors.size()) mLodErrors.resize(mesh.lods.size(), 0.0f);
+    }
+    for (const Mesh& mesh : mSkinnedMeshes) {
+        for (size_t level = 0; level < mLodErrors.size(); level++) {
+            mLodErrors[level] = std::max(mLodErrors[level], mesh.lods[std::min(level, mesh.lods.size() - 1)].error);
+        }
+    }
+    size_t vertexSize = mVertexFormat == SkinnedVertexFormat::Packed ? sizeof(PackedSkinnedVertex) : sizeof(SkinnedVertex);
+    spdlog::info("Uploaded {} vertices of {} bytes, {} KB", vertexCount, vertexSize, vertexCount * vertexSize / 1024);
 
-        std::vector<std::vector<std::pair<float, int>>> boneInfluencesPerVertex{};
+    mBones = std::move(data.bones);
+    mAnimations = std::move(data.animations);
 
-        boneInfluencesPerVertex.resize(mesh->mNumVertices);
+    // The object matrix followed by one skinning matrix per matrix index
+    mPaletteRowLength = 1;
+    for (const Bone& bone : mBones) {
+        mPaletteRowLength = std::max(mPaletteRowLength, bone.matrixIndex + 2);
+    }
 
-        for (int b = 0; b < mesh->mNumBones; b++) {
-            aiBone* bone = mesh->mBones[b];
-            for (int bv = 0; bv < bone->mNumWeights; bv++) {
-                std::vector<std::pair<float, int>>& currentVertex = boneInfluencesPerVertex[bone->mWeights[bv].mVertexId];
-                if (currentVertex.size() < BONES_PER_VERTEX - 1) {
-                    // add and don't sort
-                    currentVertex.emplace_back(bone->mWeights[bv].mWeight, boneMatrixIndices[bone->mNode]);
-                }
-                else if (currentVertex.size() == BONES_PER_VERTEX - 1) {
-                    // add and build heap
-                    currentVertex.emplace_back(bone->mWeights[bv].mWeight, boneMatrixIndices[bone->mNode]);
-                    std::make_heap(currentVertex.begin(), currentVertex.end(), WeightSmallerComparator());
-                }
-                else if (currentVertex.front().first < bone->mWeights[bv].mWeight) {
-                    // add only if there is more weight than the current maximum, and remove the smallest in that case
-                    std::pop_heap(currentVertex.begin(), currentVertex.end(), WeightSmallerComparator());
-                    currentVertex.pop_back();
-                    currentVertex.emplace_back(bone->mWeights[bv].mWeight, boneMatrixIndices[bone->mNode]);
-                    std::push_heap(currentVertex.begin(), currentVertex.end());
-                }
+    mInverseOffsetMatrices.assign(mPaletteRowLength - 1, glm::mat4(1.0f));
+    for (const Bone& bone : mBones) {
+        mInverseOffsetMatrices[bone.matrixIndex] = glm::inverse(bone.offsetMatrix);
+    }
+    // A bone's box for the whole mesh encloses its boxes in every sub-mesh.
+    std::vector<int> mergedBounds(mInverseOffsetMatrices.size(), -1);
+    mBoneBounds.clear();
+    for (const Mesh& mesh : mSkinnedMeshes) {
+        for (const SkinnedBoneBounds& bounds : mesh.boneBounds) {
+            int& merged = mergedBounds[bounds.matrixIndex];
+            if (merged < 0) {
+                merged = mBoneBounds.size();
+                mBoneBounds.push_back(bounds);
+                continue;
             }
+            mBoneBounds[merged].minimum = glm::min(mBoneBounds[merged].minimum, bounds.minimum);
+            mBoneBounds[merged].maximum = glm::max(mBoneBounds[merged].maximum, bounds.maximum);
         }
-
-        parse(assetPath, scene, mesh, boneInfluencesPerVertex);
     }
-
-    parseAnimation(scene);
+    mLoaded = true;
 
     std::stack<int> current{};
     current.push(0);
@@ -164,135 +265,427 @@ void SkinnedMesh::parse(std::string assetPath, const aiScene* scene) {
     }
 }
 
-void SkinnedMesh::parse(std::string assetPath, const aiScene* scene, const aiMesh* mesh, const std::vector<std::vector<std::pair<float, int>>>& sortedWeights) {
-    aiMaterial* material = scene->mMaterials[mesh->mMaterialIndex];
+// Path the material manager knows a texture by: its name if embedded, otherwise the file next to the model.
+static std::string texturePath(const std::string& assetPath, const SkinnedMeshTexture& texture) {
+    if (texture.name.empty() || texture.embedded) return texture.name;
+    return assetPath + "/" + texture.name;
+}
 
-    std::string diffuseTexture;
-    std::string specularTexture;
+void SkinnedMesh::uploadSubMesh(const std::string& assetPath, const SkinnedSubMeshData& subMesh) {
+    // Resolving the handles starts loading the texture files now rather than on the first draw.
+    TextureHandle diffuseTexture = globalMaterialManager->textureHandle(texturePath(assetPath, subMesh.diffuse));
+    TextureHandle specularTexture = globalMaterialManager->textureHandle(texturePath(assetPath, subMesh.specular));
+
+    // Straight from the import or the mapped cooked file, which are already in the buffer layout.
+    const void* vertices = mVertexFormat == SkinnedVertexFormat::Packed ? (const void*)subMesh.packedVertices : (const void*)subMesh.vertices;
+    std::optional<GeometryAllocation> geometry = subMesh.shortIndices ?
+        arena(mVertexFormat).allocate(vertices, subMesh.vertexCount, subMesh.shortIndices, subMesh.indexCount, GL_UNSIGNED_SHORT) :
+        arena(mVertexFormat).allocate(vertices, subMesh.vertexCount, subMesh.indices, subMesh.indexCount, GL_UNSIGNED_INT);
+    if (!geometry) {
+        // Kept empty, so the sub-meshes still line up with the data, and drawn as nothing.
+        spdlog::critical("No room for a sub-mesh of {} vertices, skipping it", subMesh.vertexCount);
+        mSkinnedMeshes.push_back({ GeometryAllocation(), { { 0, 0, 0.0f } }, subMesh.boneBounds, diffuseTexture, specularTexture });
+        return;
+    }
 
-    for (int i = 0; i < material->GetTextureCount(aiTextureType_DIFFUSE); i++) {
-        aiString str;
-        material->GetTexture(aiTextureType_DIFFUSE, i, &str);
+    std::vector<SkinnedMeshLod> lods = subMesh.lods;
+    if (lods.empty()) lods.push_back({ 0, subMesh.indexCount, 0.0f });
+    mSkinnedMeshes.push_back({ *geometry, lods, subMesh.boneBounds, diffuseTexture, specularTexture });
+}
 
-        const aiTexture* embeddedTexture = scene->GetEmbeddedTexture(str.C_Str());
-        if (embeddedTexture) {
-            diffuseTexture = str.C_Str();
-            globalMaterialManager->addTexture(str.C_Str(), embeddedTexture);
-        }
-        else {
-            diffuseTexture = assetPath + "/" + str.C_Str();
-            globalMaterialManager->getTexture(diffuseTexture);
-        }
+void SkinnedMesh::setVertexLayout(SkinnedVertexFormat vertexFormat) {
+    // Fixed locations rather than those of one program, as the draw and skin-to-buffer programs both use this layout
+    // and either may have optimized out an attribute the other reads.
+    auto floatAttribute = [](GLuint location, GLint size, GLenum type, GLboolean normalized, GLsizei stride, size_t offset) {
+        glVertexAttribPointer(location, size, type, normalized, stride, (void*)offset);
+        glEnableVertexAttribArray(location);
+    };
+    auto intAttribute = [](GLuint location, GLint size, GLenum type, GLsizei stride, size_t offset) {
+        glVertexAttribIPointer(location, size, type, stride, (void*)offset);
+        glEnableVertexAttribArray(location);
+    };
+
+    if (vertexFormat == SkinnedVertexFormat::Packed) {
+        GLsizei stride = sizeof(PackedSkinnedVertex);
+        floatAttribute(POSITION_LOCATION, 3, GL_FLOAT, GL_FALSE, stride, offsetof(PackedSkinnedVertex, position));
+        floatAttribute(NORMAL_LOCATION, 4, GL_INT_2_10_10_10_REV, GL_TRUE, stride, offsetof(PackedSkinnedVertex, normal));
+        floatAttribute(UV_LOCATION, 2, GL_HALF_FLOAT, GL_FALSE, stride, offsetof(PackedSkinnedVertex, uv));
+        intAttribute(BONE_LOCATION, 4, GL_UNSIGNED_BYTE, stride, offsetof(PackedSkinnedVertex, bone));
+        floatAttribute(INFLUENCE_LOCATION, 4, GL_UNSIGNED_BYTE, GL_TRUE, stride, offsetof(PackedSkinnedVertex, influence));
+    }
+    else {
+        GLsizei stride = sizeof(SkinnedVertex);
+        floatAttribute(POSITION_LOCATION, 3, GL_FLOAT, GL_FALSE, stride, offsetof(SkinnedVertex, position));
+        floatAttribute(NORMAL_LOCATION, 3, GL_FLOAT, GL_FALSE, stride, offsetof(SkinnedVertex, normal));
+        floatAttribute(UV_LOCATION, 2, GL_FLOAT, GL_FALSE, stride, offsetof(SkinnedVertex, uv));
+        intAttribute(BONE_LOCATION, 4, GL_INT, stride, offsetof(SkinnedVertex, bone));
+        floatAttribute(INFLUENCE_LOCATION, 4, GL_FLOAT, GL_FALSE, stride, offsetof(SkinnedVertex, influence));
+    }
+}
+
+void SkinnedMesh::draw(glm::mat4 matrix) {
+    PROFILE_ZONE("SkinnedMesh::draw");
+
+    // Not loaded yet.
+    if (!mLoaded) return;
+
+    evaluatePose();
+
+    // Culling needs the evaluated pose, but happens before anything is uploaded.
+    mDefaultInstance.matrix = matrix;
+    mDefaultInstance.mCulled = isCulled(mBoneBounds, mDefaultInstance.pose(), matrix);
+    if (mDefaultInstance.mCulled) return;
+    mSubMeshVisible.resize(mSkinnedMeshes.size());
+    for (size_t i = 0; i < mSkinnedMeshes.size(); i++) {
+        mSubMeshVisible[i] = !isCulled(mSkinnedMeshes[i].boneBounds, mDefaultInstance.pose(), matrix);
     }
 
-    for (int i = 0; i < material->GetTextureCount(aiTextureType_SPECULAR); i++) {
-        aiString str;
-        material->GetTexture(aiTextureType_SPECULAR, i, &str);
-        
-        const aiTexture* embeddedTexture = scene->GetEmbeddedTexture(str.C_Str());
-        if (embeddedTexture) {
-            specularTexture = str.C_Str();
-            globalMaterialManager->addTexture(str.C_Str(), embeddedTexture);
+    // Skinning on the CPU doesn't read the palette.
+    if (mSkinningMode != SkinningMode::Cpu && (mUploadedInstance != &mDefaultInstance || mUploadedPoseVersion != mDefaultInstance.pose().version() || mUploadedMatrix != matrix)) {
+        mPaletteData.resize(std::max<size_t>(mPaletteData.size(), mPaletteRowLength));
+        writePaletteRow(0, mDefaultInstance);
+        uploadPalette(1);
+        mUploadedInstance = &mDefaultInstance;
+        mUploadedPoseVersion = mDefaultInstance.pose().version();
+        mUploadedMatrix = matrix;
+    }
+
+    if (mSkinningMode != SkinningMode::PerDraw) {
+        updateSkinnedCache();
+        drawCachedSubMeshes(selectLod(matrix), viewDistance(matrix));
+    }
+    else {
+        drawSubMeshes(selectLod(matrix), 0, 1, viewDistance(matrix));
+    }
+}
+
+int SkinnedMesh::selectLod(const glm::mat4& matrix) const {
+    const FrameBlock& frame = globalFrameUniforms.data();
+    glm::vec3 center = glm::vec3(frame.cameraInverseMatrix * matrix * glm::vec4(mBoundsCenter, 1.0f));
+    float scale = std::sqrt(std::max({
+        glm::dot(glm::vec3(matrix[0]), glm::vec3(matrix[0])),
+        glm::dot(glm::vec3(matrix[1]), glm::vec3(matrix[1])),
+        glm::dot(glm::vec3(matrix[2]), glm::vec3(matrix[2])) }));
+
+    // From the front of the bounding sphere, model units to fractions of the viewport height
+    float distance = std::max(-center.z - mBoundsRadius * scale, LOD_MIN_DISTANCE);
+    float screenScale = scale * frame.projectionMatrix[1][1] / (2.0f * distance);
+
+    int lod = 0;
+    while (lod + 1 < (int)mLodErrors.size() && mLodErrors[lod + 1] * screenScale <= LOD_SCREEN_ERROR) lod++;
+    return lod;
+}
+
+void SkinnedMesh::drawInstances(const std::vector<SkinnedMeshInstance*>& instances) {
+    PROFILE_ZONE("SkinnedMesh::drawInstances");
+
+    // Not loaded yet.
+    if (!mLoaded || instances.empty()) return;
+
+    // Instances only touch their own pose, so they are evaluated and culled in parallel.
+    {
+        PROFILE_ZONE("culling");
+        mInstanceVisible.resize(instances.size());
+        globalJobSystem.parallelFor(instances.size(), PALETTE_JOB_GRAIN, [&](int begin, int end) {
+            for (int i = begin; i < end; i++) {
+                SkinnedMeshInstance& instance = *instances[i];
+                instance.evaluatePose();
+                instance.mCulled = isCulled(mBoneBounds, instance.pose(), instance.matrix);
+                mInstanceVisible[i] = !instance.mCulled;
+            }
+        });
+    }
+
+    // Sort the visible instances by level of detail, so each level is a contiguous range of palette rows.
+    {
+        PROFILE_ZONE("LOD selection");
+        mInstanceLods.resize(instances.size());
+        mLodStarts.assign(mLodErrors.size() + 1, 0);
+        for (size_t i = 0; i < instances.size(); i++) {
+            if (!mInstanceVisible[i]) continue;
+            mInstanceLods[i] = selectLod(instances[i]->matrix);
+            mLodStarts[mInstanceLods[i] + 1]++;
         }
-        else {
-            specularTexture = assetPath + "/" + str.C_Str();
-            globalMaterialManager->getTexture(diffuseTexture);
+        for (size_t level = 0; level < mLodErrors.size(); level++) {
+            mLodStarts[level + 1] += mLodStarts[level];
+        }
+        mSortedInstances.resize(mLodStarts.back());
+        std::vector<size_t> next(mLodStarts.begin(), mLodStarts.end() - 1);
+        for (size_t i = 0; i < instances.size(); i++) {
+            if (mInstanceVisible[i]) mSortedInstances[next[mInstanceLods[i]]++] = instances[i];
         }
     }
+    mSubMeshVisible.assign(mSkinnedMeshes.size(), 1);
+
+    // Each row of the palette is an instance, so a batch can't have more instances than the texture has rows.
+    int maxRows = mMaxPaletteRows;
 
-    std::vector<SkinnedVertex> vertexBuffer{};
-    vertexBuffer.resize(mesh->mNumVertices);
-    
-    for (int i = 0; i < vertexBuffer.size(); i++) {
-        SkinnedVertex& v = vertexBuffer[i];
-        v.position = glm::vec3(mesh->mVertices[i].x, mesh->mVertices[i].y, mesh->mVertices[i].z);
-        v.normal = glm::vec3(mesh->mNormals[i].x, mesh->mNormals[i].y, mesh->mNormals[i].z);
-        v.uv = glm::vec2(mesh->mTextureCoords[0][i].x, mesh->mTextureCoords[0][i].y);
+    for (size_t first = 0; first < mSortedInstances.size(); first += maxRows) {
+        int count = (int)std::min<size_t>(maxRows, mSortedInstances.size() - first);
+
+        {
+            PROFILE_ZONE("palette");
+            mPaletteData.resize(std::max<size_t>(mPaletteData.size(), (size_t)count * mPaletteRowLength));
+            globalJobSystem.parallelFor(count, PALETTE_JOB_GRAIN, [&](int begin, int end) {
+                for (int i = begin; i < end; i++) {
+                    writePaletteRow(i, *mSortedInstances[first + i]);
+                }
+            });
+        }
 
-        for (int j = 0; j < sortedWeights[i].size(); j++) {
-            v.influence[j] = sortedWeights[i][j].first;
-            v.bone[j] = sortedWeights[i][j].second;
+        {
+            PROFILE_ZONE("palette upload");
+            // The draws of the previous batch read the rows about to be replaced.
+            if (first > 0) globalRenderQueue.flush(globalGLState);
+            uploadPalette(count);
         }
 
-        for (int j = sortedWeights[i].size(); j < 4; j++) {
-            v.influence[j] = 0.0;
-            v.bone[j] = 0;
+        // One draw per level present in the batch
+        for (size_t level = 0; level < mLodErrors.size(); level++) {
+            size_t begin = std::max(mLodStarts[level], first);
+            size_t end = std::min(mLodStarts[level + 1], first + count);
+            if (begin < end) drawSubMeshes(level, begin - first, end - begin, viewDistance(mSortedInstances[begin]->matrix));
         }
     }
 
-    std::vector<GLuint> indices;
-    for (unsigned int i = 0; i < mesh->mNumFaces; i++)
-        for (unsigned int j = 0; j < mesh->mFaces[i].mNumIndices; j++)
-            indices.push_back(mesh->mFaces[i].mIndices[j]);
+    mUploadedInstance = nullptr;
+}
 
-    GLuint vao, vbo, vi;
-    glGenVertexArrays(1, &vao);
-    glBindVertexArray(vao);
+void SkinnedMesh::writePaletteRow(int row, const SkinnedMeshInstance& instance) {
+    const std::vector<glm::mat4>& skinningMatrices = instance.pose().skinningMatrices();
+    glm::mat4* destination = &mPaletteData[(size_t)row * mPaletteRowLength];
+    destination[0] = instance.matrix;
+    std::copy(skinningMatrices.begin(), skinningMatrices.end(), destination + 1);
+}
 
-    glGenBuffers(1, &vbo);
-    glBindBuffer(GL_ARRAY_BUFFER, vbo);
-    glBufferData(GL_ARRAY_BUFFER, vertexBuffer.size() * sizeof(SkinnedVertex), &vertexBuffer.front(), GL_STATIC_DRAW);
+void SkinnedMesh::uploadPalette(int rows) {
+    int width = 4 * mPaletteRowLength;
 
-    glGenBuffers(1, &vi);
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, vi);
-    glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(GLuint), &indices.front(), GL_STATIC_DRAW);
+    if (mPaletteTexture == 0) {
+        glGenTextures(1, &mPaletteTexture);
+    }
 
-    glVertexAttribPointer(mShader->getAttribute("position"), 3, GL_FLOAT, GL_FALSE, sizeof(SkinnedVertex), (void*)offsetof(SkinnedVertex, position));
-    glVertexAttribPointer(mShader->getAttribute("normal"), 3, GL_FLOAT, GL_FALSE, sizeof(SkinnedVertex), (void*)offsetof(SkinnedVertex, normal));
-    glVertexAttribPointer(mShader->getAttribute("uv"), 2, GL_FLOAT, GL_FALSE, sizeof(SkinnedVertex), (void*)offsetof(SkinnedVertex, uv));
-    glVertexAttribIPointer(mShader->getAttribute("bone"), 4, GL_INT, sizeof(SkinnedVertex), (void*)offsetof(SkinnedVertex, bone));
-    glVertexAttribPointer(mShader->getAttribute("influence"), 4, GL_FLOAT, GL_FALSE, sizeof(SkinnedVertex), (void*)offsetof(SkinnedVertex, influence));
-    glEnableVertexAttribArray(0);
-    glEnableVertexAttribArray(1);
-    glEnableVertexAttribArray(2);
-    glEnableVertexAttribArray(3);
-    glEnableVertexAttribArray(4);
+    glActiveTexture(GL_TEXTURE0 + PALETTE_TEXTURE_UNIT);
+    glBindTexture(GL_TEXTURE_2D, mPaletteTexture);
 
-    glBindVertexArray(0);
-    //glDeleteBuffers(1, &vbo);
+    if (rows > mPaletteRows) {
+        // Grow in powers of two so that slowly growing crowds don't reallocate every frame.
+        mPaletteRows = 1;
+        while (mPaletteRows < rows) mPaletteRows *= 2;
+
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, width, mPaletteRows, 0, GL_RGBA, GL_FLOAT, nullptr);
+    }
+
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, width, rows, GL_RGBA, GL_FLOAT, mPaletteData.data());
+}
 
-    mSkinnedMeshes.push_back({ vao, (GLuint)indices.size(), diffuseTexture, specularTexture });
+float SkinnedMesh::viewDistance(const glm::mat4& matrix) const {
+    glm::vec3 center = glm::vec3(matrix * glm::vec4(mBoundsCenter, 1.0f));
+    return glm::distance(glm::vec3(globalFrameUniforms.data().cameraPosition), center);
 }
 
-void SkinnedMesh::createBoneMatrices(int parentIndex, const aiNode* currentBone, std::unordered_map<const aiNode*, const aiBone*>& nodeBones, std::unordered_map<const aiNode*, int>& boneMatrixIndices) {
-    // printf("Handling bone: %s\n", currentBone->mName.data);
-    if (currentBone == nullptr) return;
-    mBones.push_back({ parentIndex, boneMatrixIndices[currentBone], convertMatrix(currentBone->mTransformation), convertMatrix(nodeBones[currentBone]->mOffsetMatrix), std::string(currentBone->mName.data) });
-    int myIndex = mBones.size() - 1;
-    for (int i = 0; i < currentBone->mNumChildren; i++) {
-        if (boneMatrixIndices.find(currentBone->mChildren[i]) != boneMatrixIndices.end()) {
-            createBoneMatrices(myIndex, currentBone->mChildren[i], nodeBones, boneMatrixIndices);
+bool SkinnedMesh::posedBounds(const std::vector<SkinnedBoneBounds>& bounds, const SkeletonPose& pose, glm::vec3& minimum, glm::vec3& maximum) const {
+    const std::vector<glm::mat4>& skinningMatrices = pose.skinningMatrices();
+    if (bounds.empty()) return false;
+
+    minimum = glm::vec3(std::numeric_limits<float>::max());
+    maximum = glm::vec3(-std::numeric_limits<float>::max());
+    for (const SkinnedBoneBounds& box : bounds) {
+        if (box.matrixIndex >= (int)skinningMatrices.size()) return false;
+
+        // The posed bone turns the box into an oriented one, enclosed in an axis aligned box again.
+        glm::mat4 bone = skinningMatrices[box.matrixIndex] * mInverseOffsetMatrices[box.matrixIndex];
+        glm::vec3 center = glm::vec3(bone * glm::vec4(0.5f * (box.minimum + box.maximum), 1.0f));
+        glm::vec3 halfSize = 0.5f * (box.maximum - box.minimum);
+        glm::vec3 extent = glm::abs(glm::vec3(bone[0])) * halfSize.x + glm::abs(glm::vec3(bone[1])) * halfSize.y + glm::abs(glm::vec3(bone[2])) * halfSize.z;
+        minimum = glm::min(minimum, center - extent);
+        maximum = glm::max(maximum, center + extent);
+    }
+    return true;
+}
+
+bool SkinnedMesh::isCulled(const std::vector<SkinnedBoneBounds>& bounds, const SkeletonPose& pose, const glm::mat4& matrix) const {
+    glm::vec3 minimum, maximum;
+    if (!posedBounds(bounds, pose, minimum, maximum)) return false;
+
+    // Planes of the frustum in object space, from the rows of the clip matrix (Gribb and Hartmann). The box is outside
+    // if its corner furthest along the normal of a plane is behind it.
+    glm::mat4 clip = globalFrameUniforms.data().viewProjectionMatrix * matrix;
+    glm::vec4 w = glm::vec4(clip[0][3], clip[1][3], clip[2][3], clip[3][3]);
+    for (int axis = 0; axis < 3; axis++) {
+        glm::vec4 row = glm::vec4(clip[0][axis], clip[1][axis], clip[2][axis], clip[3][axis]);
+        for (glm::vec4 plane : { w + row, w - row }) {
+            glm::vec3 corner(plane.x >= 0.0f ? maximum.x : minimum.x, plane.y >= 0.0f ? maximum.y : minimum.y, plane.z >= 0.0f ? maximum.z : minimum.z);
+            if (glm::dot(glm::vec3(plane), corner) + plane.w < 0.0f) return true;
         }
     }
+    return false;
 }
 
-void SkinnedMesh::draw(glm::mat4 projection, glm::mat4 cameraInverse, glm::mat4 matrix) {
-    // Not loaded yet.
-    if (mSkinnedMeshes.size() == 0) return;
+void SkinnedMesh::drawSubMeshes(int lod, int firstInstance, int instanceCount, float depth) {
+    // Every sub-mesh shares the arena's vertex array, and textures of the same size and format share a texture array,
+    // so the queue usually only changes the layer between them. Using the textures marks them as used this frame,
+    // which keeps them resident.
+    DrawPacket packet;
+    packet.program = mShader->get();
+    packet.vertexArray = arena(mVertexFormat).vertexArray();
+    packet.textures[PALETTE_TEXTURE_UNIT] = { GL_TEXTURE_2D, mPaletteTexture };
+    packet.draw = &SkinnedMesh::drawPacket;
+    packet.object = this;
+    packet.arguments[PACKET_LOD] = lod;
+    packet.arguments[PACKET_FIRST_INSTANCE] = firstInstance;
+    packet.arguments[PACKET_INSTANCE_COUNT] = instanceCount;
+    submitSubMeshes(packet, depth);
+}
 
-    mShader->use();
+void SkinnedMesh::submitSubMeshes(DrawPacket& packet, float depth) {
+    for (size_t i = 0; i < mSkinnedMeshes.size(); i++) {
+        if (!mSubMeshVisible[i]) continue;
+        TextureLayer diffuse = globalMaterialManager->useTexture(mSkinnedMeshes[i].diffuseTexture);
+        TextureLayer specular = globalMaterialManager->useTexture(mSkinnedMeshes[i].specularTexture);
+        packet.textures[0] = { GL_TEXTURE_2D_ARRAY, diffuse.array };
+        packet.textures[1] = { GL_TEXTURE_2D_ARRAY, specular.array };
+        packet.arguments[PACKET_SUB_MESH] = i;
+        packet.arguments[PACKET_DIFFUSE_LAYER] = diffuse.layer;
+        globalRenderQueue.submit(packet, diffuse.array, depth);
+    }
+}
 
-    mBoneNodeMatrices[0] = glm::identity<glm::mat4>();
-    glm::mat4 globalInverse = glm::inverse(mBones[0].relativeMatrix);
-    for (int i = 0; i < mBones.size(); i++) {
-        mBoneNodeMatrices[i] = mBoneNodeMatrices[mBones[i].parent] * mBones[i].relativeMatrix;
-        mBoneMatrices[mBones[i].matrixIndex] = globalInverse * mBoneNodeMatrices[i] * mBones[i].offsetMatrix;
+void SkinnedMesh::drawPacket(const DrawPacket& packet) {
+    const SkinnedMesh& self = *(const SkinnedMesh*)packet.object;
+    const Mesh& mesh = self.mSkinnedMeshes[packet.arguments[PACKET_SUB_MESH]];
+    self.mFirstInstanceUniform.set(packet.arguments[PACKET_FIRST_INSTANCE]);
+    self.mDiffuseLayerUniform.set(packet.arguments[PACKET_DIFFUSE_LAYER]);
+
+    const SkinnedMeshLod& range = mesh.lods[std::min<size_t>(packet.arguments[PACKET_LOD], mesh.lods.size() - 1)];
+    arena(self.mVertexFormat).drawInstanced(mesh.geometry, range.firstIndex, range.indexCount, packet.arguments[PACKET_INSTANCE_COUNT]);
+}
+
+void SkinnedMesh::updateSkinnedCache() {
+    // A pose that hasn't changed is already in the cache. The object matrix isn't, so moving doesn't skin again.
+    uint64_t poseVersion = mDefaultInstance.pose().version();
+    if (mCacheFilled && mCachedPoseVersion == poseVersion) return;
+    PROFILE_ZONE("skin to buffer");
+
+    if (mCachedVertexBuffer == 0) {
+        glGenBuffers(1, &mCachedVertexBuffer);
+        glGenVertexArrays(1, &mCachedVertexArray);
+        glBindVertexArray(mCachedVertexArray);
+        glBindBuffer(GL_ARRAY_BUFFER, mCachedVertexBuffer);
+        glBufferData(GL_ARRAY_BUFFER, mCachedVertexCount * CACHED_VERTEX_SIZE, nullptr, GL_DYNAMIC_COPY);
+
+        auto attribute = [](GLuint location, GLint size, size_t offset) {
+            glVertexAttribPointer(location, size, GL_FLOAT, GL_FALSE, CACHED_VERTEX_SIZE, (void*)offset);
+            glEnableVertexAttribArray(location);
+        };
+        attribute(POSITION_LOCATION, 3, 0);
+        attribute(NORMAL_LOCATION, 3, 3 * sizeof(float));
+        attribute(UV_LOCATION, 2, 6 * sizeof(float));
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mCachedIndexBuffer);
+        glBindVertexArray(0);
+        // WebGL refuses transform feedback into a buffer that is also bound elsewhere.
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
     }
 
-    glUniformMatrix4fv(SkinnedMesh::mShader->getUniform("projectionMatrix"), 1, GL_FALSE, glm::value_ptr(projection));
-    glUniformMatrix4fv(SkinnedMesh::mShader->getUniform("cameraInverseMatrix"), 1, GL_FALSE, glm::value_ptr(cameraInverse));
-    glUniformMatrix4fv(SkinnedMesh::mShader->getUniform("objectMatrix"), 1, GL_FALSE, glm::value_ptr(matrix));
-    glUniformMatrix4fv(SkinnedMesh::mShader->getUniform("boneMatrices"), mBoneMatrices.size(), GL_FALSE, glm::value_ptr(mBoneMatrices.front()));
+    if (mSkinningMode == SkinningMode::Cpu) {
+        skinOnCpu();
+        mCacheFilled = true;
+        mCachedPoseVersion = poseVersion;
+        return;
+    }
 
-    for (auto& mesh : mSkinnedMeshes) {
-        glBindVertexArray(mesh.vertexArray);
-        glActiveTexture(GL_TEXTURE0);
-        glBindTexture(GL_TEXTURE_2D, globalMaterialManager->getTexture(mesh.diffuseTexture));
-        glActiveTexture(GL_TEXTURE1);
-        glBindTexture(GL_TEXTURE_2D, globalMaterialManager->getTexture(mesh.specularTexture));
+    // One point per vertex, read straight from the arena without indices, written in sub-mesh order.
+    skinShader(mVertexFormat).use();
+    glActiveTexture(GL_TEXTURE0 + PALETTE_TEXTURE_UNIT);
+    glBindTexture(GL_TEXTURE_2D, mPaletteTexture);
+    arena(mVertexFormat).bind();
+    glEnable(GL_RASTERIZER_DISCARD);
+    for (const Mesh& mesh : mSkinnedMeshes) {
+        if (mesh.geometry.vertexCount == 0) continue;
+        glBindBufferRange(GL_TRANSFORM_FEEDBACK_BUFFER, 0, mCachedVertexBuffer,
+            (GLintptr)mesh.cachedFirstVertex * CACHED_VERTEX_SIZE, (GLsizeiptr)mesh.geometry.vertexCount * CACHED_VERTEX_SIZE);
+        glBeginTransformFeedback(GL_POINTS);
+        glDrawArrays(GL_POINTS, mesh.geometry.firstVertex, mesh.geometry.vertexCount);
+        glEndTransformFeedback();
+    }
+    glDisable(GL_RASTERIZER_DISCARD);
+    glBindBufferBase(GL_TRANSFORM_FEEDBACK_BUFFER, 0, 0);
+    glBindVertexArray(0);
 
-        glDrawElements(GL_TRIANGLES, mesh.numIndices, GL_UNSIGNED_INT, 0);
+    mCacheFilled = true;
+    mCachedPoseVersion = poseVersion;
+}
+
+void SkinnedMesh::skinOnCpu() {
+    const std::vector<glm::mat4>& skinningMatrices = mDefaultInstance.pose().skinningMatrices();
+    mCpuSkinnedVertices.resize((size_t)mCachedVertexCount * CPU_SKINNED_VERTEX_FLOATS);
+    {
+        PROFILE_ZONE("cpu skinning");
+        globalJobSystem.parallelFor(mCachedVertexCount, CPU_SKINNING_JOB_GRAIN, [&](int begin, int end) {
+            skinVertices(mSkinningStreams, skinningMatrices.data(), begin, end, mCpuSkinnedVertices.data());
+        });
     }
+
+    PROFILE_ZONE("skinned vertex upload");
+    // Orphaning gives the buffer new storage, so the upload doesn't wait for draws still reading the previous pose.
+    GLsizeiptr size = mCpuSkinnedVertices.size() * sizeof(float);
+    glBindBuffer(GL_ARRAY_BUFFER, mCachedVertexBuffer);
+    glBufferData(GL_ARRAY_BUFFER, size, nullptr, GL_STREAM_DRAW);
+    glBufferSubData(GL_ARRAY_BUFFER, 0, size, mCpuSkinnedVertices.data());
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+void SkinnedMesh::drawCachedSubMeshes(int lod, float depth) {
+    DrawPacket packet;
+    packet.program = cachedShader().get();
+    packet.vertexArray = mCachedVertexArray;
+    packet.draw = &SkinnedMesh::drawCachedPacket;
+    packet.object = this;
+    packet.arguments[PACKET_LOD] = lod;
+    submitSubMeshes(packet, depth);
+}
+
+void SkinnedMesh::drawCachedPacket(const DrawPacket& packet) {
+    const SkinnedMesh& self = *(const SkinnedMesh*)packet.object;
+    const Mesh& mesh = self.mSkinnedMeshes[packet.arguments[PACKET_SUB_MESH]];
+    self.mCachedObjectMatrixUniform.set(self.mDefaultInstance.matrix);
+    self.mCachedDiffuseLayerUniform.set(packet.arguments[PACKET_DIFFUSE_LAYER]);
+
+    const SkinnedMeshLod& range = mesh.lods[std::min<size_t>(packet.arguments[PACKET_LOD], mesh.lods.size() - 1)];
+    const void* offset = (const void*)((uintptr_t)(mesh.cachedFirstIndex + range.firstIndex) * sizeof(uint32_t));
+    glDrawElements(GL_TRIANGLES, range.indexCount, GL_UNSIGNED_INT, offset);
+}
+
+void SkinnedMesh::setSkinningMode(SkinningMode mode) {
+    if (mode == mSkinningMode) return;
+    mSkinningMode = mode;
+    mCacheFilled = false;
+    if (mode != SkinningMode::Cpu) mCpuSkinnedVertices.clear();
+}
+
+void SkinnedMesh::setAnimation(std::string name) {
+    mDefaultInstance.setAnimation(name);
+}
+
+void SkinnedMesh::crossFade(std::string name, double duration) {
+    mDefaultInstance.crossFade(name, duration);
+}
+
+void SkinnedMesh::animate(double t) {
+    PROFILE_ZONE("SkinnedMesh::animate");
+    mDefaultInstance.animate(t);
+}
+
+void SkinnedMesh::evaluatePose() {
+    PROFILE_ZONE("pose evaluation");
+    mDefaultInstance.evaluatePose();
+}
+
+const SkinnedMeshAnimation* SkinnedMesh::findAnimation(const std::string& name) const {
+    auto found = mAnimations.find(name);
+    return found == mAnimations.end() ? nullptr : &found->second;
 }
 
 Bone& SkinnedMesh::getBone(std::string name) {
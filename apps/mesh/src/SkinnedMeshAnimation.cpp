@@ -1,113 +1,222 @@
 #include "SkinnedMesh.hpp"
 #include <glm/gtc/quaternion.hpp>
 #include <spdlog/spdlog.h>
+#include <algorithm>
+#include <cmath>
+
+SkinnedMeshInstance::SkinnedMeshInstance(SkinnedMesh& mesh) : mMesh(&mesh) {}
+
+bool SkinnedMeshInstance::prepare() {
+	if (mPrepared) return true;
+	if (!mMesh->isLoaded()) return false;
+
+	const std::vector<Bone>& bones = mMesh->getBones();
+	mPose.reset(bones);
+	mRestPose.resize(bones.size());
+	mBlendPose.resize(bones.size());
+	for (int b = 0; b < bones.size(); b++) {
+		mRestPose.translations[b] = mPose.translation(b);
+		mRestPose.rotations[b] = mPose.rotation(b);
+		mRestPose.scales[b] = mPose.scale(b);
+	}
 
-glm::vec3 convertVector(aiVector3D& v) {
-	return glm::vec3(v.x, v.y, v.z);
+	mPrepared = true;
+	for (AnimationLayer& layer : mLayers) {
+		if (layer.active) resolveLayer(layer);
+	}
+	return true;
 }
 
-glm::quat convertQuaternion(aiQuaternion& q) {
-	return glm::quat(q.w, q.x, q.y, q.z);
-}
+void SkinnedMeshInstance::resolveLayer(AnimationLayer& layer) {
+	if (!mPrepared) return;
 
-void SkinnedMesh::parseAnimation(const aiScene* scene) {
-	std::unordered_map<std::string, int> boneIndices{};
+	layer.animation = mMesh->findAnimation(layer.animationName);
+	// assign reuses the capacity of layers freed earlier.
+	layer.cursors.assign(layer.animation == nullptr ? 0 : layer.animation->clips.size(), BoneClipCursor());
+}
 
-	for (int b = 0; b < mBones.size(); b++) {
-		boneIndices[mBones[b].name] = b;
+void SkinnedMeshInstance::setAnimation(std::string name) {
+	for (AnimationLayer& layer : mLayers) {
+		layer.active = false;
 	}
 
-	for (int a = 0; a < scene->mNumAnimations; a++) {
-		aiAnimation* anim = scene->mAnimations[a];
+	int layer = addLayer(name, 1.0f);
+	// Play in phase with t, as if the animation had always been running.
+	mLayers[layer].startTime = 0.0;
+}
 
-		double timeScale = 1.0 / anim->mTicksPerSecond;
+void SkinnedMeshInstance::crossFade(std::string name, double duration) {
+	for (int l = 0; l < mLayers.size(); l++) {
+		if (mLayers[l].active && mLayers[l].mode == AnimationBlendMode::Override) {
+			setLayerWeight(l, 0.0f, duration);
+			mLayers[l].removeWhenFaded = true;
+		}
+	}
 
-		SkinnedMeshAnimation animation{ anim->mDuration / anim->mTicksPerSecond };
+	int layer = addLayer(name, 0.0f);
+	setLayerWeight(layer, 1.0f, duration);
+}
 
-		for (int c = 0; c < anim->mNumChannels; c++) {
-			aiNodeAnim* nodeAnim = anim->mChannels[c];
+int SkinnedMeshInstance::addLayer(std::string name, float weight, AnimationBlendMode mode) {
+	int index = 0;
+	while (index < mLayers.size() && mLayers[index].active) index++;
+	if (index == mLayers.size()) mLayers.emplace_back();
+
+	AnimationLayer& layer = mLayers[index];
+	layer.animationName = name;
+	layer.mode = mode;
+	layer.weight = weight;
+	layer.targetWeight = weight;
+	layer.fadeSpeed = 0.0f;
+	layer.startTime = mLastTime;
+	layer.removeWhenFaded = false;
+	layer.active = true;
+	resolveLayer(layer);
+	return index;
+}
 
-			if (boneIndices.find(nodeAnim->mNodeName.C_Str()) == boneIndices.end()) {
-				continue;
-			}
-			int boneIndex = boneIndices[nodeAnim->mNodeName.C_Str()];
+void SkinnedMeshInstance::setLayerWeight(int layer, float weight, double duration) {
+	if (layer < 0 || layer >= mLayers.size()) return;
 
-			BoneClip clip{ boneIndex };
+	AnimationLayer& l = mLayers[layer];
+	l.targetWeight = weight;
+	if (duration <= 0.0) {
+		l.weight = weight;
+		l.fadeSpeed = 0.0f;
+	}
+	else {
+		l.fadeSpeed = (float)(std::abs(weight - l.weight) / duration);
+	}
+}
 
-			for (int k = 0; k < nodeAnim->mNumPositionKeys; k++) {
-				aiVectorKey& key = nodeAnim->mPositionKeys[k];
-				clip.positionFrames.emplace_back(timeScale * key.mTime, convertVector(key.mValue));
-			}
+void SkinnedMeshInstance::removeLayer(int layer) {
+	if (layer < 0 || layer >= mLayers.size()) return;
+	mLayers[layer].active = false;
+}
 
-			for (int k = 0; k < nodeAnim->mNumScalingKeys; k++) {
-				aiVectorKey& key = nodeAnim->mScalingKeys[k];
-				clip.scaleFrames.emplace_back(timeScale * key.mTime, convertVector(key.mValue));
-			}
+void SkinnedMeshInstance::advanceFades(double dt) {
+	for (AnimationLayer& layer : mLayers) {
+		if (!layer.active) continue;
 
-			for (int k = 0; k < nodeAnim->mNumRotationKeys; k++) {
-				aiQuatKey& key = nodeAnim->mRotationKeys[k];
-				clip.rotationFrames.emplace_back(timeScale * key.mTime, convertQuaternion(key.mValue));
+		if (layer.weight != layer.targetWeight) {
+			float step = (float)(layer.fadeSpeed * dt);
+			if (std::abs(layer.targetWeight - layer.weight) <= step) {
+				layer.weight = layer.targetWeight;
+			}
+			else {
+				layer.weight += layer.targetWeight > layer.weight ? step : -step;
 			}
-
-			animation.clips.push_back(clip);
 		}
 
-		mAnimations[anim->mName.C_Str()] = animation;
-		spdlog::info("Animation name: {}", anim->mName.C_Str());
+		if (layer.removeWhenFaded && layer.weight <= 0.0f && layer.targetWeight <= 0.0f) {
+			layer.active = false;
+		}
 	}
 }
 
-void SkinnedMesh::animate(double t) {
-	if (mAnimations.find(mCurrentAnimation) == mAnimations.end()) return;
+void SkinnedMeshInstance::accumulateLayer(AnimationLayer& layer, double t) {
+	const SkinnedMeshAnimation& animation = *layer.animation;
+	float w = layer.weight;
+
+	double relT = animation.duration * glm::fract((t - layer.startTime) / animation.duration);
+	for (int c = 0; c < animation.clips.size(); c++) {
+		const CompressedBoneClip& clip = animation.clips[c];
+		BoneClipCursor& cursor = layer.cursors[c];
+		int b = clip.boneIndex;
 
-	SkinnedMeshAnimation& animation = mAnimations[mCurrentAnimation];
+		glm::quat rotation = clip.rotation.sample(relT, cursor.rotation);
+		// Keep every rotation in the rest rotation's hemisphere so the weighted sum doesn't cancel out.
+		if (glm::dot(rotation, mRestPose.rotations[b]) < 0.0f) rotation = -rotation;
 
-	double relT = animation.duration * glm::fract(t / animation.duration);
-	for (const BoneClip& clip : animation.clips) {
-		int i = 0;
-		float fac;
+		mBlendPose.translations[b] += w * clip.position.sample(relT, cursor.position);
+		mBlendPose.scales[b] += w * clip.scale.sample(relT, cursor.scale);
+		mBlendPose.rotations[b] = mBlendPose.rotations[b] + w * rotation;
+		mBlendPose.weights[b] += w;
+	}
+}
 
-		glm::vec3 position = { 0, 0, 0 };
-		glm::vec3 scale = { 1, 1, 1 };
-		glm::quat rotation = { 1, 0, 0, 0 };
+void SkinnedMeshInstance::resolveBlend() {
+	for (int b = 0; b < mBlendPose.weights.size(); b++) {
+		float total = mBlendPose.weights[b];
 
-		if (clip.positionFrames.size() > 1) {
-			for (i = 0; i < clip.positionFrames.size() - 2; i++) {
-				if (clip.positionFrames[i + 1].first > relT) break;
-			}
-			fac = glm::clamp((relT - clip.positionFrames[i].first) / (clip.positionFrames[i + 1].first - clip.positionFrames[i].first), 0.0, 1.0);
-			position = (1.0f - fac) * clip.positionFrames[i].second + fac * clip.positionFrames[i + 1].second;
-		}
-		else {
-			position = clip.positionFrames[0].second;
+		// Copy rest bones exactly so the pose doesn't mark them dirty.
+		if (total <= 0.0f) {
+			mBlendPose.translations[b] = mRestPose.translations[b];
+			mBlendPose.rotations[b] = mRestPose.rotations[b];
+			mBlendPose.scales[b] = mRestPose.scales[b];
+			continue;
 		}
 
-		if (clip.scaleFrames.size() > 1) {
-			for (i = 0; i < clip.scaleFrames.size() - 2; i++) {
-				if (clip.scaleFrames[i + 1].first > relT) break;
-			}
-			fac = glm::clamp((relT - clip.scaleFrames[i].first) / (clip.scaleFrames[i + 1].first - clip.scaleFrames[i].first), 0.0, 1.0);
-			scale = (1.0f - fac) * clip.scaleFrames[i].second + fac * clip.scaleFrames[i + 1].second;
-		}
-		else {
-			scale = clip.scaleFrames[0].second;
+		// Layers fading in from nothing blend with the rest pose.
+		if (total < 1.0f) {
+			float rest = 1.0f - total;
+			mBlendPose.translations[b] += rest * mRestPose.translations[b];
+			mBlendPose.scales[b] += rest * mRestPose.scales[b];
+			mBlendPose.rotations[b] = mBlendPose.rotations[b] + rest * mRestPose.rotations[b];
+			total = 1.0f;
 		}
 
-		if (clip.rotationFrames.size() > 1) {
-			for (i = 0; i < clip.rotationFrames.size() - 2; i++) {
-				if (clip.rotationFrames[i + 1].first > relT) break;
-			}
-			fac = glm::clamp((relT - clip.rotationFrames[i].first) / (clip.rotationFrames[i + 1].first - clip.rotationFrames[i].first), 0.0, 1.0);
-			rotation = glm::slerp(clip.rotationFrames[i].second, clip.rotationFrames[i + 1].second, fac);
+		mBlendPose.translations[b] /= total;
+		mBlendPose.scales[b] /= total;
+		mBlendPose.rotations[b] = glm::normalize(mBlendPose.rotations[b]);
+	}
+}
+
+void SkinnedMeshInstance::applyAdditiveLayer(AnimationLayer& layer, double t) {
+	const SkinnedMeshAnimation& animation = *layer.animation;
+	float w = layer.weight;
+
+	double relT = animation.duration * glm::fract((t - layer.startTime) / animation.duration);
+	for (int c = 0; c < animation.clips.size(); c++) {
+		const CompressedBoneClip& clip = animation.clips[c];
+		BoneClipCursor& cursor = layer.cursors[c];
+		int b = clip.boneIndex;
+
+		// The first frame is the reference the offsets are measured from. Sampling at 0 finds it without a search.
+		BoneClipCursor first;
+		glm::vec3 position = clip.position.sample(relT, cursor.position) - clip.position.sample(0.0, first.position);
+		glm::vec3 referenceScale = clip.scale.sample(0.0, first.scale);
+		glm::vec3 scale = clip.scale.sample(relT, cursor.scale) / glm::max(referenceScale, glm::vec3(1e-6f));
+		glm::quat rotation = glm::inverse(clip.rotation.sample(0.0, first.rotation)) * clip.rotation.sample(relT, cursor.rotation);
+
+		mBlendPose.translations[b] += w * position;
+		mBlendPose.scales[b] *= glm::mix(glm::vec3(1.0f), scale, w);
+		mBlendPose.rotations[b] = glm::normalize(mBlendPose.rotations[b] * glm::slerp(glm::quat(1, 0, 0, 0), rotation, w));
+	}
+}
+
+void SkinnedMeshInstance::animate(double t) {
+	if (!prepare()) return;
+
+	advanceFades(mAnimated ? glm::max(0.0, t - mLastTime) : 0.0);
+	mLastTime = t;
+	mAnimated = true;
+
+	std::fill(mBlendPose.translations.begin(), mBlendPose.translations.end(), glm::vec3(0.0f));
+	std::fill(mBlendPose.rotations.begin(), mBlendPose.rotations.end(), glm::quat(0, 0, 0, 0));
+	std::fill(mBlendPose.scales.begin(), mBlendPose.scales.end(), glm::vec3(0.0f));
+	std::fill(mBlendPose.weights.begin(), mBlendPose.weights.end(), 0.0f);
+
+	for (AnimationLayer& layer : mLayers) {
+		if (layer.active && layer.animation != nullptr && layer.mode == AnimationBlendMode::Override && layer.weight > 0.0f) {
+			accumulateLayer(layer, t);
 		}
-		else {
-			rotation = clip.rotationFrames[0].second;
+	}
+
+	resolveBlend();
+
+	for (AnimationLayer& layer : mLayers) {
+		if (layer.active && layer.animation != nullptr && layer.mode == AnimationBlendMode::Additive && layer.weight > 0.0f) {
+			applyAdditiveLayer(layer, t);
 		}
+	}
 
-		mBones[clip.boneIndex].relativeMatrix = glm::scale(glm::translate(glm::identity<glm::mat4>(), position) * glm::mat4_cast(rotation), scale);
+	for (int b = 0; b < mBlendPose.weights.size(); b++) {
+		mPose.setLocal(b, mBlendPose.translations[b], mBlendPose.rotations[b], mBlendPose.scales[b]);
 	}
 }
 
-void SkinnedMesh::setAnimation(std::string name) {
-	mCurrentAnimation = name;
+void SkinnedMeshInstance::evaluatePose() {
+	if (!prepare()) return;
+	mPose.evaluate(mMesh->getBones());
 }
@@ -0,0 +1,781 @@
+#include "SkinnedMeshData.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <glm/gtc/packing.hpp>
+#include <spdlog/spdlog.h>
+
+#include "CookedAsset.hpp"
+#include "MeshOptimizer.hpp"
+#include "MeshSimplifier.hpp"
+#include "fetch.hpp"
+
+#ifndef __EMSCRIPTEN__
+#include <filesystem>
+#include <map>
+#include <assimp/DefaultIOSystem.h>
+#include <assimp/Importer.hpp>
+#include <assimp/MemoryIOWrapper.h>
+#endif
+
+constexpr auto BONES_PER_VERTEX = 4;
+// Levels of detail per sub-mesh, including the full one. Each simplified level targets half the triangles of the
+// previous one.
+constexpr int MAX_LODS = 4;
+// Largest simplification error allowed, relative to the radius of the sub-mesh
+constexpr float LOD_MAX_RELATIVE_ERROR = 0.05f;
+// A level removing fewer triangles of the previous one than this fraction isn't worth its indices
+constexpr float LOD_MIN_REDUCTION = 0.2f;
+
+static_assert(sizeof(PackedSkinnedVertex) == 28, "PackedSkinnedVertex must stay tightly packed");
+
+struct WeightSmallerComparator
+{
+	bool operator()(const std::pair<float, int>& s1, std::pair<float, int>& s2)
+	{
+		return s1.first < s2.first && s1.second == s2.second;
+	}
+};
+
+static glm::mat4 convertMatrix(const aiMatrix4x4& aiMat)
+{
+	return {
+	aiMat.a1, aiMat.b1, aiMat.c1, aiMat.d1,
+	aiMat.a2, aiMat.b2, aiMat.c2, aiMat.d2,
+	aiMat.a3, aiMat.b3, aiMat.c3, aiMat.d3,
+	aiMat.a4, aiMat.b4, aiMat.c4, aiMat.d4
+	};
+}
+
+static glm::vec3 convertVector(const aiVector3D& v) {
+	return glm::vec3(v.x, v.y, v.z);
+}
+
+static glm::quat convertQuaternion(const aiQuaternion& q) {
+	return glm::quat(q.w, q.x, q.y, q.z);
+}
+
+static void createBoneMatrices(std::vector<Bone>& bones, int parentIndex, const aiNode* currentBone, std::unordered_map<const aiNode*, const aiBone*>& nodeBones, std::unordered_map<const aiNode*, int>& boneMatrixIndices) {
+	if (currentBone == nullptr) return;
+	bones.push_back({ parentIndex, boneMatrixIndices[currentBone], convertMatrix(currentBone->mTransformation), convertMatrix(nodeBones[currentBone]->mOffsetMatrix), std::string(currentBone->mName.data) });
+	int myIndex = bones.size() - 1;
+	for (int i = 0; i < currentBone->mNumChildren; i++) {
+		if (boneMatrixIndices.find(currentBone->mChildren[i]) != boneMatrixIndices.end()) {
+			createBoneMatrices(bones, myIndex, currentBone->mChildren[i], nodeBones, boneMatrixIndices);
+		}
+	}
+}
+
+static SkinnedMeshTexture importTexture(const aiScene* scene, const aiMaterial* material, aiTextureType type, SkinnedMeshData& data) {
+	SkinnedMeshTexture texture;
+
+	for (int i = 0; i < material->GetTextureCount(type); i++) {
+		aiString str;
+		material->GetTexture(type, i, &str);
+		texture.name = str.C_Str();
+
+		const aiTexture* embeddedTexture = scene->GetEmbeddedTexture(str.C_Str());
+		texture.embedded = embeddedTexture != nullptr;
+		if (embeddedTexture && !data.embeddedTextures.count(texture.name)) {
+			// A height of 0 means the texture holds a compressed image file of mWidth bytes.
+			if (embeddedTexture->mHeight == 0) {
+				const unsigned char* bytes = (const unsigned char*)embeddedTexture->pcData;
+				data.embeddedTextures[texture.name].assign(bytes, bytes + embeddedTexture->mWidth);
+			}
+			else {
+				spdlog::warn("Embedded texture {} isn't an image file and is ignored", texture.name);
+			}
+		}
+	}
+
+	return texture;
+}
+
+// Vertices the simplifier must not move: those on an edge of a single triangle, which is a border or a UV or normal
+// seam where Assimp split the vertices, and those on an edge between regions where different bones dominate.
+static std::vector<uint8_t> lockedLodVertices(const std::vector<SkinnedVertex>& vertices, const std::vector<uint32_t>& indices) {
+	std::vector<int> dominantBone(vertices.size());
+	for (size_t v = 0; v < vertices.size(); v++) {
+		int largest = 0;
+		for (int j = 1; j < BONES_PER_VERTEX; j++) {
+			if (vertices[v].influence[j] > vertices[v].influence[largest]) largest = j;
+		}
+		dominantBone[v] = vertices[v].bone[largest];
+	}
+
+	std::vector<uint8_t> locked(vertices.size(), 0);
+	std::unordered_map<uint64_t, int> edgeTriangles;
+	for (size_t t = 0; t < indices.size(); t += 3) {
+		for (int k = 0; k < 3; k++) {
+			uint32_t a = indices[t + k], b = indices[t + (k + 1) % 3];
+			edgeTriangles[(uint64_t)std::min(a, b) << 32 | std::max(a, b)]++;
+			if (dominantBone[a] != dominantBone[b]) locked[a] = locked[b] = 1;
+		}
+	}
+	for (const auto& [edge, triangles] : edgeTriangles) {
+		if (triangles == 1) locked[edge >> 32] = locked[edge & 0xffffffff] = 1;
+	}
+	return locked;
+}
+
+// Append simplified copies of the first level's indices, each ordered for the vertex cache.
+static void buildLods(const std::vector<SkinnedVertex>& vertices, std::vector<uint32_t>& indices, std::vector<SkinnedMeshLod>& lods) {
+	glm::vec3 minimum = vertices[0].position, maximum = vertices[0].position;
+	for (const SkinnedVertex& v : vertices) {
+		minimum = glm::min(minimum, v.position);
+		maximum = glm::max(maximum, v.position);
+	}
+	float maxError = LOD_MAX_RELATIVE_ERROR * 0.5f * glm::length(maximum - minimum);
+
+	std::vector<uint8_t> locked = lockedLodVertices(vertices, indices);
+	std::vector<uint32_t> simplified(indices.size());
+	size_t fullCount = indices.size();
+	size_t previousCount = fullCount;
+	for (int level = 1; level < MAX_LODS; level++) {
+		float error;
+		size_t count = simplifyMesh(simplified.data(), indices.data(), fullCount, &vertices[0].position, sizeof(SkinnedVertex),
+			vertices.size(), locked.data(), previousCount / 6 * 3, maxError, error);
+		if (count == 0 || count > previousCount * (1.0f - LOD_MIN_REDUCTION)) break;
+
+		optimizeVertexCache(simplified.data(), count, vertices.size());
+		lods.push_back({ (uint32_t)indices.size(), (uint32_t)count, error });
+		indices.insert(indices.end(), simplified.begin(), simplified.begin() + count);
+		previousCount = count;
+	}
+}
+
+// Bounds of the vertices each bone influences, in the space of the bone.
+static std::vector<SkinnedBoneBounds> computeBoneBounds(const std::vector<SkinnedVertex>& vertices, const std::vector<Bone>& bones) {
+	std::vector<const glm::mat4*> offsetMatrices;
+	for (const Bone& bone : bones) {
+		if (bone.matrixIndex >= (int)offsetMatrices.size()) offsetMatrices.resize(bone.matrixIndex + 1, nullptr);
+		offsetMatrices[bone.matrixIndex] = &bone.offsetMatrix;
+	}
+
+	// Indexed by matrix index, with empty boxes for bones that don't influence the sub-mesh
+	std::vector<SkinnedBoneBounds> bounds(offsetMatrices.size());
+	for (size_t b = 0; b < bounds.size(); b++) {
+		bounds[b] = { (int32_t)b, glm::vec3(std::numeric_limits<float>::max()), glm::vec3(-std::numeric_limits<float>::max()) };
+	}
+	for (const SkinnedVertex& vertex : vertices) {
+		for (int j = 0; j < BONES_PER_VERTEX; j++) {
+			int b = vertex.bone[j];
+			if (vertex.influence[j] <= 0.0f || b < 0 || b >= (int)bounds.size() || offsetMatrices[b] == nullptr) continue;
+			glm::vec3 position = glm::vec3(*offsetMatrices[b] * glm::vec4(vertex.position, 1.0f));
+			bounds[b].minimum = glm::min(bounds[b].minimum, position);
+			bounds[b].maximum = glm::max(bounds[b].maximum, position);
+		}
+	}
+
+	bounds.erase(std::remove_if(bounds.begin(), bounds.end(), [](const SkinnedBoneBounds& box) { return box.minimum.x > box.maximum.x; }), bounds.end());
+	return bounds;
+}
+
+static void importSubMesh(const aiScene* scene, const aiMesh* mesh, const std::vector<std::vector<std::pair<float, int>>>& sortedWeights, SkinnedMeshData& data) {
+	const aiMaterial* material = scene->mMaterials[mesh->mMaterialIndex];
+
+	data.meshes.emplace_back();
+	SkinnedSubMeshData& subMesh = data.meshes.back();
+	subMesh.diffuse = importTexture(scene, material, aiTextureType_DIFFUSE, data);
+	subMesh.specular = importTexture(scene, material, aiTextureType_SPECULAR, data);
+
+	std::vector<SkinnedVertex>& vertexBuffer = subMesh.vertexStorage;
+	vertexBuffer.resize(mesh->mNumVertices);
+
+	for (int i = 0; i < vertexBuffer.size(); i++) {
+		SkinnedVertex& v = vertexBuffer[i];
+		v.position = glm::vec3(mesh->mVertices[i].x, mesh->mVertices[i].y, mesh->mVertices[i].z);
+		v.normal = glm::vec3(mesh->mNormals[i].x, mesh->mNormals[i].y, mesh->mNormals[i].z);
+		v.uv = glm::vec2(mesh->mTextureCoords[0][i].x, mesh->mTextureCoords[0][i].y);
+
+		for (int j = 0; j < sortedWeights[i].size(); j++) {
+			v.influence[j] = sortedWeights[i][j].first;
+			v.bone[j] = sortedWeights[i][j].second;
+		}
+
+		for (int j = sortedWeights[i].size(); j < 4; j++) {
+			v.influence[j] = 0.0;
+			v.bone[j] = 0;
+		}
+	}
+
+	std::vector<uint32_t>& indices = subMesh.indexStorage;
+	for (unsigned int i = 0; i < mesh->mNumFaces; i++)
+		for (unsigned int j = 0; j < mesh->mFaces[i].mNumIndices; j++)
+			indices.push_back(mesh->mFaces[i].mIndices[j]);
+
+	// Triangle order first, then vertex order, since the fetch order follows the triangles.
+	bool triangles = !indices.empty() && indices.size() % 3 == 0;
+	float acmrBefore = computeACMR(indices.data(), indices.size(), vertexBuffer.size());
+	if (triangles) {
+		optimizeVertexCache(indices.data(), indices.size(), vertexBuffer.size());
+		optimizeOverdraw(indices.data(), indices.size(), &vertexBuffer[0].position, sizeof(SkinnedVertex), vertexBuffer.size());
+		vertexBuffer.resize(optimizeVertexFetch(indices.data(), indices.size(), vertexBuffer.data(), vertexBuffer.size(), sizeof(SkinnedVertex)));
+	}
+	float acmrAfter = computeACMR(indices.data(), indices.size(), vertexBuffer.size());
+
+	size_t triangleCount = indices.size() / 3;
+	subMesh.lods.push_back({ 0, (uint32_t)indices.size(), 0.0f });
+	if (triangles) {
+		buildLods(vertexBuffer, indices, subMesh.lods);
+	}
+	subMesh.boneBounds = computeBoneBounds(vertexBuffer, data.bones);
+	bool shortIndices = vertexBuffer.size() < 65536;
+	if (shortIndices) {
+		subMesh.shortIndexStorage.assign(indices.begin(), indices.end());
+		indices = std::vector<uint32_t>();
+	}
+	spdlog::info("Sub-mesh {}: {} vertices, {} triangles, ACMR {:.3f} -> {:.3f}, {}-bit indices, {} bones",
+		mesh->mName.C_Str(), vertexBuffer.size(), triangleCount,
+		acmrBefore, acmrAfter, shortIndices ? 16 : 32, subMesh.boneBounds.size());
+	for (size_t level = 1; level < subMesh.lods.size(); level++) {
+		spdlog::info("  LOD {}: {} triangles, error {}", level, subMesh.lods[level].indexCount / 3, subMesh.lods[level].error);
+	}
+
+	subMesh.packedVertexStorage.resize(vertexBuffer.size());
+	if (!packSkinnedVertices(vertexBuffer.data(), vertexBuffer.size(), subMesh.packedVertexStorage.data())) {
+		subMesh.packedVertexStorage.clear();
+	}
+
+	// Moving the sub-mesh keeps the storage buffers in place, so these stay valid.
+	subMesh.vertices = vertexBuffer.data();
+	subMesh.vertexCount = vertexBuffer.size();
+	subMesh.packedVertices = subMesh.packedVertexStorage.empty() ? nullptr : subMesh.packedVertexStorage.data();
+	subMesh.indices = shortIndices ? nullptr : indices.data();
+	subMesh.shortIndices = shortIndices ? subMesh.shortIndexStorage.data() : nullptr;
+	subMesh.indexCount = shortIndices ? subMesh.shortIndexStorage.size() : indices.size();
+}
+
+// Round to a signed 10-bit integer, as read back by GL_INT_2_10_10_10_REV with normalization.
+static uint32_t packSnorm10(float value) {
+	int quantized = (int)std::round(glm::clamp(value, -1.0f, 1.0f) * 511.0f);
+	return (uint32_t)quantized & 0x3ff;
+}
+
+bool packSkinnedVertices(const SkinnedVertex* vertices, size_t count, PackedSkinnedVertex* packed) {
+	for (size_t i = 0; i < count; i++) {
+		const SkinnedVertex& v = vertices[i];
+		PackedSkinnedVertex& p = packed[i];
+
+		p.position = v.position;
+		glm::vec3 normal = glm::length(v.normal) > 0.0f ? glm::normalize(v.normal) : v.normal;
+		p.normal = packSnorm10(normal.x) | packSnorm10(normal.y) << 10 | packSnorm10(normal.z) << 20;
+		p.uv = glm::packHalf2x16(v.uv);
+
+		// Quantize the weights so they sum to exactly 255, giving the rounding error to the largest one.
+		float sum = v.influence[0] + v.influence[1] + v.influence[2] + v.influence[3];
+		int total = 0;
+		int largest = 0;
+		for (int j = 0; j < 4; j++) {
+			if (v.bone[j] < 0 || v.bone[j] > 255) return false;
+			p.bone[j] = v.bone[j];
+			p.influence[j] = sum > 0.0f ? (uint8_t)std::round(255.0f * v.influence[j] / sum) : 0;
+			total += p.influence[j];
+			if (v.influence[j] > v.influence[largest]) largest = j;
+		}
+		if (sum > 0.0f) {
+			p.influence[largest] += 255 - total;
+		}
+	}
+
+	return true;
+}
+
+static void importAnimations(const aiScene* scene, SkinnedMeshData& data) {
+	std::unordered_map<std::string, int> boneIndices{};
+
+	for (int b = 0; b < data.bones.size(); b++) {
+		boneIndices[data.bones[b].name] = b;
+	}
+
+	for (int a = 0; a < scene->mNumAnimations; a++) {
+		aiAnimation* anim = scene->mAnimations[a];
+
+		double timeScale = 1.0 / anim->mTicksPerSecond;
+
+		SkinnedMeshAnimation animation{ anim->mDuration / anim->mTicksPerSecond };
+		ClipCompressionStats stats;
+
+		for (int c = 0; c < anim->mNumChannels; c++) {
+			aiNodeAnim* nodeAnim = anim->mChannels[c];
+
+			if (boneIndices.find(nodeAnim->mNodeName.C_Str()) == boneIndices.end()) {
+				continue;
+			}
+			int boneIndex = boneIndices[nodeAnim->mNodeName.C_Str()];
+
+			BoneClip clip{ boneIndex };
+
+			for (int k = 0; k < nodeAnim->mNumPositionKeys; k++) {
+				aiVectorKey& key = nodeAnim->mPositionKeys[k];
+				clip.positionFrames.emplace_back(timeScale * key.mTime, convertVector(key.mValue));
+			}
+
+			for (int k = 0; k < nodeAnim->mNumScalingKeys; k++) {
+				aiVectorKey& key = nodeAnim->mScalingKeys[k];
+				clip.scaleFrames.emplace_back(timeScale * key.mTime, convertVector(key.mValue));
+			}
+
+			for (int k = 0; k < nodeAnim->mNumRotationKeys; k++) {
+				aiQuatKey& key = nodeAnim->mRotationKeys[k];
+				clip.rotationFrames.emplace_back(timeScale * key.mTime, convertQuaternion(key.mValue));
+			}
+
+			animation.clips.push_back(compressClip(clip, ClipCompressionSettings(), stats));
+		}
+
+
+		data.animations[anim->mName.C_Str()] = animation;
+		spdlog::info("Animation name: {}", anim->mName.C_Str());
+		spdlog::info("Compressed {} keys to {}, {} KB to {} KB. Max error: position {}, scale {}, rotation {} rad",
+			stats.keysBefore, stats.keysAfter, stats.bytesBefore / 1024, stats.bytesAfter / 1024,
+			stats.maxPositionError, stats.maxScaleError, stats.maxRotationError);
+	}
+}
+
+bool importSkinnedMesh(const aiScene* scene, SkinnedMeshData& data) {
+	aiNode* armature = nullptr;
+	std::vector<aiMesh*> meshesToParse{};
+	std::unordered_map<const aiNode*, int> boneMatrixIndices;
+	std::unordered_map<const aiNode*, const aiBone*> nodeBones;
+	std::vector<aiBone*> foundBones;
+	int boneMatrixCounter = 0;
+	for (int i = 0; i < scene->mNumMeshes; i++) {
+		aiMesh* mesh = scene->mMeshes[i];
+		bool alreadyListed = false;
+
+		if (armature == nullptr && mesh->HasBones()) {
+			armature = scene->mMeshes[i]->mBones[0]->mArmature;
+		}
+
+		for (int b = 0; b < mesh->mNumBones; b++) {
+			aiBone* bone = mesh->mBones[b];
+			if (armature == mesh->mBones[b]->mArmature) {
+				if (!alreadyListed) {
+					meshesToParse.push_back(mesh);
+					alreadyListed = true;
+				}
+
+				if (boneMatrixIndices.find(bone->mNode) == boneMatrixIndices.end()) {
+					boneMatrixIndices[bone->mNode] = boneMatrixCounter++;
+					foundBones.push_back(bone);
+					nodeBones[bone->mNode] = bone;
+				}
+			}
+		}
+	}
+
+	if (armature == nullptr) {
+		spdlog::warn("No armature was found. Object will be empty.");
+		return false;
+	}
+
+	for (aiBone* foundBone : foundBones) {
+		aiNode* currentNode = foundBone->mNode;
+		while (currentNode != nullptr) {
+			if (boneMatrixIndices.find(currentNode) == boneMatrixIndices.end()) {
+				boneMatrixIndices[currentNode] = boneMatrixCounter++;
+				nodeBones[currentNode] = foundBone;
+			}
+			if (currentNode == armature) {
+				break;
+			}
+			currentNode = currentNode->mParent;
+		}
+	}
+
+	createBoneMatrices(data.bones, 0, armature, nodeBones, boneMatrixIndices);
+
+	for (aiMesh* mesh : meshesToParse) {
+		std::vector<std::vector<std::pair<float, int>>> boneInfluencesPerVertex{};
+
+		boneInfluencesPerVertex.resize(mesh->mNumVertices);
+
+		for (int b = 0; b < mesh->mNumBones; b++) {
+			aiBone* bone = mesh->mBones[b];
+			for (int bv = 0; bv < bone->mNumWeights; bv++) {
+				std::vector<std::pair<float, int>>& currentVertex = boneInfluencesPerVertex[bone->mWeights[bv].mVertexId];
+				if (currentVertex.size() < BONES_PER_VERTEX - 1) {
+					// add and don't sort
+					currentVertex.emplace_back(bone->mWeights[bv].mWeight, boneMatrixIndices[bone->mNode]);
+				}
+				else if (currentVertex.size() == BONES_PER_VERTEX - 1) {
+					// add and build heap
+					currentVertex.emplace_back(bone->mWeights[bv].mWeight, boneMatrixIndices[bone->mNode]);
+					std::make_heap(currentVertex.begin(), currentVertex.end(), WeightSmallerComparator());
+				}
+				else if (currentVertex.front().first < bone->mWeights[bv].mWeight) {
+					// add only if there is more weight than the current maximum, and remove the smallest in that case
+					std::pop_heap(currentVertex.begin(), currentVertex.end(), WeightSmallerComparator());
+					currentVertex.pop_back();
+					currentVertex.emplace_back(bone->mWeights[bv].mWeight, boneMatrixIndices[bone->mNode]);
+					std::push_heap(currentVertex.begin(), currentVertex.end());
+				}
+			}
+		}
+
+		importSubMesh(scene, mesh, boneInfluencesPerVertex, data);
+	}
+
+	importAnimations(scene, data);
+	return true;
+}
+
+// Layout of a cooked mesh, after the header: the source dependencies, bones, then for each sub-mesh its textures and aligned arrays of full
+// vertices, packed vertices if they fit and 16 or 32-bit indices of every level of detail and bone bounds,
+// animations, and embedded textures.
+struct CookedMeshHeader {
+	CookedHeader common;
+	// Catch a vertex layout change that forgot to bump the version
+	uint32_t vertexSize;
+	uint32_t packedVertexSize;
+	uint32_t boneCount;
+	uint32_t meshCount;
+	uint32_t animationCount;
+	uint32_t textureCount;
+	uint32_t dependencyCount;
+};
+
+static void writeVectorTrack(CookedWriter& writer, const CompressedVectorTrack& track) {
+	writer.write(track.minimum);
+	writer.write(track.range);
+	writer.writeVector(track.times);
+	writer.writeVector(track.values);
+}
+
+static bool readVectorTrack(CookedReader& reader, CompressedVectorTrack& track) {
+	return reader.read(track.minimum) && reader.read(track.range) && reader.readVector(track.times) && reader.readVector(track.values);
+}
+
+static void writeTexture(CookedWriter& writer, const SkinnedMeshTexture& texture) {
+	writer.writeString(texture.name);
+	writer.write<uint8_t>(texture.embedded);
+}
+
+static bool readTexture(CookedReader& reader, SkinnedMeshTexture& texture) {
+	uint8_t embedded;
+	if (!reader.readString(texture.name) || !reader.read(embedded)) return false;
+	texture.embedded = embedded != 0;
+	return true;
+}
+
+bool writeCookedMesh(const std::string& path, const SkinnedMeshData& data, uint64_t sourceHash) {
+	CookedWriter writer;
+
+	CookedMeshHeader header{};
+	memcpy(header.common.magic, COOKED_MESH_MAGIC, sizeof(header.common.magic));
+	header.common.version = COOKED_MESH_VERSION;
+	header.common.sourceHash = sourceHash;
+	header.vertexSize = sizeof(SkinnedVertex);
+	header.packedVertexSize = sizeof(PackedSkinnedVertex);
+	header.boneCount = data.bones.size();
+	header.meshCount = data.meshes.size();
+	header.animationCount = data.animations.size();
+	header.textureCount = data.embeddedTextures.size();
+	header.dependencyCount = data.sourceDependencies.size();
+	writer.write(header);
+
+	for (const std::string& dependency : data.sourceDependencies) {
+		writer.writeString(dependency);
+	}
+
+	for (const Bone& bone : data.bones) {
+		writer.write<int32_t>(bone.parent);
+		writer.write<int32_t>(bone.matrixIndex);
+		writer.write(bone.relativeMatrix);
+		writer.write(bone.offsetMatrix);
+		writer.writeString(bone.name);
+	}
+
+	for (const SkinnedSubMeshData& mesh : data.meshes) {
+		writeTexture(writer, mesh.diffuse);
+		writeTexture(writer, mesh.specular);
+		writer.write(mesh.vertexCount);
+		writer.write(mesh.indexCount);
+		writer.writeVector(mesh.lods);
+		writer.writeVector(mesh.boneBounds);
+		writer.write<uint8_t>(mesh.packedVertices != nullptr);
+		writer.write<uint8_t>(mesh.shortIndices != nullptr);
+		writer.writeArray(mesh.vertices, mesh.vertexCount);
+		if (mesh.packedVertices) {
+			writer.writeArray(mesh.packedVertices, mesh.vertexCount);
+		}
+		if (mesh.shortIndices) {
+			writer.writeArray(mesh.shortIndices, mesh.indexCount);
+		}
+		else {
+			writer.writeArray(mesh.indices, mesh.indexCount);
+		}
+	}
+
+	for (const auto& [name, animation] : data.animations) {
+		writer.writeString(name);
+		writer.write(animation.duration);
+		writer.write<uint32_t>(animation.clips.size());
+		for (const CompressedBoneClip& clip : animation.clips) {
+			writer.write<int32_t>(clip.boneIndex);
+			writeVectorTrack(writer, clip.position);
+			writeVectorTrack(writer, clip.scale);
+			writer.writeVector(clip.rotation.times);
+			writer.writeVector(clip.rotation.values);
+		}
+	}
+
+	for (const auto& [name, bytes] : data.embeddedTextures) {
+		writer.writeString(name);
+		writer.writeVector(bytes);
+	}
+
+	return writeCookedFile(path, writer.buffer());
+}
+
+bool readCookedMesh(const unsigned char* bytes, size_t size, std::optional<uint64_t> sourceHash, SkinnedMeshData& data) {
+	CookedReader reader(bytes, size);
+
+	CookedMeshHeader header;
+	if (!reader.read(header) ||
+		memcmp(header.common.magic, COOKED_MESH_MAGIC, sizeof(header.common.magic)) != 0 ||
+		header.common.version != COOKED_MESH_VERSION ||
+		header.vertexSize != sizeof(SkinnedVertex) ||
+		header.packedVertexSize != sizeof(PackedSkinnedVertex) ||
+		(sourceHash && header.common.sourceHash != *sourceHash)) {
+		return false;
+	}
+
+	data = SkinnedMeshData();
+
+	data.sourceDependencies.resize(header.dependencyCount);
+	for (std::string& dependency : data.sourceDependencies) {
+		if (!reader.readString(dependency)) return false;
+	}
+
+	data.bones.resize(header.boneCount);
+	for (Bone& bone : data.bones) {
+		int32_t parent, matrixIndex;
+		if (!reader.read(parent) || !reader.read(matrixIndex) ||
+			!reader.read(bone.relativeMatrix) || !reader.read(bone.offsetMatrix) ||
+			!reader.readString(bone.name)) {
+			return false;
+		}
+		bone.parent = parent;
+		bone.matrixIndex = matrixIndex;
+	}
+	int32_t matrixCount = 0;
+	for (const Bone& bone : data.bones) matrixCount = std::max(matrixCount, bone.matrixIndex + 1);
+
+	data.meshes.resize(header.meshCount);
+	for (SkinnedSubMeshData& mesh : data.meshes) {
+		uint8_t packed, shortIndices;
+		if (!readTexture(reader, mesh.diffuse) || !readTexture(reader, mesh.specular) ||
+			!reader.read(mesh.vertexCount) || !reader.read(mesh.indexCount) || !reader.readVector(mesh.lods) ||
+			!reader.readVector(mesh.boneBounds) || !reader.read(packed) || !reader.read(shortIndices) ||
+			!reader.view(mesh.vertices, mesh.vertexCount) ||
+			(packed && !reader.view(mesh.packedVertices, mesh.vertexCount)) ||
+			(shortIndices && !reader.view(mesh.shortIndices, mesh.indexCount)) ||
+			(!shortIndices && !reader.view(mesh.indices, mesh.indexCount))) {
+			return false;
+		}
+		bool lodsInRange = std::all_of(mesh.lods.begin(), mesh.lods.end(), [&mesh](const SkinnedMeshLod& lod) {
+			return lod.firstIndex <= mesh.indexCount && lod.indexCount <= mesh.indexCount - lod.firstIndex;
+		});
+		if (mesh.lods.empty() || !lodsInRange) return false;
+		bool boundsInRange = std::all_of(mesh.boneBounds.begin(), mesh.boneBounds.end(), [matrixCount](const SkinnedBoneBounds& bounds) {
+			return bounds.matrixIndex >= 0 && bounds.matrixIndex < matrixCount;
+		});
+		if (!boundsInRange) return false;
+	}
+
+	for (uint32_t a = 0; a < header.animationCount; a++) {
+		std::string name;
+		SkinnedMeshAnimation animation;
+		uint32_t clipCount;
+		if (!reader.readString(name) || !reader.read(animation.duration) || !reader.read(clipCount)) return false;
+
+		animation.clips.resize(clipCount);
+		for (CompressedBoneClip& clip : animation.clips) {
+			int32_t boneIndex;
+			if (!reader.read(boneIndex) ||
+				!readVectorTrack(reader, clip.position) ||
+				!readVectorTrack(reader, clip.scale) ||
+				!reader.readVector(clip.rotation.times) ||
+				!reader.readVector(clip.rotation.values)) {
+				return false;
+			}
+			clip.boneIndex = boneIndex;
+		}
+
+		data.animations[name] = std::move(animation);
+	}
+
+	for (uint32_t t = 0; t < header.textureCount; t++) {
+		std::string name;
+		if (!reader.readString(name) || !reader.readVector(data.embeddedTextures[name])) return false;
+	}
+
+	return true;
+}
+
+#ifndef __EMSCRIPTEN__
+
+// Hash of the contents of one source file
+static uint64_t sourceFileHash(const unsigned char* bytes, size_t size) {
+	return cookedSourceHash(bytes, size, (uint64_t)COOKED_MESH_VERSION << 32 | SKINNED_MESH_IMPORT_FLAGS);
+}
+
+// Chain each dependency's name and contents hash onto the model's hash
+static uint64_t combineSourceHashes(uint64_t modelHash, const std::vector<std::string>& dependencies, const std::vector<uint64_t>& dependencyHashes) {
+	uint64_t hash = modelHash;
+	for (size_t i = 0; i < dependencies.size(); i++) {
+		hash = cookedSourceHash((const unsigned char*)dependencies[i].data(), dependencies[i].size(), hash);
+		hash = cookedSourceHash((const unsigned char*)&dependencyHashes[i], sizeof(uint64_t), hash);
+	}
+	return hash;
+}
+
+// Assimp's file system, hashing every file an import reads. Files are read whole and handed to Assimp from memory, so
+// the hashes are of the very bytes imported even if a file changes on disk meanwhile.
+class RecordingIOSystem : public Assimp::DefaultIOSystem {
+public:
+	using DefaultIOSystem::Open;
+
+	Assimp::IOStream* Open(const char* file, const char* mode) override {
+		Assimp::IOStream* stream = DefaultIOSystem::Open(file, mode);
+		if (!stream || mode[0] != 'r') return stream;
+
+		size_t size = stream->FileSize();
+		uint8_t* bytes = new uint8_t[size];
+		bool complete = size == 0 || stream->Read(bytes, 1, size) == size;
+		DefaultIOSystem::Close(stream);
+
+		// A file read twice with different contents changed during the import, so it has no hash.
+		std::optional<uint64_t> hash;
+		if (complete) hash = sourceFileHash(bytes, size);
+		std::string path = std::filesystem::absolute(file).lexically_normal().string();
+		auto [found, added] = mHashes.try_emplace(path, hash);
+		if (!added && found->second != hash) found->second = std::nullopt;
+
+		// The stream owns the bytes
+		return new Assimp::MemoryIOStream(bytes, size, true);
+	}
+
+	// Contents hash of each file read, by absolute path
+	const std::map<std::string, std::optional<uint64_t>>& hashes() const {
+		return mHashes;
+	}
+
+private:
+	std::map<std::string, std::optional<uint64_t>> mHashes;
+};
+
+const aiScene* readSkinnedMeshFile(Assimp::Importer& loader, const std::string& sourcePath, std::vector<std::string>& dependencies, std::optional<uint64_t>& sourceHash) {
+	// The importer owns its file system
+	RecordingIOSystem* files = new RecordingIOSystem();
+	loader.SetIOHandler(files);
+	// Read from the path rather than a mapping, so formats with separate buffer files like glTF can find them.
+	const aiScene* scene = loader.ReadFile(sourcePath, SKINNED_MESH_IMPORT_FLAGS);
+
+	std::filesystem::path model = std::filesystem::absolute(sourcePath).lexically_normal();
+	std::optional<uint64_t> modelHash;
+	bool hashed = true;
+	std::vector<std::pair<std::string, uint64_t>> read;
+	for (const auto& [file, hash] : files->hashes()) {
+		if (!hash) hashed = false;
+		std::filesystem::path path(file);
+		if (path == model) {
+			modelHash = hash;
+		}
+		else if (hash) {
+			read.push_back({ path.lexically_relative(model.parent_path()).generic_string(), *hash });
+		}
+	}
+	std::sort(read.begin(), read.end());
+
+	dependencies.clear();
+	std::vector<uint64_t> dependencyHashes;
+	for (const auto& [dependency, hash] : read) {
+		dependencies.push_back(dependency);
+		dependencyHashes.push_back(hash);
+	}
+	sourceHash.reset();
+	if (hashed && modelHash) sourceHash = combineSourceHashes(*modelHash, dependencies, dependencyHashes);
+	return scene;
+}
+
+std::optional<uint64_t> cookedMeshSourceHash(const std::string& sourcePath, const std::vector<std::string>& dependencies) {
+	FetchedData source;
+	if (!source.map(sourcePath)) return std::nullopt;
+	uint64_t modelHash = sourceFileHash(source.data(), source.size());
+
+	std::filesystem::path directory = std::filesystem::path(sourcePath).parent_path();
+	std::vector<uint64_t> dependencyHashes;
+	for (const std::string& dependency : dependencies) {
+		FetchedData file;
+		if (!file.map((directory / dependency).string())) return std::nullopt;
+		dependencyHashes.push_back(sourceFileHash(file.data(), file.size()));
+	}
+	return combineSourceHashes(modelHash, dependencies, dependencyHashes);
+}
+
+std::optional<uint64_t> currentCookedMeshSourceHash(const unsigned char* cooked, size_t size, const std::string& sourcePath) {
+	CookedReader reader(cooked, size);
+
+	CookedMeshHeader header;
+	if (!reader.read(header) ||
+		memcmp(header.common.magic, COOKED_MESH_MAGIC, sizeof(header.common.magic)) != 0 ||
+		header.common.version != COOKED_MESH_VERSION) {
+		return std::nullopt;
+	}
+
+	std::vector<std::string> dependencies(header.dependencyCount);
+	for (std::string& dependency : dependencies) {
+		if (!reader.readString(dependency)) return std::nullopt;
+	}
+	return cookedMeshSourceHash(sourcePath, dependencies);
+}
+
+bool loadSkinnedMesh(const std::string& sourcePath, const std::string& cookedPath, SkinnedMeshData& data) {
+	auto start = std::chrono::steady_clock::now();
+	auto elapsedMs = [&start] {
+		return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+	};
+
+	if (!cookedPath.empty()) {
+		auto cooked = std::make_shared<FetchedData>();
+		if (cooked->map(cookedPath)) {
+			std::optional<uint64_t> sourceHash = currentCookedMeshSourceHash(cooked->data(), cooked->size(), sourcePath);
+			if (sourceHash && readCookedMesh(cooked->data(), cooked->size(), sourceHash, data)) {
+				// The sub-meshes point into the mapping
+				data.cookedFile = cooked;
+				spdlog::info("Loaded cooked {} in {:.1f} ms", sourcePath, elapsedMs());
+				return true;
+			}
+			spdlog::info("Cooked {} is out of date, importing again", cookedPath);
+		}
+	}
+
+	Assimp::Importer loader;
+	std::vector<std::string> dependencies;
+	std::optional<uint64_t> sourceHash;
+	const aiScene* scene = readSkinnedMeshFile(loader, sourcePath, dependencies, sourceHash);
+	if (!scene) {
+		spdlog::critical("Couldn't load model file! {}", loader.GetErrorString());
+		return false;
+	}
+
+	data = SkinnedMeshData();
+	if (!importSkinnedMesh(scene, data)) return false;
+	data.sourceDependencies = std::move(dependencies);
+	spdlog::info("Imported {} in {:.1f} ms", sourcePath, elapsedMs());
+
+	// Without a hash a source changed while it was imported, so the data may not match any version of it.
+	if (cookedPath.empty() || !sourceHash) return true;
+	if (writeCookedMesh(cookedPath, data, *sourceHash)) {
+		spdlog::info("Wrote cooked mesh {}", cookedPath);
+	}
+	return true;
+}
+
+#endif
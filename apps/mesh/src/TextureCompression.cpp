@@ -0,0 +1,315 @@
+#include "TextureCompression.hpp"
+
+#include <algorithm>
+#include <climits>
+#include <cmath>
+
+// Intensity modifiers of the ETC1 tables, as {a, b} for the pixel indices +a, +b, -a, -b
+static const int ETC_MODIFIERS[8][2] = {
+	{ 2, 8 }, { 5, 17 }, { 9, 29 }, { 13, 42 }, { 18, 60 }, { 24, 80 }, { 33, 106 }, { 47, 183 },
+};
+
+// Alpha modifiers of the EAC tables, scaled by the multiplier of each block
+static const int EAC_MODIFIERS[16][8] = {
+	{ -3, -6, -9, -15, 2, 5, 8, 14 },
+	{ -3, -7, -10, -13, 2, 6, 9, 12 },
+	{ -2, -5, -8, -13, 1, 4, 7, 12 },
+	{ -2, -4, -6, -13, 1, 3, 5, 12 },
+	{ -3, -6, -8, -12, 2, 5, 7, 11 },
+	{ -3, -7, -9, -11, 2, 6, 8, 10 },
+	{ -4, -7, -8, -11, 3, 6, 7, 10 },
+	{ -3, -5, -8, -11, 2, 4, 7, 10 },
+	{ -2, -6, -8, -10, 1, 5, 7, 9 },
+	{ -2, -5, -8, -10, 1, 4, 7, 9 },
+	{ -2, -4, -8, -10, 1, 3, 7, 9 },
+	{ -2, -5, -7, -10, 1, 4, 6, 9 },
+	{ -3, -4, -7, -10, 2, 3, 6, 9 },
+	{ -1, -2, -3, -10, 0, 1, 2, 9 },
+	{ -4, -6, -8, -9, 3, 5, 7, 8 },
+	{ -3, -5, -7, -9, 2, 4, 6, 8 },
+};
+
+static int clampByte(int value) {
+	return std::clamp(value, 0, 255);
+}
+
+static int etcModifier(int table, int index) {
+	int modifier = ETC_MODIFIERS[table][index & 1];
+	return index & 2 ? -modifier : modifier;
+}
+
+// Pixels of the two halves of a block, row by row. Unflipped halves are 2x4 side by side, flipped ones are 4x2.
+static void subblockPixels(bool flip, int half, int pixels[8]) {
+	int n = 0;
+	for (int y = 0; y < 4; y++) {
+		for (int x = 0; x < 4; x++) {
+			if ((flip ? y / 2 : x / 2) == half) pixels[n++] = y * 4 + x;
+		}
+	}
+}
+
+// Bits of each pixel's index in a block, where pixels are numbered down the columns.
+static int indexBit(int pixel) {
+	return (pixel % 4) * 4 + pixel / 4;
+}
+
+// Squared error of a half block for a base color, with the best table and the index of each of its pixels.
+struct SubblockFit {
+	int error = INT_MAX;
+	int table = 0;
+	uint8_t indices[8] = {};
+};
+
+static SubblockFit fitSubblock(const uint8_t pixels[64], const int members[8], const int base[3]) {
+	SubblockFit best;
+	for (int table = 0; table < 8; table++) {
+		SubblockFit fit;
+		fit.error = 0;
+		fit.table = table;
+		for (int p = 0; p < 8 && fit.error < best.error; p++) {
+			const uint8_t* pixel = &pixels[members[p] * 4];
+			int bestError = INT_MAX;
+			for (int index = 0; index < 4; index++) {
+				int modifier = etcModifier(table, index);
+				int error = 0;
+				for (int c = 0; c < 3; c++) {
+					int difference = clampByte(base[c] + modifier) - pixel[c];
+					error += difference * difference;
+				}
+				if (error < bestError) {
+					bestError = error;
+					fit.indices[p] = index;
+				}
+			}
+			fit.error += bestError;
+		}
+		if (fit.error < best.error) best = fit;
+	}
+	return best;
+}
+
+static void writeBigEndian(uint64_t bits, uint8_t block[8]) {
+	for (int i = 0; i < 8; i++) block[i] = bits >> (56 - i * 8);
+}
+
+static uint64_t readBigEndian(const uint8_t block[8]) {
+	uint64_t bits = 0;
+	for (int i = 0; i < 8; i++) bits = bits << 8 | block[i];
+	return bits;
+}
+
+void encodeEtc2RgbBlock(const uint8_t pixels[64], uint8_t block[ETC2_RGB_BLOCK_SIZE]) {
+	int bestError = INT_MAX;
+	uint64_t bestBits = 0;
+
+	for (int flip = 0; flip < 2; flip++) {
+		int members[2][8];
+		float average[2][3] = {};
+		for (int half = 0; half < 2; half++) {
+			subblockPixels(flip, half, members[half]);
+			for (int p = 0; p < 8; p++) {
+				for (int c = 0; c < 3; c++) average[half][c] += pixels[members[half][p] * 4 + c] / 8.0f;
+			}
+		}
+
+		for (int differential = 0; differential < 2; differential++) {
+			// Base colors are 4 bits per channel each, or 5 bits with the second one a 3-bit delta from the first.
+			int levels = differential ? 31 : 15;
+			int quantized[2][3], base[2][3];
+			bool fits = true;
+			for (int half = 0; half < 2; half++) {
+				for (int c = 0; c < 3; c++) {
+					int q = (int)std::lround(average[half][c] * levels / 255.0f);
+					quantized[half][c] = q;
+					base[half][c] = differential ? (q << 3) | (q >> 2) : q * 17;
+				}
+			}
+			for (int c = 0; c < 3 && differential; c++) {
+				int delta = quantized[1][c] - quantized[0][c];
+				fits = fits && delta >= -4 && delta <= 3;
+			}
+			if (!fits) continue;
+
+			SubblockFit halves[2] = { fitSubblock(pixels, members[0], base[0]), fitSubblock(pixels, members[1], base[1]) };
+			int error = halves[0].error + halves[1].error;
+			if (error >= bestError) continue;
+			bestError = error;
+
+			uint64_t bits = 0;
+			for (int c = 0; c < 3; c++) {
+				int shift = 56 - c * 8;
+				if (differential) {
+					int delta = quantized[1][c] - quantized[0][c];
+					bits |= (uint64_t)quantized[0][c] << (shift + 3) | (uint64_t)(delta & 7) << shift;
+				}
+				else {
+					bits |= (uint64_t)quantized[0][c] << (shift + 4) | (uint64_t)quantized[1][c] << shift;
+				}
+			}
+			bits |= (uint64_t)halves[0].table << 37 | (uint64_t)halves[1].table << 34;
+			bits |= (uint64_t)differential << 33 | (uint64_t)flip << 32;
+			for (int half = 0; half < 2; half++) {
+				for (int p = 0; p < 8; p++) {
+					int bit = indexBit(members[half][p]);
+					int index = halves[half].indices[p];
+					bits |= (uint64_t)(index >> 1) << (16 + bit) | (uint64_t)(index & 1) << bit;
+				}
+			}
+			bestBits = bits;
+		}
+	}
+
+	writeBigEndian(bestBits, block);
+}
+
+bool decodeEtc2RgbBlock(const uint8_t block[ETC2_RGB_BLOCK_SIZE], uint8_t pixels[64]) {
+	uint64_t bits = readBigEndian(block);
+	bool differential = bits >> 33 & 1;
+	bool flip = bits >> 32 & 1;
+
+	int base[2][3];
+	for (int c = 0; c < 3; c++) {
+		int shift = 56 - c * 8;
+		if (differential) {
+			int first = bits >> (shift + 3) & 31;
+			int delta = (int)(bits >> shift & 7) << 29 >> 29;
+			int second = first + delta;
+			// Out of range deltas select the T, H and planar modes.
+			if (second < 0 || second > 31) return false;
+			base[0][c] = (first << 3) | (first >> 2);
+			base[1][c] = (second << 3) | (second >> 2);
+		}
+		else {
+			base[0][c] = (bits >> (shift + 4) & 15) * 17;
+			base[1][c] = (bits >> shift & 15) * 17;
+		}
+	}
+	int tables[2] = { (int)(bits >> 37 & 7), (int)(bits >> 34 & 7) };
+
+	for (int half = 0; half < 2; half++) {
+		int members[8];
+		subblockPixels(flip, half, members);
+		for (int p = 0; p < 8; p++) {
+			int bit = indexBit(members[p]);
+			int index = (int)(bits >> (16 + bit) & 1) << 1 | (int)(bits >> bit & 1);
+			int modifier = etcModifier(tables[half], index);
+			for (int c = 0; c < 3; c++) pixels[members[p] * 4 + c] = clampByte(base[half][c] + modifier);
+		}
+	}
+	return true;
+}
+
+void encodeEacAlphaBlock(const uint8_t pixels[64], uint8_t block[8]) {
+	int lowest = 255, highest = 0;
+	for (int p = 0; p < 16; p++) {
+		lowest = std::min<int>(lowest, pixels[p * 4 + 3]);
+		highest = std::max<int>(highest, pixels[p * 4 + 3]);
+	}
+
+	// Table 13 has a zero modifier, which stores uniform alpha exactly.
+	int bestError = INT_MAX;
+	int bestBase = lowest, bestMultiplier = 1, bestTable = 13;
+	uint8_t bestIndices[16];
+	std::fill(bestIndices, bestIndices + 16, 4);
+
+	for (int table = 0; table < 16 && bestError > 0 && highest > lowest; table++) {
+		const int* modifiers = EAC_MODIFIERS[table];
+		int tableLow = modifiers[3], tableHigh = modifiers[7];
+		// Multipliers around the one stretching the table over the alpha range, each centered on it
+		int estimate = (int)std::lround((float)(highest - lowest) / (tableHigh - tableLow));
+		for (int multiplier = std::max(1, estimate - 1); multiplier <= std::min(15, estimate + 1); multiplier++) {
+			int base = clampByte((int)std::lround((highest + lowest) / 2.0f - (tableHigh + tableLow) * multiplier / 2.0f));
+
+			int error = 0;
+			uint8_t indices[16];
+			for (int p = 0; p < 16 && error < bestError; p++) {
+				int alpha = pixels[p * 4 + 3];
+				int pixelError = INT_MAX;
+				for (int index = 0; index < 8; index++) {
+					int difference = clampByte(base + modifiers[index] * multiplier) - alpha;
+					if (difference * difference < pixelError) {
+						pixelError = difference * difference;
+						indices[p] = index;
+					}
+				}
+				error += pixelError;
+			}
+			if (error < bestError) {
+				bestError = error;
+				bestBase = base;
+				bestMultiplier = multiplier;
+				bestTable = table;
+				std::copy(indices, indices + 16, bestIndices);
+			}
+		}
+	}
+
+	uint64_t bits = (uint64_t)bestBase << 56 | (uint64_t)bestMultiplier << 52 | (uint64_t)bestTable << 48;
+	for (int p = 0; p < 16; p++) {
+		bits |= (uint64_t)bestIndices[p] << (45 - 3 * indexBit(p));
+	}
+	writeBigEndian(bits, block);
+}
+
+void decodeEacAlphaBlock(const uint8_t block[8], uint8_t pixels[64]) {
+	uint64_t bits = readBigEndian(block);
+	int base = bits >> 56 & 255;
+	int multiplier = bits >> 52 & 15;
+	const int* modifiers = EAC_MODIFIERS[bits >> 48 & 15];
+	for (int p = 0; p < 16; p++) {
+		int index = bits >> (45 - 3 * indexBit(p)) & 7;
+		pixels[p * 4 + 3] = clampByte(base + modifiers[index] * multiplier);
+	}
+}
+
+size_t etc2ImageSize(uint32_t width, uint32_t height, uint32_t channels) {
+	size_t blocks = (size_t)((width + 3) / 4) * ((height + 3) / 4);
+	return blocks * (channels == 4 ? ETC2_RGBA_BLOCK_SIZE : ETC2_RGB_BLOCK_SIZE);
+}
+
+void compressEtc2Image(const uint8_t* pixels, uint32_t width, uint32_t height, uint32_t channels, uint8_t* blocks) {
+	uint8_t block[64];
+	for (uint32_t blockY = 0; blockY < height; blockY += 4) {
+		for (uint32_t blockX = 0; blockX < width; blockX += 4) {
+			for (uint32_t y = 0; y < 4; y++) {
+				for (uint32_t x = 0; x < 4; x++) {
+					const uint8_t* pixel = &pixels[((size_t)std::min(blockY + y, height - 1) * width + std::min(blockX + x, width - 1)) * channels];
+					uint8_t* destination = &block[(y * 4 + x) * 4];
+					destination[0] = pixel[0];
+					destination[1] = pixel[1];
+					destination[2] = pixel[2];
+					destination[3] = channels == 4 ? pixel[3] : 255;
+				}
+			}
+
+			if (channels == 4) {
+				encodeEacAlphaBlock(block, blocks);
+				blocks += 8;
+			}
+			encodeEtc2RgbBlock(block, blocks);
+			blocks += ETC2_RGB_BLOCK_SIZE;
+		}
+	}
+}
+
+bool decompressEtc2Image(const uint8_t* blocks, uint32_t width, uint32_t height, uint32_t channels, uint8_t* pixels) {
+	uint8_t block[64];
+	for (uint32_t blockY = 0; blockY < height; blockY += 4) {
+		for (uint32_t blockX = 0; blockX < width; blockX += 4) {
+			if (channels == 4) {
+				decodeEacAlphaBlock(blocks, block);
+				blocks += 8;
+			}
+			if (!decodeEtc2RgbBlock(blocks, block)) return false;
+			blocks += ETC2_RGB_BLOCK_SIZE;
+
+			for (uint32_t y = 0; y < 4 && blockY + y < height; y++) {
+				for (uint32_t x = 0; x < 4 && blockX + x < width; x++) {
+					const uint8_t* source = &block[(y * 4 + x) * 4];
+					std::copy(source, source + channels, &pixels[((size_t)(blockY + y) * width + blockX + x) * channels]);
+				}
+			}
+		}
+	}
+	return true;
+}
@@ -6,7 +6,21 @@
 #include <glm/ext/matrix_clip_space.hpp>
 #include <glm/ext/matrix_transform.hpp>
 #include "MaterialManager.hpp"
+#include "profiler.hpp"
+#include "jobs.hpp"
+#include "renderqueue.hpp"
+#include "uniforms.hpp"
 #include <spdlog/spdlog.h>
+#include <cmath>
+#include <cstring>
+#include <vector>
+
+// Largest crowd selectable in the UI
+constexpr int MAX_CROWD_SIZE = 4096;
+// Distance between neighbouring characters of the crowd
+constexpr float CROWD_SPACING = 2.0f;
+// Characters per job when animating the crowd in parallel
+constexpr int ANIMATE_JOB_GRAIN = 16;
 
 #ifndef __EMSCRIPTEN__
 void debugCallback(GLenum source, GLenum type, GLuint id, GLenum severity, GLsizei length, const GLchar* message, const void* userParam) {
@@ -15,11 +29,27 @@ void debugCallback(GLenum source, GLenum type, GLuint id, GLenum severity, GLsiz
 #endif
 
 class App : public BaseScaffold {
+public:
+    // Number of characters drawn. More than one uses instanced rendering.
+    int mCrowdSize = 1;
+    // Vertex layout of the character's buffers
+    SkinnedVertexFormat mVertexFormat = SkinnedVertexFormat::Full;
+    // Bytes of textures kept loaded, or 0 for no limit
+    size_t mTextureBudget = 0;
+    // How the single character is skinned
+    SkinningMode mSkinningMode = SkinningMode::PerDraw;
+    // Leave characters outside the view at their last pose until they are drawn again
+    bool mSkipCulledAnimation = true;
+
+private:
     void setup() {
         mGlobalMaterialManager = std::make_unique<MaterialManager>();
         globalMaterialManager = mGlobalMaterialManager.get();
-        mMesh = std::make_unique<SkinnedMesh>("dancing_vampire/dancing_vampire.dae");
+        globalMaterialManager->setBudget(mTextureBudget);
+        mMesh = std::make_unique<SkinnedMesh>("dancing_vampire/dancing_vampire.dae", mVertexFormat);
         mMesh->setAnimation("Hips");
+        mMesh->setSkinningMode(mSkinningMode);
+        spdlog::info("CPU skinning uses {}", skinningInstructionSet());
         glEnable(GL_DEPTH_TEST);
         glDepthFunc(GL_LESS);
 
@@ -33,11 +63,53 @@ class App : public BaseScaffold {
         globalMaterialManager->unloadTextures();
     }
 
+    int imgui() {
+        ImGui::Begin("Crowd");
+        ImGui::SliderInt("Characters", &mCrowdSize, 1, MAX_CROWD_SIZE);
+        if (mCrowdSize > 1) ImGui::Text("Drawn: %d", (int)mMesh->drawnInstanceCount());
+        ImGui::Checkbox("Skip animating culled", &mSkipCulledAnimation);
+        int skinningMode = (int)mSkinningMode;
+        ImGui::RadioButton("Skin per draw", &skinningMode, (int)SkinningMode::PerDraw);
+        ImGui::RadioButton("Skin once", &skinningMode, (int)SkinningMode::SkinOnce);
+        ImGui::RadioButton("Skin on CPU", &skinningMode, (int)SkinningMode::Cpu);
+        if (skinningMode != (int)mSkinningMode) {
+            mSkinningMode = (SkinningMode)skinningMode;
+            mMesh->setSkinningMode(mSkinningMode);
+        }
+        ImGui::Text("Textures: %.1f MB in %d arrays", globalMaterialManager->residentBytes() / (1024.0f * 1024.0f), (int)globalMaterialManager->arrayCount());
+        ImGui::End();
+        return 1;
+    }
+
+    // Create or remove instances to match the crowd size, laying them out on a square grid.
+    void updateCrowd() {
+        int side = (int)std::ceil(std::sqrt((float)mCrowdSize));
+        while (mInstances.size() < (size_t)mCrowdSize) {
+            mInstances.push_back(std::make_unique<SkinnedMeshInstance>(*mMesh));
+            mInstances.back()->setAnimation("Hips");
+        }
+        mInstances.resize(mCrowdSize);
+
+        mInstancePointers.clear();
+        for (int i = 0; i < mCrowdSize; i++) {
+            float x = (i % side - 0.5f * (side - 1)) * CROWD_SPACING;
+            float z = (i / side - 0.5f * (side - 1)) * CROWD_SPACING;
+            glm::mat4 modelMatrix = glm::translate(glm::identity<glm::mat4>(), glm::vec3(x, 0.0f, z));
+            mInstances[i]->matrix = glm::scale(modelMatrix, glm::vec3(0.02f, 0.02f, 0.02f));
+            mInstancePointers.push_back(mInstances[i].get());
+        }
+    }
+
     void draw() {
-        float nowTime = glfwGetTime();
+        float nowTime = time;
+        globalMaterialManager->beginFrame();
+
+        // Pull the camera back so the whole crowd stays in view.
+        float crowdExtent = std::ceil(std::sqrt((float)mCrowdSize)) * CROWD_SPACING;
+        float cameraDistance = mCrowdSize > 1 ? 5.0f + crowdExtent : 5.0f;
 
         float aspect = height == 0 || width == 0 ? 1.0 : (float)width / height;
-        glm::mat4 projectionMatrix = glm::perspective(glm::radians(90.0f), aspect, 1.0f, 10.0f);
+        glm::mat4 projectionMatrix = glm::perspective(glm::radians(90.0f), aspect, 1.0f, 5.0f + 2.0f * cameraDistance);
 
         glm::mat4 cameraMatrix = glm::identity<glm::mat4>();
 
@@ -48,21 +120,70 @@ class App : public BaseScaffold {
         // Rotate camera towards above (pitch)
         cameraMatrix = glm::rotate(cameraMatrix, glm::radians(-15.0f), glm::vec3(1.0f, 0.0f, 0.0f));
         // Move camera away from the subject
-        cameraMatrix = glm::translate(cameraMatrix, glm::vec3(0.0f, 0.0f, 5.0f));
+        cameraMatrix = glm::translate(cameraMatrix, glm::vec3(0.0f, 0.0f, cameraDistance));
+
+        globalFrameUniforms.update(projectionMatrix, glm::inverse(cameraMatrix));
 
-        glm::mat4 modelMatrix = glm::identity<glm::mat4>();
-        modelMatrix = glm::scale(modelMatrix, glm::vec3(0.02f, 0.02f, 0.02f));
+        if (mCrowdSize == 1) {
+            glm::mat4 modelMatrix = glm::identity<glm::mat4>();
+            modelMatrix = glm::scale(modelMatrix, glm::vec3(0.02f, 0.02f, 0.02f));
 
-        mMesh->animate(nowTime);
-        mMesh->draw(projectionMatrix, glm::inverse(cameraMatrix), modelMatrix);
+            mMesh->animate(nowTime);
+            mMesh->draw(modelMatrix);
+            globalRenderQueue.flush(globalGLState);
+            return;
+        }
+
+        updateCrowd();
+        {
+            PROFILE_ZONE("crowd animate");
+            // Offset each character in time so the crowd doesn't dance in lockstep.
+            globalJobSystem.parallelFor(mCrowdSize, ANIMATE_JOB_GRAIN, [&](int begin, int end) {
+                for (int i = begin; i < end; i++) {
+                    if (mSkipCulledAnimation && mInstances[i]->culled()) continue;
+                    mInstances[i]->animate(nowTime + 0.37 * i);
+                }
+            });
+        }
+        mMesh->drawInstances(mInstancePointers);
+        globalRenderQueue.flush(globalGLState);
     }
 
-private:
     std::unique_ptr<SkinnedMesh> mMesh;
+    std::vector<std::unique_ptr<SkinnedMeshInstance>> mInstances;
+    std::vector<SkinnedMeshInstance*> mInstancePointers;
     std::unique_ptr<MaterialManager> mGlobalMaterialManager;
 };
 
-int main() {
+int main(int argc, char** argv) {
     std::unique_ptr<App> app = std::make_unique<App>();
-    return runApplication(*app);
+
+    // --crowd N starts with N characters, e.g. for headless benchmarks
+    // --packed-vertices uses the 28-byte vertex format
+    // --texture-budget MB evicts the least recently used textures beyond that much texture memory
+    // --skin-once skins the single character through transform feedback once per pose
+    // --cpu-skinning skins the single character on the CPU instead
+    // --animate-culled keeps animating characters outside the view
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--crowd") == 0 && i + 1 < argc) {
+            app->mCrowdSize = glm::clamp(atoi(argv[i + 1]), 1, MAX_CROWD_SIZE);
+        }
+        else if (strcmp(argv[i], "--packed-vertices") == 0) {
+            app->mVertexFormat = SkinnedVertexFormat::Packed;
+        }
+        else if (strcmp(argv[i], "--texture-budget") == 0 && i + 1 < argc) {
+            app->mTextureBudget = (size_t)glm::max(0, atoi(argv[i + 1])) << 20;
+        }
+        else if (strcmp(argv[i], "--skin-once") == 0) {
+            app->mSkinningMode = SkinningMode::SkinOnce;
+        }
+        else if (strcmp(argv[i], "--cpu-skinning") == 0) {
+            app->mSkinningMode = SkinningMode::Cpu;
+        }
+        else if (strcmp(argv[i], "--animate-culled") == 0) {
+            app->mSkipCulledAnimation = false;
+        }
+    }
+
+    return runApplication(*app, argc, argv);
 }
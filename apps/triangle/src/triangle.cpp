@@ -1,6 +1,7 @@
 #include "opengl.hpp"
 #include "scaffold.hpp"
 #include "shader.hpp"
+#include "renderqueue.hpp"
 #include "shaders.hpp"
 #include <memory>
 #include <backends/imgui_impl_opengl3.h>
@@ -43,10 +44,12 @@ public:
 	}
 
 	void draw() {
-		mShader->use();
-
-		glBindVertexArray(mVertexArray);
-		glDrawArrays(GL_TRIANGLES, 0, 3);
+		DrawPacket packet;
+		packet.program = mShader->get();
+		packet.vertexArray = mVertexArray;
+		packet.draw = [](const DrawPacket&) { glDrawArrays(GL_TRIANGLES, 0, 3); };
+		globalRenderQueue.submit(packet, 0, 0.0f);
+		globalRenderQueue.flush(globalGLState);
 	}
 
 	int imgui() {
@@ -77,8 +80,8 @@ private:
 	GLuint mVertexArray;
 };
 
-int main() {
+int main(int argc, char** argv) {
 	std::unique_ptr<App> app = std::make_unique<App>();
 
-	return runApplication(*app);
+	return runApplication(*app, argc, argv);
 }
@@ -1,12 +1,69 @@
 #pragma once
 
+#include <cstddef>
 #include <functional>
 #include <string>
 #include <assimp/postprocess.h>
 #include <assimp/scene.h>
 
-typedef std::function<void(int, unsigned char*)> FetchDataHandler;
+#ifdef __EMSCRIPTEN__
+struct emscripten_fetch_t;
+#endif
 
+// Read-only bytes of a fetched file, released when destroyed. Natively the file is memory-mapped, so parsers
+// read straight from the page cache without a copy. On the web it is the downloaded buffer.
+class FetchedData {
+public:
+	FetchedData() = default;
+	FetchedData(const FetchedData&) = delete;
+	FetchedData& operator=(const FetchedData&) = delete;
+	FetchedData(FetchedData&& other) noexcept;
+	FetchedData& operator=(FetchedData&& other) noexcept;
+	~FetchedData();
+
+#ifdef __EMSCRIPTEN__
+	// Take over a finished download, closing it when destroyed.
+	explicit FetchedData(emscripten_fetch_t* fetch);
+#else
+	// Map a whole file. Returns false if it can't be opened. An empty file gives an empty view.
+	bool map(const std::string& path);
+#endif
+
+	const unsigned char* data() const { return mData; }
+	size_t size() const { return mSize; }
+
+private:
+	void release();
+
+	const unsigned char* mData = nullptr;
+	size_t mSize = 0;
+	// The mapping natively, or the emscripten_fetch_t on the web
+	void* mHandle = nullptr;
+#ifdef _WIN32
+	void* mFile = nullptr;
+#endif
+};
+
+// Handlers borrow the data for the duration of the call.
+typedef std::function<void(const FetchedData&)> FetchDataHandler;
+
+// Loads are asynchronous on every platform. Files are read and decoded on loader threads natively, and by the
+// browser on the web. Handlers always run on the main thread later on, so they can create GL objects.
+// Natively they run from fetch_process_completions, which the frame loop calls.
 void fetch_image(std::string root, std::string path, std::function<void(unsigned char*, int, int, int)> handler);
 void fetch_assimp_scene(std::string root, std::string path, unsigned int postprocessingFlags, std::function<void(std::string, const aiScene*)> handler);
 void fetch_data(std::string root, std::string path, FetchDataHandler handler);
+
+#ifndef __EMSCRIPTEN__
+// Work done on a loader thread. Returns the completion to run on the main thread, or an empty function on failure.
+typedef std::function<std::function<void()>()> LoadTask;
+// Run custom loading work, like decoding a cooked asset, on a loader thread. The completion runs like a handler.
+void fetch_task(LoadTask task);
+#endif
+
+// Run the handlers of finished native loads until the budget in milliseconds is spent. At least one runs if any are ready.
+void fetch_process_completions(double budgetMs);
+// Number of native loads whose handler hasn't run yet.
+int fetch_pending_count();
+// Block until every native load, including ones started by handlers, has run its handler.
+void fetch_wait_all();
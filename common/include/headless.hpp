@@ -0,0 +1,25 @@
+#pragma once
+
+#ifdef SCAFFOLD_HEADLESS
+#include <EGL/egl.h>
+#endif
+
+// OpenGL context backed by an offscreen EGL pbuffer, used to run apps without a display.
+// Works with software rasterizers such as Mesa's llvmpipe.
+class HeadlessContext {
+public:
+	~HeadlessContext();
+
+	// Create the context and make it current. Returns false if no usable EGL display exists.
+	bool create(int width, int height);
+	// Present the current frame. Waits for the GPU so the time spent rendering is accounted for.
+	void swap();
+	void destroy();
+
+private:
+#ifdef SCAFFOLD_HEADLESS
+	EGLDisplay mDisplay = EGL_NO_DISPLAY;
+	EGLSurface mSurface = EGL_NO_SURFACE;
+	EGLContext mContext = EGL_NO_CONTEXT;
+#endif
+};
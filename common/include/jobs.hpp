@@ -0,0 +1,90 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <initializer_list>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Number of jobs scheduled against it that haven't finished yet. Wait on it with JobSystem::wait.
+struct JobCounter {
+	std::atomic<int> pending{ 0 };
+};
+
+// Task scheduler with one deque per thread. Threads pop their own newest job and steal the oldest job of
+// another thread when they run out. The thread that calls wait runs jobs too, so with no workers
+// (e.g. the web build, which has no threads) everything runs inline on the calling thread.
+class JobSystem {
+public:
+	~JobSystem();
+
+	// Spawn the worker threads. A negative count uses one worker per hardware thread besides the calling one.
+	void start(int workerCount = -1);
+	// Finish running the queued jobs and join the workers.
+	void stop();
+	// Number of threads running jobs, including the one that calls wait.
+	int threadCount() const { return (int)mWorkers.size() + 1; }
+
+	// Queue a job. The counter is incremented now and decremented once the job has run.
+	void schedule(JobCounter& counter, std::function<void()> function);
+	// Run queued jobs on the calling thread until the counter reaches zero. Sleeps while the last ones run elsewhere.
+	void wait(JobCounter& counter);
+	// Call function(begin, end) over [0, count) split into chunks of at most grain items, and wait for all of them.
+	void parallelFor(int count, int grain, const std::function<void(int, int)>& function);
+
+private:
+	struct Job {
+		std::function<void()> function;
+		JobCounter* counter;
+	};
+
+	struct Queue {
+		std::mutex mutex;
+		std::deque<Job> jobs;
+	};
+
+	void workerLoop(int index);
+	// Pop from the thread's own queue, or steal from another one.
+	bool pop(int index, Job& job);
+	void execute(Job& job);
+	int currentQueue() const;
+
+	// Queue 0 belongs to threads that aren't workers, usually the main thread.
+	std::vector<std::unique_ptr<Queue>> mQueues;
+	std::vector<std::thread> mWorkers;
+	std::atomic<int> mQueuedJobs{ 0 };
+	std::atomic<bool> mStopping{ false };
+	std::mutex mSleepMutex;
+	std::condition_variable mWakeUp;
+	// Wakes threads sleeping in wait when a counter reaches zero or a job is queued. Guarded by mSleepMutex.
+	std::condition_variable mJobsChanged;
+	int mSleepingWaiters = 0;
+};
+
+// Set of jobs with dependencies between them, run as soon as everything they depend on has finished.
+class JobGraph {
+public:
+	// Add a job that runs after the given ones. Returns its index, to be used as a dependency of later jobs.
+	int add(std::function<void()> function, std::initializer_list<int> dependencies = {});
+	// Run every job and wait for all of them. The graph can be run again.
+	void run(JobSystem& jobs);
+	void clear() { mNodes.clear(); }
+
+private:
+	struct Node {
+		std::function<void()> function;
+		std::vector<int> successors;
+		int dependencyCount;
+	};
+
+	void schedule(JobSystem& jobs, JobCounter& counter, std::vector<std::atomic<int>>& remaining, int node);
+
+	std::vector<Node> mNodes;
+};
+
+// Scheduler started by runApplication and shared by every system of the app.
+extern JobSystem globalJobSystem;
@@ -9,3 +9,10 @@
 #else
 #include <glad/glad.h>
 #endif
+
+#ifndef EMSCRIPTEN
+// Desktop OpenGL version requested by both the windowed and the headless context, so they render the same way. A
+// compatibility profile, as GL_ALPHA and GL_LUMINANCE textures are still used. Drivers may return a later version.
+constexpr int OPENGL_MAJOR_VERSION = 3;
+constexpr int OPENGL_MINOR_VERSION = 3;
+#endif
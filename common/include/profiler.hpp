@@ -0,0 +1,120 @@
+#pragma once
+
+#include "opengl.hpp"
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+// Maximum number of zones recorded in a single frame. Zones past this limit are dropped.
+constexpr int PROFILER_MAX_ZONES = 32;
+// Number of completed frames kept in the history ring buffer.
+constexpr int PROFILER_HISTORY = 1024;
+// Number of frames GPU timer queries stay in flight before their results are read back.
+constexpr int PROFILER_QUERY_LATENCY = 4;
+
+struct ProfilerZoneSample {
+	// Zone label. Must point to a string that outlives the profiler, usually a literal.
+	const char* name;
+	// Nesting level, 0 for zones opened directly inside the frame.
+	int depth;
+	double cpuMs;
+	// Negative when GPU timer queries are unavailable or the result was not ready.
+	double gpuMs;
+};
+
+struct ProfilerFrame {
+	uint64_t index;
+	double cpuMs;
+	int zoneCount;
+	ProfilerZoneSample zones[PROFILER_MAX_ZONES];
+};
+
+static_assert(std::is_trivially_copyable_v<ProfilerFrame>, "Profiler frames are copied word by word through the history");
+
+// Frame profiler with nested CPU zones and GL timestamp queries.
+// Zones are recorded on the render thread. Completed frames go into a lock-free ring buffer that can be
+// read from any thread while the render thread keeps writing.
+class Profiler {
+public:
+	void beginFrame();
+	void endFrame();
+	// Wait for the GPU times of the frames still in flight and publish them. Call before reading the history at exit.
+	void flush();
+	// Open a zone and return its slot, or -1 when the frame is full. Prefer the PROFILE_ZONE macro.
+	int beginZone(const char* name);
+	void endZone(int slot);
+
+	// Number of frames that can currently be read from the history.
+	int frameCount() const;
+	// Copy the completed frame that is `age` frames old (0 is the newest). Returns false if it is no longer available.
+	bool copyFrame(int age, ProfilerFrame& frame) const;
+	// Whether GPU times come from timer queries rather than being left out.
+	bool hasGpuTimers() const { return mGpuTimers; }
+
+	// Draw an ImGui window with percentiles for every zone in the history.
+	void drawOverlay();
+	bool writeCsv(const std::string& path) const;
+	bool writeJson(const std::string& path) const;
+	// Log percentiles for every zone in the history.
+	void printSummary() const;
+
+private:
+	struct ZoneStatistics {
+		const char* name;
+		int depth;
+		std::vector<double> cpuMs;
+		std::vector<double> gpuMs;
+	};
+
+	void initGpuTimers();
+	// Read back the timer queries of a pending frame. Without `wait` the frame keeps no GPU times if any result is missing.
+	void resolvePending(int slot, bool wait);
+	void publish(const ProfilerFrame& frame);
+	std::vector<ZoneStatistics> collectStatistics() const;
+
+	using Clock = std::chrono::steady_clock;
+
+	bool mInitialized = false;
+	bool mGpuTimers = false;
+	bool mInFrame = false;
+	uint64_t mFrameIndex = 0;
+	int mDepth = 0;
+	Clock::time_point mFrameStart;
+	Clock::time_point mZoneStarts[PROFILER_MAX_ZONES];
+
+	// Frames whose GPU results are still in flight, indexed by frame index modulo the latency.
+	ProfilerFrame mPending[PROFILER_QUERY_LATENCY];
+	bool mPendingValid[PROFILER_QUERY_LATENCY] = {};
+	GLuint mQueries[PROFILER_QUERY_LATENCY][PROFILER_MAX_ZONES * 2] = {};
+
+	// A history entry guarded by a sequence lock. The sequence is 2n + 1 while the n-th published frame is being
+	// written and 2n + 2 once it is complete, so readers can detect copies that raced with the render thread.
+	static constexpr size_t HISTORY_WORDS = (sizeof(ProfilerFrame) + 7) / 8;
+	struct HistorySlot {
+		std::atomic<uint64_t> sequence{ 0 };
+		std::atomic<uint64_t> words[HISTORY_WORDS];
+	};
+
+	HistorySlot mHistory[PROFILER_HISTORY];
+	// Number of frames ever published. The newest frame lives at (mPublished - 1) % PROFILER_HISTORY.
+	std::atomic<uint64_t> mPublished{ 0 };
+};
+
+extern Profiler globalProfiler;
+
+// Records a zone on the global profiler for the lifetime of the object.
+class ProfileZone {
+public:
+	ProfileZone(const char* name) : mSlot(globalProfiler.beginZone(name)) {}
+	~ProfileZone() { globalProfiler.endZone(mSlot); }
+private:
+	int mSlot;
+};
+
+#define PROFILE_ZONE_CONCAT_INNER(a, b) a##b
+#define PROFILE_ZONE_CONCAT(a, b) PROFILE_ZONE_CONCAT_INNER(a, b)
+// Profile the rest of the enclosing scope under the given name.
+#define PROFILE_ZONE(name) ProfileZone PROFILE_ZONE_CONCAT(profileZone, __LINE__)(name)
@@ -0,0 +1,86 @@
+#pragma once
+
+#include "opengl.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Texture units a draw packet can bind, from unit 0
+constexpr int MAX_PACKET_TEXTURES = 4;
+// Integers a draw packet carries for its draw function
+constexpr int MAX_PACKET_ARGUMENTS = 6;
+
+// Bindings last set through the cache, so that setting the same one again makes no GL call. GL calls made around the
+// cache leave it stale, so invalidate it after them.
+class GLStateCache {
+public:
+	GLStateCache() { invalidate(); }
+
+	void useProgram(GLuint program);
+	void bindVertexArray(GLuint vertexArray);
+	void bindTexture(int unit, GLenum target, GLuint texture);
+	// Forget every binding, so the next ones are all made.
+	void invalidate();
+
+	// GL calls made and skipped since the last resetStatistics
+	int issuedCalls() const { return mIssuedCalls; }
+	int skippedCalls() const { return mSkippedCalls; }
+	void resetStatistics();
+
+private:
+	// Matches no GL name, so it is replaced by the first binding
+	static constexpr GLuint UNKNOWN = ~0u;
+
+	GLuint mProgram = UNKNOWN;
+	GLuint mVertexArray = UNKNOWN;
+	GLuint mActiveUnit = UNKNOWN;
+	GLenum mTextureTargets[MAX_PACKET_TEXTURES];
+	GLuint mTextures[MAX_PACKET_TEXTURES];
+	int mIssuedCalls = 0;
+	int mSkippedCalls = 0;
+};
+
+// Texture bound to one unit by a draw packet. A zero target leaves the unit alone.
+struct PacketTexture {
+	GLenum target = 0;
+	GLuint texture = 0;
+};
+
+// The state and call of one draw, small and trivially copyable so that thousands can be queued every frame.
+struct DrawPacket {
+	GLuint program = 0;
+	GLuint vertexArray = 0;
+	PacketTexture textures[MAX_PACKET_TEXTURES];
+	// Sets the uniforms of the draw and makes the draw call, once the state above is bound
+	void (*draw)(const DrawPacket& packet) = nullptr;
+	// Read by the draw function, usually the object that submitted the packet
+	const void* object = nullptr;
+	int32_t arguments[MAX_PACKET_ARGUMENTS] = {};
+};
+
+// Draw packets of a frame, drawn together sorted by a 64-bit key: the program, then the material, then the vertex
+// array, then the depth front to back. Sorting is a radix sort on the keys, and the bindings go through a
+// GLStateCache, so each program, texture and vertex array change is made once per run of packets sharing it.
+// Packets are drawn at flush, so whatever they read, like buffers and textures, must stay unchanged until then.
+class RenderQueue {
+public:
+	// Queue a draw. material groups packets binding the same textures, and depth is the distance from the camera.
+	void submit(const DrawPacket& packet, uint32_t material, float depth);
+	// Draw the queued packets in key order, then empty the queue. The cache is invalidated first, since other code
+	// binds state between flushes.
+	void flush(GLStateCache& state);
+	size_t size() const { return mPackets.size(); }
+
+private:
+	std::vector<DrawPacket> mPackets;
+	std::vector<uint64_t> mKeys;
+	// Packet indices in key order, and the buffers the radix sort ping-pongs with
+	std::vector<uint32_t> mOrder;
+	std::vector<uint64_t> mSortKeys;
+	std::vector<uint64_t> mScratchKeys;
+	std::vector<uint32_t> mSortScratch;
+};
+
+// Shared by every app, flushed once per frame after the scene is submitted.
+extern GLStateCache globalGLState;
+extern RenderQueue globalRenderQueue;
@@ -2,8 +2,19 @@
 
 #include <string>
 #include <functional>
+#include <vector>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <chrono>
 
 #include "opengl.hpp"
+#include "headless.hpp"
+#include "fetch.hpp"
+#include "profiler.hpp"
+#include "jobs.hpp"
+#include "uniforms.hpp"
+#include <spdlog/spdlog.h>
 
 #include <GLFW/glfw3.h>
 #include <backends/imgui_impl_opengl3.h>
@@ -29,11 +40,82 @@ public:
     int width;
     // Height of the frame buffer. You can use this to compute the rendering aspect ratio
     int height;
+    // Seconds since the application started. Advances by a fixed step in headless mode so runs are deterministic
+    double time = 0.0;
 };
 
 class BaseScaffold : public Scaffold {
 };
 
+// Options controlling how runApplication creates its context and drives the frame loop
+struct RunOptions {
+    // Render into an offscreen EGL surface instead of a window
+    bool headless = false;
+    // Number of frames rendered before exiting in headless mode
+    int frames = 600;
+    // Seconds the clock advances every frame in headless mode
+    double timeStep = 1.0 / 60.0;
+    // Size of the window or offscreen surface
+    int width = 640;
+    int height = 480;
+    // Show the profiler overlay on top of the app's own imgui windows
+    bool profilerOverlay = false;
+    // Files the profiler history is written to at exit, if not empty
+    std::string profileCsv;
+    std::string profileJson;
+    // Threads running jobs besides the main thread, or -1 for one per remaining hardware thread
+    int workerThreads = -1;
+    // Milliseconds per frame spent running handlers of finished asset loads, such as texture uploads
+    double loadBudgetMs = 4.0;
+};
+
+// Read options from the command line: --headless, --frames N, --time-step SECONDS, --size WIDTHxHEIGHT,
+// --profiler, --profile-csv FILE, --profile-json FILE, --threads N (total threads, including the main one),
+// --load-budget MILLISECONDS
+RunOptions parseRunOptions(int argc, char** argv) {
+    RunOptions options;
+    for (int i = 1; i < argc; i++) {
+        bool hasValue = i + 1 < argc;
+        if (strcmp(argv[i], "--headless") == 0) {
+            options.headless = true;
+        }
+        else if (strcmp(argv[i], "--frames") == 0 && hasValue) {
+            options.frames = std::max(1, atoi(argv[++i]));
+        }
+        else if (strcmp(argv[i], "--time-step") == 0 && hasValue) {
+            // ImGui asserts on a frame that takes no time
+            double timeStep = atof(argv[++i]);
+            if (timeStep > 0.0) options.timeStep = timeStep;
+            else spdlog::warn("Ignoring --time-step {}, it must be positive", argv[i]);
+        }
+        else if (strcmp(argv[i], "--size") == 0 && hasValue) {
+            sscanf(argv[++i], "%dx%d", &options.width, &options.height);
+        }
+        else if (strcmp(argv[i], "--profiler") == 0) {
+            options.profilerOverlay = true;
+        }
+        else if (strcmp(argv[i], "--profile-csv") == 0 && hasValue) {
+            options.profileCsv = argv[++i];
+        }
+        else if (strcmp(argv[i], "--profile-json") == 0 && hasValue) {
+            options.profileJson = argv[++i];
+        }
+        else if (strcmp(argv[i], "--threads") == 0 && hasValue) {
+            options.workerThreads = std::max(1, atoi(argv[++i])) - 1;
+        }
+        else if (strcmp(argv[i], "--load-budget") == 0 && hasValue) {
+            options.loadBudgetMs = atof(argv[++i]);
+        }
+    }
+    return options;
+}
+
+// Write the profiler history to the files requested in the options
+void writeProfiles(const RunOptions& options) {
+    if (!options.profileCsv.empty()) globalProfiler.writeCsv(options.profileCsv);
+    if (!options.profileJson.empty()) globalProfiler.writeJson(options.profileJson);
+}
+
 bool windowSizeNeedsUpdate = true;
 bool mouseNeedsUpdate = true;
 
@@ -45,8 +127,97 @@ void resizeCallback(GLFWwindow* window, int width, int height)
 std::function<void()> loop;
 void main_loop() { loop(); }
 
+// Render a fixed number of frames offscreen with a deterministic clock, then print how long each phase took.
+// The profiler keeps PROFILER_HISTORY frames, so statistics cover the last frames of longer runs.
+int runHeadlessApplication(Scaffold& app, const RunOptions& options) {
+    HeadlessContext context;
+    if (!context.create(options.width, options.height))
+        return -1;
+
+    globalJobSystem.start(options.workerThreads);
+
+    /* Create Context of ImGui without a platform backend, feeding it the display state directly */
+    ImGui::CreateContext();
+    ImGuiIO& io = ImGui::GetIO();
+    io.DisplaySize = ImVec2((float)options.width, (float)options.height);
+    io.DeltaTime = (float)options.timeStep;
+    ImGui_ImplOpenGL3_Init();
+
+    glViewport(0, 0, options.width, options.height);
+    app.width = options.width;
+    app.height = options.height;
+    app.time = 0.0;
+
+    app.setup();
+    app.onResize();
+
+    // Finish loading before the first frame so every run measures the same work.
+    {
+        auto loadStart = std::chrono::steady_clock::now();
+        fetch_wait_all();
+        spdlog::info("Loaded assets in {:.1f} ms", std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - loadStart).count());
+    }
+
+    for (int frame = 0; frame < options.frames; frame++) {
+        globalProfiler.beginFrame();
+
+        // There are no events to poll without a window.
+        app.time = frame * options.timeStep;
+
+        {
+            PROFILE_ZONE("loads");
+            fetch_process_completions(options.loadBudgetMs);
+        }
+
+        {
+            PROFILE_ZONE("imgui");
+            ImGui_ImplOpenGL3_NewFrame();
+            ImGui::NewFrame();
+            app.imgui();
+            if (options.profilerOverlay) globalProfiler.drawOverlay();
+            ImGui::Render();
+        }
+
+        {
+            PROFILE_ZONE("draw");
+            glClearColor(0.1, 0.1, 0.1, 1.0);
+            glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+            app.draw();
+        }
+
+        {
+            PROFILE_ZONE("imgui draw");
+            ImGui_ImplOpenGL3_RenderDrawData(ImGui::GetDrawData());
+        }
+
+        {
+            PROFILE_ZONE("swap");
+            context.swap();
+        }
+
+        globalProfiler.endFrame();
+    }
+
+    spdlog::info("Ran {} frames on {} threads", options.frames, globalJobSystem.threadCount());
+    globalProfiler.flush();
+    globalProfiler.printSummary();
+    writeProfiles(options);
+
+    app.cleanup();
+    globalFrameUniforms.destroy();
+    globalJobSystem.stop();
+    ImGui_ImplOpenGL3_Shutdown();
+    ImGui::DestroyContext();
+    return 0;
+}
+
 // Run the given application in a new window, calling the scaffold methods whenever appropriate
-int runApplication(Scaffold& app) {
+int runApplication(Scaffold& app, const RunOptions& options = {}) {
+
+#ifndef __EMSCRIPTEN__
+    if (options.headless)
+        return runHeadlessApplication(app, options);
+#endif
 
     GLFWwindow* window;
 
@@ -54,8 +225,15 @@ int runApplication(Scaffold& app) {
     if (!glfwInit())
         return -1;
 
+#ifndef __EMSCRIPTEN__
+    /* Request the same OpenGL version as the headless context */
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, OPENGL_MAJOR_VERSION);
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, OPENGL_MINOR_VERSION);
+    glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_COMPAT_PROFILE);
+#endif
+
     /* Create a windowed mode window and its OpenGL context */
-    window = glfwCreateWindow(640, 480, app.initTitle().c_str(), NULL, NULL);
+    window = glfwCreateWindow(options.width, options.height, app.initTitle().c_str(), NULL, NULL);
     if (!window)
     {
         glfwTerminate();
@@ -70,6 +248,8 @@ int runApplication(Scaffold& app) {
     gladLoadGL();
 #endif
 
+    globalJobSystem.start(options.workerThreads);
+
     /* Create Context of ImGui */
     ImGui::CreateContext();
     ImGui_ImplGlfw_InitForOpenGL(window, true);
@@ -81,7 +261,19 @@ int runApplication(Scaffold& app) {
 
     /* Loop until the user closes the window */
     loop = [&] {
-        glfwPollEvents();
+        globalProfiler.beginFrame();
+
+        {
+            PROFILE_ZONE("poll");
+            glfwPollEvents();
+        }
+
+        {
+            PROFILE_ZONE("loads");
+            fetch_process_completions(options.loadBudgetMs);
+        }
+
+        app.time = glfwGetTime();
         if (windowSizeNeedsUpdate) {
             int width, height;
             glfwGetFramebufferSize(window, &width, &height);
@@ -98,22 +290,38 @@ int runApplication(Scaffold& app) {
             return;
         }*/
 
-        ImGui_ImplOpenGL3_NewFrame();
-        ImGui_ImplGlfw_NewFrame();
-        ImGui::NewFrame();
+        {
+            PROFILE_ZONE("imgui");
+            ImGui_ImplOpenGL3_NewFrame();
+            ImGui_ImplGlfw_NewFrame();
+            ImGui::NewFrame();
 
-        app.imgui();
-        ImGui::Render();
+            app.imgui();
+            if (options.profilerOverlay) globalProfiler.drawOverlay();
+            ImGui::Render();
+        }
 
         /* Render here */
-        glClearColor(0.1, 0.1, 0.1, 1.0);
-        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+        {
+            PROFILE_ZONE("draw");
+            glClearColor(0.1, 0.1, 0.1, 1.0);
+            glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
-        app.draw();
-        ImGui_ImplOpenGL3_RenderDrawData(ImGui::GetDrawData());
+            app.draw();
+        }
+
+        {
+            PROFILE_ZONE("imgui draw");
+            ImGui_ImplOpenGL3_RenderDrawData(ImGui::GetDrawData());
+        }
 
         /* Swap front and back buffers */
-        glfwSwapBuffers(window);
+        {
+            PROFILE_ZONE("swap");
+            glfwSwapBuffers(window);
+        }
+
+        globalProfiler.endFrame();
         };
 
 #ifdef __EMSCRIPTEN__
@@ -123,7 +331,12 @@ int runApplication(Scaffold& app) {
         main_loop();
 #endif
 
+    globalProfiler.flush();
+    writeProfiles(options);
+
     app.cleanup();
+    globalFrameUniforms.destroy();
+    globalJobSystem.stop();
     ImGui_ImplOpenGL3_Shutdown();
     ImGui_ImplGlfw_Shutdown();
     ImGui::DestroyContext();
@@ -132,3 +345,8 @@ int runApplication(Scaffold& app) {
     glfwTerminate();
     return 0;
 }
+
+// Run the given application with options read from the command line
+int runApplication(Scaffold& app, int argc, char** argv) {
+    return runApplication(app, parseRunOptions(argc, argv));
+}
@@ -1,7 +1,51 @@
 #pragma once
 
 #include "opengl.hpp"
+#include <cstdint>
 #include <string>
+#include <vector>
+#include <unordered_map>
+#include <unordered_set>
+#include <glm/glm.hpp>
+
+// Active uniform, attribute or uniform block of a linked program.
+struct ShaderVariable {
+	// GL type such as GL_FLOAT_MAT4, or 0 for uniform blocks
+	GLenum type;
+	// Array length, or the data size in bytes for uniform blocks
+	GLint size;
+	// Location, or the block index for uniform blocks
+	GLint location;
+};
+
+// Uniform location resolved once after linking, with a setter for its GLSL type.
+// Setting an invalid handle is a no-op, like setting location -1.
+template<typename T>
+struct Uniform {
+	GLint location = -1;
+
+	bool valid() const { return location >= 0; }
+	// Set the uniform of the program currently in use.
+	void set(const T& value) const;
+};
+
+template<> void Uniform<int>::set(const int& value) const;
+template<> void Uniform<float>::set(const float& value) const;
+template<> void Uniform<glm::vec2>::set(const glm::vec2& value) const;
+template<> void Uniform<glm::vec3>::set(const glm::vec3& value) const;
+template<> void Uniform<glm::vec4>::set(const glm::vec4& value) const;
+template<> void Uniform<glm::mat3>::set(const glm::mat3& value) const;
+template<> void Uniform<glm::mat4>::set(const glm::mat4& value) const;
+
+// Whether a uniform of the given GL type can be set through Uniform<T>. Samplers are set as int.
+template<typename T> bool uniformTypeMatches(GLenum type);
+template<> bool uniformTypeMatches<int>(GLenum type);
+template<> bool uniformTypeMatches<float>(GLenum type);
+template<> bool uniformTypeMatches<glm::vec2>(GLenum type);
+template<> bool uniformTypeMatches<glm::vec3>(GLenum type);
+template<> bool uniformTypeMatches<glm::vec4>(GLenum type);
+template<> bool uniformTypeMatches<glm::mat3>(GLenum type);
+template<> bool uniformTypeMatches<glm::mat4>(GLenum type);
 
 class Shader {
 public:
@@ -14,12 +58,61 @@ public:
 	}
 
 	void addSource(std::string filename);
-	void addSource(std::string label, GLuint shaderType, unsigned int count, const char** lines, const int* lineLengths);
+	// Add a shader stage. It is compiled by link, and only if the program isn't in the cache.
+	// Each define is inserted as "#define <define>" after the #version line, to build variants of one source.
+	void addSource(std::string label, GLuint shaderType, unsigned int count, const char** lines, const int* lineLengths,
+		const std::vector<std::string>& defines = {});
+	// Capture these vertex shader outputs, interleaved in this order, into the buffer bound to transform feedback
+	// binding 0. Call before link.
+	void setTransformFeedbackVaryings(const std::vector<std::string>& varyings);
+	// Load the program binary from PROGRAM_CACHE_DIR or compile and link the sources, storing the binary for
+	// the next run. Then reflect its active uniforms, attributes and uniform blocks.
+	// A FrameBlock uniform block gets bound to FRAME_BLOCK_BINDING.
 	void link();
 	int getAttribute(std::string name) const;
 	int getUniform(std::string name) const;
+	// Typed handle to a uniform, meant to be resolved once at setup. Warns if it is missing or has another type.
+	template<typename T>
+	Uniform<T> uniform(const std::string& name) const {
+		return { findUniform(name, &uniformTypeMatches<T>) };
+	}
+	// Bind a uniform block to a uniform buffer binding point. Returns false if the program doesn't have it.
+	bool bindUniformBlock(const std::string& name, GLuint binding);
 	void use();
 	GLuint get();
+
+	const std::unordered_map<std::string, ShaderVariable>& uniforms() const { return mUniforms; }
+	const std::unordered_map<std::string, ShaderVariable>& attributes() const { return mAttributes; }
+	const std::unordered_map<std::string, ShaderVariable>& uniformBlocks() const { return mUniformBlocks; }
+	// Programs loaded from and missing in the binary cache since startup
+	static int programCacheHits;
+	static int programCacheMisses;
 private:
+	struct Source {
+		std::string label;
+		GLuint type;
+		std::string code;
+	};
+
+	bool compileSources();
+	// Key of the program in the binary cache, from the sources and the driver.
+	uint64_t cacheKey() const;
+	bool loadBinary(const std::string& path);
+	void saveBinary(const std::string& path) const;
+	void finishLink();
+	// Labels of the sources, for logs
+	std::string label() const;
+	void reflect();
+	GLint findUniform(const std::string& name, bool (*typeMatches)(GLenum)) const;
+	// Log a missing name the first time it is looked up only.
+	void warnMissing(const char* kind, const std::string& name) const;
+
 	GLuint mProgram;
+	// Kept until link
+	std::vector<Source> mSources;
+	std::vector<std::string> mFeedbackVaryings;
+	std::unordered_map<std::string, ShaderVariable> mUniforms;
+	std::unordered_map<std::string, ShaderVariable> mAttributes;
+	std::unordered_map<std::string, ShaderVariable> mUniformBlocks;
+	mutable std::unordered_set<std::string> mReportedMissing;
 };
@@ -0,0 +1,62 @@
+#pragma once
+
+// 4-wide SIMD kernels on column-major 4x4 float matrices, the layout used by glm::mat4.
+// Uses SSE on x86, WASM SIMD when Emscripten builds with -msimd128, and plain loops otherwise.
+
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#include <xmmintrin.h>
+#define SIMD_USE_SSE
+#elif defined(__wasm_simd128__)
+#include <wasm_simd128.h>
+#define SIMD_USE_WASM
+#endif
+
+// out = a * b. out may alias a or b.
+inline void mat4Multiply(const float* a, const float* b, float* out) {
+#if defined(SIMD_USE_SSE)
+	__m128 a0 = _mm_loadu_ps(a);
+	__m128 a1 = _mm_loadu_ps(a + 4);
+	__m128 a2 = _mm_loadu_ps(a + 8);
+	__m128 a3 = _mm_loadu_ps(a + 12);
+
+	__m128 columns[4];
+	for (int j = 0; j < 4; j++) {
+		const float* bj = b + j * 4;
+		columns[j] = _mm_add_ps(
+			_mm_add_ps(_mm_mul_ps(a0, _mm_set1_ps(bj[0])), _mm_mul_ps(a1, _mm_set1_ps(bj[1]))),
+			_mm_add_ps(_mm_mul_ps(a2, _mm_set1_ps(bj[2])), _mm_mul_ps(a3, _mm_set1_ps(bj[3]))));
+	}
+
+	for (int j = 0; j < 4; j++) {
+		_mm_storeu_ps(out + j * 4, columns[j]);
+	}
+#elif defined(SIMD_USE_WASM)
+	v128_t a0 = wasm_v128_load(a);
+	v128_t a1 = wasm_v128_load(a + 4);
+	v128_t a2 = wasm_v128_load(a + 8);
+	v128_t a3 = wasm_v128_load(a + 12);
+
+	v128_t columns[4];
+	for (int j = 0; j < 4; j++) {
+		const float* bj = b + j * 4;
+		columns[j] = wasm_f32x4_add(
+			wasm_f32x4_add(wasm_f32x4_mul(a0, wasm_f32x4_splat(bj[0])), wasm_f32x4_mul(a1, wasm_f32x4_splat(bj[1]))),
+			wasm_f32x4_add(wasm_f32x4_mul(a2, wasm_f32x4_splat(bj[2])), wasm_f32x4_mul(a3, wasm_f32x4_splat(bj[3]))));
+	}
+
+	for (int j = 0; j < 4; j++) {
+		wasm_v128_store(out + j * 4, columns[j]);
+	}
+#else
+	float result[16];
+	for (int j = 0; j < 4; j++) {
+		for (int i = 0; i < 4; i++) {
+			result[j * 4 + i] = a[i] * b[j * 4] + a[4 + i] * b[j * 4 + 1] + a[8 + i] * b[j * 4 + 2] + a[12 + i] * b[j * 4 + 3];
+		}
+	}
+
+	for (int i = 0; i < 16; i++) {
+		out[i] = result[i];
+	}
+#endif
+}
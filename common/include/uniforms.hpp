@@ -0,0 +1,40 @@
+#pragma once
+
+#include "opengl.hpp"
+#include <glm/glm.hpp>
+
+// Uniform buffer binding point of FrameBlock. Shader::link binds every program declaring the block to it.
+constexpr GLuint FRAME_BLOCK_BINDING = 0;
+
+// Per-frame camera data, laid out like this block in std140:
+//   layout(std140) uniform FrameBlock {
+//       mat4 projectionMatrix;
+//       mat4 cameraInverseMatrix;
+//       mat4 viewProjectionMatrix;
+//       vec4 cameraPosition;
+//   };
+struct FrameBlock {
+	glm::mat4 projectionMatrix;
+	glm::mat4 cameraInverseMatrix;
+	// projectionMatrix * cameraInverseMatrix
+	glm::mat4 viewProjectionMatrix;
+	// World space camera position, w is 1
+	glm::vec4 cameraPosition;
+};
+
+// Uniform buffer holding the FrameBlock of the current frame, shared by every program.
+class FrameUniforms {
+public:
+	// Upload the camera of the frame and bind the buffer. Call once per frame, before drawing.
+	void update(const glm::mat4& projection, const glm::mat4& cameraInverse);
+	// Delete the buffer. Must be done while the GL context still exists.
+	void destroy();
+
+	const FrameBlock& data() const { return mData; }
+
+private:
+	GLuint mBuffer = 0;
+	FrameBlock mData;
+};
+
+extern FrameUniforms globalFrameUniforms;
@@ -3,68 +3,204 @@
 #include <assimp/Importer.hpp>
 #include <stb_image.h>
 #include <filesystem>
+#include <memory>
+#include <utility>
 
 #ifdef __EMSCRIPTEN__
 #include <emscripten/fetch.h>
 #else
-#include <fstream>
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
 #endif
 
 std::string joinPath(std::string a, std::string b) {
 	return (std::filesystem::path(a) / std::filesystem::path(b)).string();
 }
 
+std::string parentPath(const std::string& fullPath) {
+	auto index = fullPath.find_last_of("/");
+	return index == std::string::npos ? fullPath : fullPath.substr(0, index);
+}
+
+FetchedData::FetchedData(FetchedData&& other) noexcept {
+	*this = std::move(other);
+}
+
+FetchedData& FetchedData::operator=(FetchedData&& other) noexcept {
+	if (this != &other) {
+		release();
+		std::swap(mData, other.mData);
+		std::swap(mSize, other.mSize);
+		std::swap(mHandle, other.mHandle);
+#ifdef _WIN32
+		std::swap(mFile, other.mFile);
+#endif
+	}
+	return *this;
+}
+
+FetchedData::~FetchedData() {
+	release();
+}
+
+#ifdef __EMSCRIPTEN__
+
+FetchedData::FetchedData(emscripten_fetch_t* fetch) {
+	mData = (const unsigned char*)fetch->data;
+	mSize = fetch->numBytes;
+	mHandle = fetch;
+}
+
+void FetchedData::release() {
+	if (mHandle != nullptr) emscripten_fetch_close((emscripten_fetch_t*)mHandle);
+	mData = nullptr;
+	mSize = 0;
+	mHandle = nullptr;
+}
+
+#elif defined(_WIN32)
+
+bool FetchedData::map(const std::string& path) {
+	release();
+
+	HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+	if (file == INVALID_HANDLE_VALUE) return false;
+	mFile = file;
+
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(file, &size)) {
+		release();
+		return false;
+	}
+	if (size.QuadPart == 0) return true;
+
+	mHandle = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	if (mHandle != nullptr) {
+		mData = (const unsigned char*)MapViewOfFile(mHandle, FILE_MAP_READ, 0, 0, 0);
+	}
+	if (mData == nullptr) {
+		release();
+		return false;
+	}
+
+	mSize = (size_t)size.QuadPart;
+	return true;
+}
+
+void FetchedData::release() {
+	if (mData != nullptr) UnmapViewOfFile(mData);
+	if (mHandle != nullptr) CloseHandle(mHandle);
+	if (mFile != nullptr) CloseHandle(mFile);
+	mData = nullptr;
+	mSize = 0;
+	mHandle = nullptr;
+	mFile = nullptr;
+}
+
+#else
+
+bool FetchedData::map(const std::string& path) {
+	release();
+
+	int file = open(path.c_str(), O_RDONLY);
+	if (file < 0) return false;
+
+	struct stat status;
+	if (fstat(file, &status) != 0) {
+		close(file);
+		return false;
+	}
+
+	// mmap rejects empty lengths, and an empty view needs no mapping.
+	if (status.st_size > 0) {
+		void* mapping = mmap(nullptr, status.st_size, PROT_READ, MAP_PRIVATE, file, 0);
+		if (mapping == MAP_FAILED) {
+			close(file);
+			return false;
+		}
+		// Parsers read assets front to back, so ask the kernel to read ahead.
+		madvise(mapping, status.st_size, MADV_SEQUENTIAL);
+		mHandle = mapping;
+		mData = (const unsigned char*)mapping;
+		mSize = status.st_size;
+	}
+
+	// The mapping keeps the file alive on its own.
+	close(file);
+	return true;
+}
+
+void FetchedData::release() {
+	if (mHandle != nullptr) munmap(mHandle, mSize);
+	mData = nullptr;
+	mSize = 0;
+	mHandle = nullptr;
+}
+
+#endif
+
+#ifdef __EMSCRIPTEN__
+
 void fetch_image(std::string root, std::string path, std::function<void(stbi_uc*, int, int, int)> handler) {
 	std::string fullPath = joinPath(root, path);
-	fetch_data(root, path, [fullPath=std::move(fullPath), handler=std::move(handler)](unsigned int size, unsigned char* data) {
+	fetch_data(root, path, [fullPath=std::move(fullPath), handler=std::move(handler)](const FetchedData& data) {
 		int x, y, channels;
-		stbi_uc* image = stbi_load_from_memory(data, size, &x, &y, &channels, 0);
-		delete data;
+		stbi_uc* image = stbi_load_from_memory(data.data(), data.size(), &x, &y, &channels, 0);
 		if (image == nullptr) {
 			spdlog::critical("Failed to load image {}: {}", fullPath, stbi_failure_reason());
 			return;
 		}
 		handler(image, x, y, channels);
+		stbi_image_free(image);
 	});
 }
 
 void fetch_assimp_scene(std::string root, std::string path, unsigned int postprocessingFlags, std::function<void(std::string, const aiScene*)> handler) {
 	std::string fullPath = joinPath(root, path);
-	fetch_data(root, path, std::move([postprocessingFlags, fullPath=std::move(fullPath), handler=std::move(handler)](unsigned int size, unsigned char* data) {
+	fetch_data(root, path, std::move([postprocessingFlags, fullPath=std::move(fullPath), handler=std::move(handler)](const FetchedData& data) {
 		Assimp::Importer loader;
-		const aiScene* scene = loader.ReadFileFromMemory(data, size, postprocessingFlags, fullPath.c_str());
-		delete data;
+		const aiScene* scene = loader.ReadFileFromMemory(data.data(), data.size(), postprocessingFlags, fullPath.c_str());
 		if (!scene) {
 			spdlog::critical("Couldn't load model file! {}", loader.GetErrorString());
 			return;
 		}
 
-		auto index = fullPath.find_last_of("/");
-		std::string assetPath = index == -1 ? fullPath : fullPath.substr(0, index);
-		handler(assetPath, scene);
+		handler(parentPath(fullPath), scene);
 	}));
 }
 
-#ifdef __EMSCRIPTEN__
-
 struct MyFetchData {
 	FetchDataHandler handler;
 };
 
 void downloadSucceeded(emscripten_fetch_t* fetch) {
-	// Steal the data object
-	unsigned char* data = (unsigned char*)fetch->data;
-	fetch->data = nullptr;
-
-	static_cast<MyFetchData*>(fetch->userData)->handler(fetch->numBytes, std::move(data));
-	
-	delete fetch->userData;
-	emscripten_fetch_close(fetch); // Free data associated with the fetch.
+	MyFetchData* userData = static_cast<MyFetchData*>(fetch->userData);
+	{
+		// Closes the fetch, freeing its data, once the handler is done with it.
+		FetchedData data(fetch);
+		userData->handler(data);
+	}
+	delete userData;
 }
 
 void downloadFailed(emscripten_fetch_t* fetch) {
 	spdlog::critical("Downloading {} failed, HTTP failure status code: {}.\n", fetch->url, fetch->status);
-	delete fetch->userData;
+	delete static_cast<MyFetchData*>(fetch->userData);
 	emscripten_fetch_close(fetch); // Also free data on failure.
 }
 
@@ -81,33 +217,186 @@ void fetch_data(std::string root, std::string path, FetchDataHandler handler) {
 	emscripten_fetch(&attr, fullPath.c_str());
 }
 
+// The browser calls the handlers between frames, so there is nothing to drain.
+void fetch_process_completions(double) {}
+int fetch_pending_count() { return 0; }
+void fetch_wait_all() {}
+
 #else
 
-void fetch_data(std::string root, std::string path, std::function<void(int, unsigned char*)> handler) {
-	std::string fullPath = joinPath(root, path);
+// Number of threads reading and decoding assets. Loads are mostly I/O and parsing, so a couple is enough.
+constexpr int LOADER_THREADS = 2;
 
-	auto ifs = std::ifstream(fullPath, std::ifstream::binary);
-	if (ifs.fail()) {
-		spdlog::critical("File {} not found!", fullPath);
-		return;
+// Threads running load tasks, and the queue of completions they hand back to the main thread.
+// Kept separate from the job system: a load can take seconds, and waiting on a parallelFor must not pick one up.
+class AssetLoader {
+public:
+	~AssetLoader() {
+		{
+			std::lock_guard<std::mutex> lock(mMutex);
+			mStopping = true;
+		}
+		mTaskAdded.notify_all();
+		for (std::thread& thread : mThreads) {
+			thread.join();
+		}
 	}
 
-	ifs.seekg(0, std::ios::end);
-	size_t fileSize = ifs.tellg();
-	unsigned char* buffer = new unsigned char[fileSize];
-	ifs.seekg(0, std::ios::beg);
-	ifs.read((char*)buffer, fileSize);
+	void start(LoadTask task) {
+		std::lock_guard<std::mutex> lock(mMutex);
+		if (mThreads.empty()) {
+			for (int i = 0; i < LOADER_THREADS; i++) {
+				mThreads.emplace_back(&AssetLoader::threadLoop, this);
+			}
+		}
+		mPending++;
+		mTasks.push_back(std::move(task));
+		mTaskAdded.notify_one();
+	}
+
+	void processCompletions(double budgetMs) {
+		auto start = std::chrono::steady_clock::now();
+
+		// Always run at least one completion so loading makes progress even on slow frames.
+		do {
+			std::function<void()> completion;
+			{
+				std::lock_guard<std::mutex> lock(mMutex);
+				if (mCompletions.empty()) return;
+				completion = std::move(mCompletions.front());
+				mCompletions.pop_front();
+			}
+
+			completion();
+			mPending--;
+		} while (std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() < budgetMs);
+	}
 
-	if (ifs.eof()) {
-		spdlog::critical("From file {}, {} bytes have been read while {} were expected!", fullPath, ifs.gcount(), fileSize);
-		return;
+	void waitAll() {
+		while (mPending > 0) {
+			{
+				std::unique_lock<std::mutex> lock(mMutex);
+				mCompletionAdded.wait(lock, [this] { return !mCompletions.empty() || mPending == 0; });
+			}
+			processCompletions(INFINITY);
+		}
 	}
-	else if (ifs.fail()) {
-		spdlog::critical("File {} was unable to be read!", fullPath);
-		return;
+
+	int pendingCount() const { return mPending; }
+
+private:
+	void threadLoop() {
+		while (true) {
+			LoadTask task;
+			{
+				std::unique_lock<std::mutex> lock(mMutex);
+				mTaskAdded.wait(lock, [this] { return mStopping || !mTasks.empty(); });
+				if (mStopping) return;
+				task = std::move(mTasks.front());
+				mTasks.pop_front();
+			}
+
+			std::function<void()> completion = task();
+
+			std::lock_guard<std::mutex> lock(mMutex);
+			if (completion) {
+				mCompletions.push_back(std::move(completion));
+			}
+			else {
+				mPending--;
+			}
+			mCompletionAdded.notify_all();
+		}
 	}
 
-	handler(fileSize, buffer);
+	std::mutex mMutex;
+	std::condition_variable mTaskAdded;
+	std::condition_variable mCompletionAdded;
+	std::deque<LoadTask> mTasks;
+	std::deque<std::function<void()>> mCompletions;
+	std::vector<std::thread> mThreads;
+	// Loads started whose handler hasn't run yet
+	std::atomic<int> mPending{ 0 };
+	bool mStopping = false;
+};
+
+AssetLoader assetLoader;
+
+// Map a whole file on the calling thread, logging failures.
+bool mapFile(const std::string& fullPath, FetchedData& data) {
+	if (!data.map(fullPath)) {
+		spdlog::critical("File {} not found!", fullPath);
+		return false;
+	}
+	return true;
+}
+
+void fetch_image(std::string root, std::string path, std::function<void(stbi_uc*, int, int, int)> handler) {
+	std::string fullPath = joinPath(root, path);
+	assetLoader.start([fullPath=std::move(fullPath), handler=std::move(handler)]() -> std::function<void()> {
+		FetchedData data;
+		if (!mapFile(fullPath, data)) return {};
+
+		int x, y, channels;
+		stbi_uc* image = stbi_load_from_memory(data.data(), data.size(), &x, &y, &channels, 0);
+		if (image == nullptr) {
+			spdlog::critical("Failed to load image {}: {}", fullPath, stbi_failure_reason());
+			return {};
+		}
+
+		return [handler, image, x, y, channels] {
+			handler(image, x, y, channels);
+			stbi_image_free(image);
+		};
+	});
+}
+
+void fetch_assimp_scene(std::string root, std::string path, unsigned int postprocessingFlags, std::function<void(std::string, const aiScene*)> handler) {
+	std::string fullPath = joinPath(root, path);
+	assetLoader.start([postprocessingFlags, fullPath=std::move(fullPath), handler=std::move(handler)]() -> std::function<void()> {
+		FetchedData data;
+		if (!mapFile(fullPath, data)) return {};
+
+		Assimp::Importer loader;
+		if (!loader.ReadFileFromMemory(data.data(), data.size(), postprocessingFlags, fullPath.c_str())) {
+			spdlog::critical("Couldn't load model file! {}", loader.GetErrorString());
+			return {};
+		}
+
+		// Take the scene from the importer so it outlives this thread's work, until the handler has run.
+		aiScene* scene = loader.GetOrphanedScene();
+		return [handler, scene, assetPath=parentPath(fullPath)] {
+			handler(assetPath, scene);
+			delete scene;
+		};
+	});
+}
+
+void fetch_data(std::string root, std::string path, FetchDataHandler handler) {
+	std::string fullPath = joinPath(root, path);
+	assetLoader.start([fullPath=std::move(fullPath), handler=std::move(handler)]() -> std::function<void()> {
+		// Shared so the completion stays copyable. The mapping is released after the handler runs.
+		auto data = std::make_shared<FetchedData>();
+		if (!mapFile(fullPath, *data)) return {};
+
+		return [handler, data] { handler(*data); };
+	});
+}
+
+void fetch_task(LoadTask task) {
+	assetLoader.start(std::move(task));
+}
+
+void fetch_process_completions(double budgetMs) {
+	assetLoader.processCompletions(budgetMs);
+}
+
+int fetch_pending_count() {
+	return assetLoader.pendingCount();
+}
+
+void fetch_wait_all() {
+	assetLoader.waitAll();
 }
 
 #endif
@@ -0,0 +1,126 @@
+#include "headless.hpp"
+#include "opengl.hpp"
+#include <spdlog/spdlog.h>
+
+#ifdef SCAFFOLD_HEADLESS
+
+#include <EGL/eglext.h>
+#include <cstring>
+
+EGLDisplay getHeadlessDisplay() {
+	// Prefer Mesa's surfaceless platform, which needs neither X11 nor Wayland.
+	const char* extensions = eglQueryString(EGL_NO_DISPLAY, EGL_EXTENSIONS);
+	if (extensions != nullptr && strstr(extensions, "EGL_MESA_platform_surfaceless") != nullptr) {
+		auto getPlatformDisplay = (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+		if (getPlatformDisplay != nullptr) {
+			EGLDisplay display = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, nullptr);
+			if (display != EGL_NO_DISPLAY) {
+				return display;
+			}
+		}
+	}
+
+	return eglGetDisplay(EGL_DEFAULT_DISPLAY);
+}
+
+HeadlessContext::~HeadlessContext() {
+	destroy();
+}
+
+bool HeadlessContext::create(int width, int height) {
+	mDisplay = getHeadlessDisplay();
+	if (mDisplay == EGL_NO_DISPLAY || !eglInitialize(mDisplay, nullptr, nullptr)) {
+		spdlog::critical("Cannot initialize an EGL display for headless rendering!");
+		return false;
+	}
+
+	const EGLint configAttributes[] = {
+		EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+		EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+		EGL_RED_SIZE, 8,
+		EGL_GREEN_SIZE, 8,
+		EGL_BLUE_SIZE, 8,
+		EGL_ALPHA_SIZE, 8,
+		EGL_DEPTH_SIZE, 24,
+		EGL_NONE
+	};
+
+	EGLConfig config;
+	EGLint numConfigs = 0;
+	if (!eglChooseConfig(mDisplay, configAttributes, &config, 1, &numConfigs) || numConfigs == 0) {
+		spdlog::critical("No EGL config supports offscreen OpenGL rendering!");
+		destroy();
+		return false;
+	}
+
+	const EGLint surfaceAttributes[] = {
+		EGL_WIDTH, width,
+		EGL_HEIGHT, height,
+		EGL_NONE
+	};
+
+	mSurface = eglCreatePbufferSurface(mDisplay, config, surfaceAttributes);
+	if (mSurface == EGL_NO_SURFACE) {
+		spdlog::critical("Cannot create a {}x{} EGL pbuffer surface!", width, height);
+		destroy();
+		return false;
+	}
+
+	const EGLint contextAttributes[] = {
+		EGL_CONTEXT_MAJOR_VERSION, OPENGL_MAJOR_VERSION,
+		EGL_CONTEXT_MINOR_VERSION, OPENGL_MINOR_VERSION,
+		EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_COMPATIBILITY_PROFILE_BIT,
+		EGL_NONE
+	};
+
+	eglBindAPI(EGL_OPENGL_API);
+	mContext = eglCreateContext(mDisplay, config, EGL_NO_CONTEXT, contextAttributes);
+	if (mContext == EGL_NO_CONTEXT || !eglMakeCurrent(mDisplay, mSurface, mSurface, mContext)) {
+		spdlog::critical("Cannot create an OpenGL {}.{} context on the EGL display!", OPENGL_MAJOR_VERSION, OPENGL_MINOR_VERSION);
+		destroy();
+		return false;
+	}
+
+	/* Load GLAD bindings through EGL since there is no GLX or WGL context */
+	if (!gladLoadGLLoader((GLADloadproc)eglGetProcAddress)) {
+		spdlog::critical("Cannot load OpenGL functions for the headless context!");
+		destroy();
+		return false;
+	}
+
+	spdlog::info("Headless renderer: {}", (const char*)glGetString(GL_RENDERER));
+	return true;
+}
+
+void HeadlessContext::swap() {
+	glFinish();
+	eglSwapBuffers(mDisplay, mSurface);
+}
+
+void HeadlessContext::destroy() {
+	if (mDisplay == EGL_NO_DISPLAY) return;
+
+	eglMakeCurrent(mDisplay, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+	if (mContext != EGL_NO_CONTEXT) eglDestroyContext(mDisplay, mContext);
+	if (mSurface != EGL_NO_SURFACE) eglDestroySurface(mDisplay, mSurface);
+	eglTerminate(mDisplay);
+
+	mDisplay = EGL_NO_DISPLAY;
+	mSurface = EGL_NO_SURFACE;
+	mContext = EGL_NO_CONTEXT;
+}
+
+#else
+
+HeadlessContext::~HeadlessContext() {}
+
+bool HeadlessContext::create(int, int) {
+	spdlog::critical("Headless rendering is not available in this build!");
+	return false;
+}
+
+void HeadlessContext::swap() {}
+
+void HeadlessContext::destroy() {}
+
+#endif
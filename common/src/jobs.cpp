@@ -0,0 +1,201 @@
+#include "jobs.hpp"
+#include <algorithm>
+#include <spdlog/spdlog.h>
+
+JobSystem globalJobSystem;
+
+// Queue of the current thread: its index for workers, 0 for every other thread.
+thread_local int currentQueueIndex = 0;
+
+JobSystem::~JobSystem() {
+	stop();
+}
+
+void JobSystem::start(int workerCount) {
+	stop();
+
+#ifdef __EMSCRIPTEN__
+	// Threads need SharedArrayBuffer and cross-origin isolation on the web, so jobs run inline there.
+	workerCount = 0;
+#else
+	if (workerCount < 0) {
+		workerCount = std::max(0, (int)std::thread::hardware_concurrency() - 1);
+	}
+#endif
+
+	mStopping = false;
+	mQueues.clear();
+	for (int i = 0; i <= workerCount; i++) {
+		mQueues.push_back(std::make_unique<Queue>());
+	}
+	for (int i = 1; i <= workerCount; i++) {
+		mWorkers.emplace_back(&JobSystem::workerLoop, this, i);
+	}
+
+	spdlog::info("Job system running on {} threads", threadCount());
+}
+
+void JobSystem::stop() {
+	if (mWorkers.empty()) return;
+
+	{
+		std::lock_guard<std::mutex> lock(mSleepMutex);
+		mStopping = true;
+	}
+	mWakeUp.notify_all();
+
+	for (std::thread& worker : mWorkers) {
+		worker.join();
+	}
+	mWorkers.clear();
+}
+
+int JobSystem::currentQueue() const {
+	return currentQueueIndex < (int)mQueues.size() ? currentQueueIndex : 0;
+}
+
+void JobSystem::schedule(JobCounter& counter, std::function<void()> function) {
+	if (mQueues.empty()) start(0);
+
+	counter.pending.fetch_add(1, std::memory_order_relaxed);
+
+	Queue& queue = *mQueues[currentQueue()];
+	{
+		std::lock_guard<std::mutex> lock(queue.mutex);
+		queue.jobs.push_back({ std::move(function), &counter });
+	}
+
+	if (mWorkers.empty()) return;
+
+	// Taking the sleep mutex orders this with a worker checking the job count before it sleeps.
+	bool wakeWaiters;
+	{
+		std::lock_guard<std::mutex> lock(mSleepMutex);
+		mQueuedJobs.fetch_add(1);
+		wakeWaiters = mSleepingWaiters > 0;
+	}
+	mWakeUp.notify_one();
+	// Threads in wait can help with jobs spawned by the ones they are waiting on, e.g. successors in a JobGraph.
+	if (wakeWaiters) mJobsChanged.notify_all();
+}
+
+bool JobSystem::pop(int index, Job& job) {
+	// Newest job of our own queue first, it is the most likely to still be in cache.
+	{
+		Queue& queue = *mQueues[index];
+		std::lock_guard<std::mutex> lock(queue.mutex);
+		if (!queue.jobs.empty()) {
+			job = std::move(queue.jobs.back());
+			queue.jobs.pop_back();
+			return true;
+		}
+	}
+
+	// Steal the oldest job of another queue, which tends to be the largest remaining piece of work.
+	int count = (int)mQueues.size();
+	for (int offset = 1; offset < count; offset++) {
+		Queue& queue = *mQueues[(index + offset) % count];
+		std::lock_guard<std::mutex> lock(queue.mutex);
+		if (!queue.jobs.empty()) {
+			job = std::move(queue.jobs.front());
+			queue.jobs.pop_front();
+			return true;
+		}
+	}
+
+	return false;
+}
+
+void JobSystem::execute(Job& job) {
+	if (!mWorkers.empty()) mQueuedJobs.fetch_sub(1);
+	job.function();
+
+	// The counter may be destroyed as soon as a waiter sees it reach zero, so it isn't touched after this.
+	if (job.counter->pending.fetch_sub(1, std::memory_order_release) == 1) {
+		std::lock_guard<std::mutex> lock(mSleepMutex);
+		if (mSleepingWaiters > 0) mJobsChanged.notify_all();
+	}
+}
+
+void JobSystem::workerLoop(int index) {
+	currentQueueIndex = index;
+
+	Job job;
+	while (true) {
+		if (pop(index, job)) {
+			execute(job);
+			continue;
+		}
+
+		std::unique_lock<std::mutex> lock(mSleepMutex);
+		if (mStopping && mQueuedJobs == 0) break;
+		mWakeUp.wait(lock, [this] { return mStopping || mQueuedJobs > 0; });
+	}
+}
+
+void JobSystem::wait(JobCounter& counter) {
+	Job job;
+	while (counter.pending.load(std::memory_order_acquire) > 0) {
+		if (pop(currentQueue(), job)) {
+			execute(job);
+			continue;
+		}
+
+		// The remaining jobs are running on other threads. Sleep until they finish or queue more work.
+		std::unique_lock<std::mutex> lock(mSleepMutex);
+		mSleepingWaiters++;
+		mJobsChanged.wait(lock, [&] {
+			return counter.pending.load(std::memory_order_acquire) == 0 || mQueuedJobs > 0;
+		});
+		mSleepingWaiters--;
+	}
+}
+
+void JobSystem::parallelFor(int count, int grain, const std::function<void(int, int)>& function) {
+	grain = std::max(1, grain);
+	if (count <= grain || mWorkers.empty()) {
+		if (count > 0) function(0, count);
+		return;
+	}
+
+	JobCounter counter;
+	for (int begin = 0; begin < count; begin += grain) {
+		int end = std::min(count, begin + grain);
+		schedule(counter, [&function, begin, end] { function(begin, end); });
+	}
+	wait(counter);
+}
+
+int JobGraph::add(std::function<void()> function, std::initializer_list<int> dependencies) {
+	int index = (int)mNodes.size();
+	mNodes.push_back({ std::move(function), {}, (int)dependencies.size() });
+	for (int dependency : dependencies) {
+		mNodes[dependency].successors.push_back(index);
+	}
+	return index;
+}
+
+void JobGraph::schedule(JobSystem& jobs, JobCounter& counter, std::vector<std::atomic<int>>& remaining, int node) {
+	jobs.schedule(counter, [this, &jobs, &counter, &remaining, node] {
+		mNodes[node].function();
+		// Successors are scheduled before this job is counted as done, so the counter can't reach zero early.
+		for (int successor : mNodes[node].successors) {
+			if (remaining[successor].fetch_sub(1, std::memory_order_acq_rel) == 1) {
+				schedule(jobs, counter, remaining, successor);
+			}
+		}
+	});
+}
+
+void JobGraph::run(JobSystem& jobs) {
+	std::vector<std::atomic<int>> remaining(mNodes.size());
+	for (size_t i = 0; i < mNodes.size(); i++) {
+		remaining[i] = mNodes[i].dependencyCount;
+	}
+
+	JobCounter counter;
+	for (size_t i = 0; i < mNodes.size(); i++) {
+		if (mNodes[i].dependencyCount == 0) schedule(jobs, counter, remaining, (int)i);
+	}
+	jobs.wait(counter);
+}
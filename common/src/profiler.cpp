@@ -0,0 +1,327 @@
+#include "profiler.hpp"
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <imgui.h>
+#include <spdlog/spdlog.h>
+
+Profiler globalProfiler;
+
+double percentile(const std::vector<double>& sorted, double p) {
+	if (sorted.empty()) return -1.0;
+	return sorted[(size_t)(p * (sorted.size() - 1))];
+}
+
+double mean(const std::vector<double>& samples) {
+	if (samples.empty()) return -1.0;
+	double sum = 0.0;
+	for (double sample : samples) sum += sample;
+	return sum / samples.size();
+}
+
+void Profiler::initGpuTimers() {
+	mInitialized = true;
+
+#ifndef __EMSCRIPTEN__
+	// Timestamp queries are core since OpenGL 3.3. WebGL only exposes them behind an extension, so the web build uses CPU times only.
+	mGpuTimers = GLAD_GL_VERSION_3_3 || GLAD_GL_ARB_timer_query;
+	if (mGpuTimers) {
+		for (int i = 0; i < PROFILER_QUERY_LATENCY; i++) {
+			glGenQueries(PROFILER_MAX_ZONES * 2, mQueries[i]);
+		}
+	}
+#endif
+
+	spdlog::info("Profiler is using {}", mGpuTimers ? "GL timestamp queries" : "CPU times only");
+}
+
+void Profiler::beginFrame() {
+	if (!mInitialized) initGpuTimers();
+
+	int slot = mFrameIndex % PROFILER_QUERY_LATENCY;
+	if (mPendingValid[slot]) {
+		resolvePending(slot, false);
+		publish(mPending[slot]);
+		mPendingValid[slot] = false;
+	}
+
+	ProfilerFrame& frame = mPending[slot];
+	frame.index = mFrameIndex;
+	frame.cpuMs = 0.0;
+	frame.zoneCount = 0;
+
+	mDepth = 0;
+	mInFrame = true;
+	mFrameStart = Clock::now();
+}
+
+void Profiler::endFrame() {
+	if (!mInFrame) return;
+
+	int slot = mFrameIndex % PROFILER_QUERY_LATENCY;
+	mPending[slot].cpuMs = std::chrono::duration<double, std::milli>(Clock::now() - mFrameStart).count();
+	mInFrame = false;
+	mFrameIndex++;
+
+	// Without timer queries there is nothing to wait for.
+	if (mGpuTimers) {
+		mPendingValid[slot] = true;
+	}
+	else {
+		publish(mPending[slot]);
+	}
+}
+
+void Profiler::flush() {
+	// The slot of the next frame holds the oldest frame in flight, so walking forward from it publishes in order.
+	for (int i = 0; i < PROFILER_QUERY_LATENCY; i++) {
+		int slot = (mFrameIndex + i) % PROFILER_QUERY_LATENCY;
+		if (!mPendingValid[slot]) continue;
+		resolvePending(slot, true);
+		publish(mPending[slot]);
+		mPendingValid[slot] = false;
+	}
+}
+
+int Profiler::beginZone(const char* name) {
+	if (!mInFrame) return -1;
+
+	int slot = mFrameIndex % PROFILER_QUERY_LATENCY;
+	ProfilerFrame& frame = mPending[slot];
+	if (frame.zoneCount >= PROFILER_MAX_ZONES) return -1;
+
+	int zone = frame.zoneCount++;
+	frame.zones[zone] = { name, mDepth++, 0.0, -1.0 };
+	mZoneStarts[zone] = Clock::now();
+
+#ifndef __EMSCRIPTEN__
+	if (mGpuTimers) glQueryCounter(mQueries[slot][zone * 2], GL_TIMESTAMP);
+#endif
+
+	return zone;
+}
+
+void Profiler::endZone(int zone) {
+	if (!mInFrame || zone < 0) return;
+
+	int slot = mFrameIndex % PROFILER_QUERY_LATENCY;
+	ProfilerZoneSample& sample = mPending[slot].zones[zone];
+	sample.cpuMs = std::chrono::duration<double, std::milli>(Clock::now() - mZoneStarts[zone]).count();
+	mDepth--;
+
+#ifndef __EMSCRIPTEN__
+	if (mGpuTimers) glQueryCounter(mQueries[slot][zone * 2 + 1], GL_TIMESTAMP);
+#endif
+}
+
+void Profiler::resolvePending(int slot, bool wait) {
+#ifndef __EMSCRIPTEN__
+	ProfilerFrame& frame = mPending[slot];
+	GLuint* queries = mQueries[slot];
+
+	// Never stall the pipeline while running: if any result is missing the frame is published without GPU times.
+	// When flushing, reading GL_QUERY_RESULT below blocks until the GPU has caught up instead.
+	for (int i = 0; i < frame.zoneCount * 2 && !wait; i++) {
+		GLuint available = 0;
+		glGetQueryObjectuiv(queries[i], GL_QUERY_RESULT_AVAILABLE, &available);
+		if (!available) return;
+	}
+
+	for (int zone = 0; zone < frame.zoneCount; zone++) {
+		GLuint64 begin = 0, end = 0;
+		glGetQueryObjectui64v(queries[zone * 2], GL_QUERY_RESULT, &begin);
+		glGetQueryObjectui64v(queries[zone * 2 + 1], GL_QUERY_RESULT, &end);
+		frame.zones[zone].gpuMs = (end - begin) / 1e6;
+	}
+#endif
+}
+
+void Profiler::publish(const ProfilerFrame& frame) {
+	uint64_t published = mPublished.load(std::memory_order_relaxed);
+	HistorySlot& slot = mHistory[published % PROFILER_HISTORY];
+
+	uint64_t words[HISTORY_WORDS] = {};
+	memcpy(words, &frame, sizeof(frame));
+
+	slot.sequence.store(published * 2 + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+	for (size_t i = 0; i < HISTORY_WORDS; i++) {
+		slot.words[i].store(words[i], std::memory_order_relaxed);
+	}
+	slot.sequence.store(published * 2 + 2, std::memory_order_release);
+
+	mPublished.store(published + 1, std::memory_order_release);
+}
+
+int Profiler::frameCount() const {
+	return (int)std::min<uint64_t>(mPublished.load(std::memory_order_acquire), PROFILER_HISTORY);
+}
+
+bool Profiler::copyFrame(int age, ProfilerFrame& frame) const {
+	uint64_t published = mPublished.load(std::memory_order_acquire);
+	if (age < 0 || (uint64_t)age >= published || age >= PROFILER_HISTORY) return false;
+
+	uint64_t index = published - 1 - age;
+	const HistorySlot& slot = mHistory[index % PROFILER_HISTORY];
+
+	// The slot must hold the complete frame both before and after the copy. A slot is only ever rewritten with
+	// a newer frame, so a sequence that is odd or has moved on means the requested frame is gone and retrying
+	// could never return it.
+	uint64_t expected = index * 2 + 2;
+	if (slot.sequence.load(std::memory_order_acquire) != expected) return false;
+
+	uint64_t words[HISTORY_WORDS];
+	for (size_t i = 0; i < HISTORY_WORDS; i++) {
+		words[i] = slot.words[i].load(std::memory_order_relaxed);
+	}
+
+	std::atomic_thread_fence(std::memory_order_acquire);
+	if (slot.sequence.load(std::memory_order_relaxed) != expected) return false;
+
+	memcpy(&frame, words, sizeof(frame));
+	return true;
+}
+
+std::vector<Profiler::ZoneStatistics> Profiler::collectStatistics() const {
+	std::vector<ZoneStatistics> statistics;
+	ProfilerFrame frame;
+
+	for (int age = frameCount() - 1; age >= 0; age--) {
+		if (!copyFrame(age, frame)) continue;
+
+		for (int z = 0; z < frame.zoneCount; z++) {
+			const ProfilerZoneSample& sample = frame.zones[z];
+			auto found = std::find_if(statistics.begin(), statistics.end(), [&](const ZoneStatistics& s) {
+				return s.name == sample.name || strcmp(s.name, sample.name) == 0;
+			});
+			if (found == statistics.end()) {
+				statistics.push_back({ sample.name, sample.depth, {}, {} });
+				found = statistics.end() - 1;
+			}
+
+			found->cpuMs.push_back(sample.cpuMs);
+			if (sample.gpuMs >= 0.0) found->gpuMs.push_back(sample.gpuMs);
+		}
+	}
+
+	for (ZoneStatistics& s : statistics) {
+		std::sort(s.cpuMs.begin(), s.cpuMs.end());
+		std::sort(s.gpuMs.begin(), s.gpuMs.end());
+	}
+
+	return statistics;
+}
+
+void Profiler::drawOverlay() {
+	ImGui::Begin("Profiler");
+
+	int count = frameCount();
+	ImGui::Text("%d frames, %s", count, mGpuTimers ? "GPU timer queries" : "CPU times only");
+
+	float frameTimes[120];
+	int plotted = 0;
+	ProfilerFrame frame;
+	for (int age = std::min(count, 120) - 1; age >= 0; age--) {
+		if (copyFrame(age, frame)) frameTimes[plotted++] = (float)frame.cpuMs;
+	}
+	ImGui::PlotLines("Frame (ms)", frameTimes, plotted);
+
+	if (ImGui::BeginTable("zones", 7, ImGuiTableFlags_Borders | ImGuiTableFlags_RowBg)) {
+		ImGui::TableSetupColumn("Zone");
+		ImGui::TableSetupColumn("CPU p50");
+		ImGui::TableSetupColumn("CPU p95");
+		ImGui::TableSetupColumn("CPU p99");
+		ImGui::TableSetupColumn("GPU p50");
+		ImGui::TableSetupColumn("GPU p95");
+		ImGui::TableSetupColumn("GPU p99");
+		ImGui::TableHeadersRow();
+
+		for (const ZoneStatistics& s : collectStatistics()) {
+			ImGui::TableNextRow();
+			ImGui::TableNextColumn();
+			ImGui::Text("%*s%s", s.depth * 2, "", s.name);
+			for (const std::vector<double>* samples : { &s.cpuMs, &s.gpuMs }) {
+				for (double p : { 0.5, 0.95, 0.99 }) {
+					ImGui::TableNextColumn();
+					if (samples->empty()) ImGui::Text("-");
+					else ImGui::Text("%.3f", percentile(*samples, p));
+				}
+			}
+		}
+		ImGui::EndTable();
+	}
+
+	if (ImGui::Button("Write CSV")) writeCsv("profile.csv");
+	ImGui::SameLine();
+	if (ImGui::Button("Write JSON")) writeJson("profile.json");
+
+	ImGui::End();
+}
+
+bool Profiler::writeCsv(const std::string& path) const {
+	std::ofstream out(path);
+	if (out.fail()) {
+		spdlog::critical("Cannot write profile to {}", path);
+		return false;
+	}
+
+	out << "frame,zone,depth,cpu_ms,gpu_ms\n";
+	ProfilerFrame frame;
+	for (int age = frameCount() - 1; age >= 0; age--) {
+		if (!copyFrame(age, frame)) continue;
+		for (int z = 0; z < frame.zoneCount; z++) {
+			const ProfilerZoneSample& sample = frame.zones[z];
+			out << frame.index << "," << sample.name << "," << sample.depth << "," << sample.cpuMs << ",";
+			if (sample.gpuMs >= 0.0) out << sample.gpuMs;
+			out << "\n";
+		}
+	}
+
+	spdlog::info("Wrote profile to {}", path);
+	return true;
+}
+
+bool Profiler::writeJson(const std::string& path) const {
+	std::ofstream out(path);
+	if (out.fail()) {
+		spdlog::critical("Cannot write profile to {}", path);
+		return false;
+	}
+
+	out << "{\"gpuTimers\":" << (mGpuTimers ? "true" : "false") << ",\"frames\":[";
+	ProfilerFrame frame;
+	bool firstFrame = true;
+	for (int age = frameCount() - 1; age >= 0; age--) {
+		if (!copyFrame(age, frame)) continue;
+
+		out << (firstFrame ? "" : ",") << "{\"frame\":" << frame.index << ",\"cpuMs\":" << frame.cpuMs << ",\"zones\":[";
+		for (int z = 0; z < frame.zoneCount; z++) {
+			const ProfilerZoneSample& sample = frame.zones[z];
+			out << (z == 0 ? "" : ",") << "{\"name\":\"" << sample.name << "\",\"depth\":" << sample.depth << ",\"cpuMs\":" << sample.cpuMs;
+			if (sample.gpuMs >= 0.0) out << ",\"gpuMs\":" << sample.gpuMs;
+			out << "}";
+		}
+		out << "]}";
+		firstFrame = false;
+	}
+	out << "]}\n";
+
+	spdlog::info("Wrote profile to {}", path);
+	return true;
+}
+
+void Profiler::printSummary() const {
+	spdlog::info("Frame timings over the last {} frames (ms):", frameCount());
+	for (const ZoneStatistics& s : collectStatistics()) {
+		std::string name = std::string(s.depth * 2, ' ') + s.name;
+		if (s.gpuMs.empty()) {
+			spdlog::info("{:<24} cpu mean {:8.3f} p50 {:8.3f} p95 {:8.3f} p99 {:8.3f} max {:8.3f}",
+				name, mean(s.cpuMs), percentile(s.cpuMs, 0.5), percentile(s.cpuMs, 0.95), percentile(s.cpuMs, 0.99), s.cpuMs.back());
+		}
+		else {
+			spdlog::info("{:<24} cpu mean {:8.3f} p50 {:8.3f} p95 {:8.3f} p99 {:8.3f} max {:8.3f} | gpu mean {:8.3f} p50 {:8.3f} p95 {:8.3f} p99 {:8.3f}",
+				name, mean(s.cpuMs), percentile(s.cpuMs, 0.5), percentile(s.cpuMs, 0.95), percentile(s.cpuMs, 0.99), s.cpuMs.back(),
+				mean(s.gpuMs), percentile(s.gpuMs, 0.5), percentile(s.gpuMs, 0.95), percentile(s.gpuMs, 0.99));
+		}
+	}
+}
@@ -0,0 +1,136 @@
+#include "renderqueue.hpp"
+
+#include <cstring>
+
+GLStateCache globalGLState;
+RenderQueue globalRenderQueue;
+
+// Bits of each field of the sort key, from the most significant. GL names are truncated, which can only merge runs
+// of different state into one sorted run, never skip a binding.
+constexpr int KEY_PROGRAM_BITS = 12;
+constexpr int KEY_MATERIAL_BITS = 16;
+constexpr int KEY_VERTEX_ARRAY_BITS = 12;
+constexpr int KEY_DEPTH_BITS = 24;
+static_assert(KEY_PROGRAM_BITS + KEY_MATERIAL_BITS + KEY_VERTEX_ARRAY_BITS + KEY_DEPTH_BITS == 64, "Sort key fields must fill 64 bits");
+
+void GLStateCache::useProgram(GLuint program) {
+	if (program == mProgram) {
+		mSkippedCalls++;
+		return;
+	}
+	glUseProgram(program);
+	mProgram = program;
+	mIssuedCalls++;
+}
+
+void GLStateCache::bindVertexArray(GLuint vertexArray) {
+	if (vertexArray == mVertexArray) {
+		mSkippedCalls++;
+		return;
+	}
+	glBindVertexArray(vertexArray);
+	mVertexArray = vertexArray;
+	mIssuedCalls++;
+}
+
+void GLStateCache::bindTexture(int unit, GLenum target, GLuint texture) {
+	if (mTextureTargets[unit] == target && mTextures[unit] == texture) {
+		mSkippedCalls++;
+		return;
+	}
+	if (mActiveUnit != (GLuint)unit) {
+		glActiveTexture(GL_TEXTURE0 + unit);
+		mActiveUnit = unit;
+		mIssuedCalls++;
+	}
+	glBindTexture(target, texture);
+	mTextureTargets[unit] = target;
+	mTextures[unit] = texture;
+	mIssuedCalls++;
+}
+
+void GLStateCache::invalidate() {
+	mProgram = UNKNOWN;
+	mVertexArray = UNKNOWN;
+	mActiveUnit = UNKNOWN;
+	for (int unit = 0; unit < MAX_PACKET_TEXTURES; unit++) {
+		mTextureTargets[unit] = 0;
+		mTextures[unit] = UNKNOWN;
+	}
+}
+
+void GLStateCache::resetStatistics() {
+	mIssuedCalls = 0;
+	mSkippedCalls = 0;
+}
+
+// Positive floats compare like their bits, so the top bits of a distance sort it with the exponent and the start of
+// the mantissa.
+static uint64_t depthBits(float depth) {
+	if (!(depth > 0.0f)) return 0;
+	uint32_t bits;
+	memcpy(&bits, &depth, sizeof(bits));
+	return bits >> (32 - KEY_DEPTH_BITS);
+}
+
+void RenderQueue::submit(const DrawPacket& packet, uint32_t material, float depth) {
+	uint64_t key = (uint64_t)(packet.program & ((1u << KEY_PROGRAM_BITS) - 1));
+	key = key << KEY_MATERIAL_BITS | (material & ((1u << KEY_MATERIAL_BITS) - 1));
+	key = key << KEY_VERTEX_ARRAY_BITS | (packet.vertexArray & ((1u << KEY_VERTEX_ARRAY_BITS) - 1));
+	key = key << KEY_DEPTH_BITS | depthBits(depth);
+
+	mPackets.push_back(packet);
+	mKeys.push_back(key);
+}
+
+void RenderQueue::flush(GLStateCache& state) {
+	size_t count = mPackets.size();
+	if (count == 0) return;
+
+	// Least significant byte first, counting all eight bytes in one pass. A byte that is the same in every key
+	// leaves the order as it is, so its pass is skipped, which is most of them for a frame of similar draws.
+	uint32_t histograms[8][256] = {};
+	for (uint64_t key : mKeys) {
+		for (int byte = 0; byte < 8; byte++) histograms[byte][key >> (byte * 8) & 0xff]++;
+	}
+
+	mOrder.resize(count);
+	mSortScratch.resize(count);
+	mSortKeys.assign(mKeys.begin(), mKeys.end());
+	mScratchKeys.resize(count);
+	for (uint32_t i = 0; i < count; i++) mOrder[i] = i;
+
+	for (int byte = 0; byte < 8; byte++) {
+		uint32_t* histogram = histograms[byte];
+		if (histogram[mSortKeys[0] >> (byte * 8) & 0xff] == count) continue;
+
+		uint32_t offset = 0;
+		for (int bucket = 0; bucket < 256; bucket++) {
+			uint32_t bucketCount = histogram[bucket];
+			histogram[bucket] = offset;
+			offset += bucketCount;
+		}
+		for (size_t i = 0; i < count; i++) {
+			uint32_t destination = histogram[mSortKeys[i] >> (byte * 8) & 0xff]++;
+			mScratchKeys[destination] = mSortKeys[i];
+			mSortScratch[destination] = mOrder[i];
+		}
+		mSortKeys.swap(mScratchKeys);
+		mOrder.swap(mSortScratch);
+	}
+
+	state.invalidate();
+	for (uint32_t index : mOrder) {
+		const DrawPacket& packet = mPackets[index];
+		state.useProgram(packet.program);
+		state.bindVertexArray(packet.vertexArray);
+		for (int unit = 0; unit < MAX_PACKET_TEXTURES; unit++) {
+			const PacketTexture& texture = packet.textures[unit];
+			if (texture.target != 0) state.bindTexture(unit, texture.target, texture.texture);
+		}
+		packet.draw(packet);
+	}
+
+	mPackets.clear();
+	mKeys.clear();
+}
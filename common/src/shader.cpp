@@ -1,9 +1,17 @@
 #include "shader.hpp"
+#include "uniforms.hpp"
 #include <iostream>
 #include <sstream>
 #include <fstream>
 #include <streambuf>
 #include <spdlog/spdlog.h>
+#include <cstring>
+#include <filesystem>
+#include <vector>
+#include <glm/gtc/type_ptr.hpp>
+
+int Shader::programCacheHits = 0;
+int Shader::programCacheMisses = 0;
 
 int getShaderType(std::string filename) {
 	std::string ext = filename.substr(filename.length() - 4);
@@ -36,30 +44,198 @@ void Shader::addSource(std::string filename) {
 	addSource(filename, getShaderType(filename), 1, &sourceStr, &sourceLength);
 }
 
-void Shader::addSource(std::string label, GLuint shaderType, unsigned int count, const char** lines, const int* lineLengths) {
-	GLuint shader = 0;
+void Shader::addSource(std::string label, GLuint shaderType, unsigned int count, const char** lines, const int* lineLengths,
+	const std::vector<std::string>& defines) {
+	Source source{ label, shaderType, "" };
+	for (unsigned int i = 0; i < count; i++) {
+		if (lineLengths == nullptr || lineLengths[i] < 0) {
+			source.code += lines[i];
+		}
+		else {
+			source.code.append(lines[i], lineLengths[i]);
+		}
+	}
 
-	shader = glCreateShader(shaderType);
+	if (!defines.empty()) {
+		// GLSL requires #version to come first, so the defines go right after it.
+		size_t insertAt = 0;
+		if (source.code.compare(0, 8, "#version") == 0) {
+			size_t lineEnd = source.code.find('\n');
+			if (lineEnd == std::string::npos) {
+				lineEnd = source.code.size();
+				source.code += '\n';
+			}
+			insertAt = lineEnd + 1;
+		}
 
-	glShaderSource(shader, count, lines, lineLengths);
+		std::string defineLines;
+		for (const std::string& define : defines) {
+			defineLines += "#define " + define + "\n";
+			source.label += " " + define;
+		}
+		source.code.insert(insertAt, defineLines);
+	}
 
-	glCompileShader(shader);
+	mSources.push_back(std::move(source));
+}
 
-	int logLength = 0;
-	char infoLogBuffer[1024];
-	glGetShaderInfoLog(shader, sizeof(infoLogBuffer), &logLength, infoLogBuffer);
+bool Shader::compileSources() {
+	for (const Source& source : mSources) {
+		GLuint shader = 0;
 
-	if (logLength > 0) {
-		spdlog::critical("There are shader compilation errors for {}!\n{}", label, infoLogBuffer);
-		return;
+		shader = glCreateShader(source.type);
+
+		const char* code = source.code.c_str();
+		const int length = source.code.length();
+		glShaderSource(shader, 1, &code, &length);
+
+		glCompileShader(shader);
+
+		int logLength = 0;
+		char infoLogBuffer[1024];
+		glGetShaderInfoLog(shader, sizeof(infoLogBuffer), &logLength, infoLogBuffer);
+
+		if (logLength > 0) {
+			spdlog::critical("There are shader compilation errors for {}!\n{}", source.label, infoLogBuffer);
+			glDeleteShader(shader);
+			return false;
+		}
+
+		glAttachShader(mProgram, shader);
+
+		glDeleteShader(shader);
 	}
 
-	glAttachShader(mProgram, shader);
+	return true;
+}
 
-	glDeleteShader(shader);
+// Program binaries need GL 4.1 or ARB_get_program_binary, and at least one binary format. WebGL has neither.
+bool programBinariesSupported() {
+#if defined(__EMSCRIPTEN__) || !defined(PROGRAM_CACHE_DIR)
+	return false;
+#else
+	static int supported = -1;
+	if (supported < 0) {
+		GLint formats = 0;
+		if (GLAD_GL_VERSION_4_1 || GLAD_GL_ARB_get_program_binary) {
+			glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+		}
+		supported = formats > 0;
+		if (!supported) spdlog::info("Program binaries aren't supported, shaders are always compiled from source");
+	}
+	return supported;
+#endif
+}
+
+std::string Shader::label() const {
+	std::string result;
+	for (const Source& source : mSources) {
+		if (!result.empty()) result += "+";
+		result += source.label;
+	}
+	return result;
+}
+
+// FNV-1a over the driver strings and every source, so a driver update or a shader edit changes the key.
+uint64_t Shader::cacheKey() const {
+	uint64_t hash = 14695981039346656037ull;
+	auto add = [&hash](const void* data, size_t length) {
+		const unsigned char* bytes = (const unsigned char*)data;
+		for (size_t i = 0; i < length; i++) {
+			hash = (hash ^ bytes[i]) * 1099511628211ull;
+		}
+	};
+
+	for (GLenum name : { GL_VENDOR, GL_RENDERER, GL_VERSION }) {
+		const char* value = (const char*)glGetString(name);
+		if (value != nullptr) add(value, strlen(value) + 1);
+	}
+
+	for (const Source& source : mSources) {
+		add(&source.type, sizeof(source.type));
+		add(source.code.data(), source.code.size() + 1);
+	}
+	for (const std::string& varying : mFeedbackVaryings) {
+		add(varying.data(), varying.size() + 1);
+	}
+
+	return hash;
+}
+
+// Cache file layout: the binary format, then the binary as returned by glGetProgramBinary.
+bool Shader::loadBinary(const std::string& path) {
+	std::ifstream file(path, std::ios::binary);
+	if (file.fail()) return false;
+
+	GLenum format = 0;
+	file.read((char*)&format, sizeof(format));
+	std::vector<char> binary((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+	if (binary.empty()) return false;
+
+	glProgramBinary(mProgram, format, binary.data(), (GLsizei)binary.size());
+
+	// Drivers reject binaries from other versions or hardware, in which case the program is compiled again.
+	GLint status = GL_FALSE;
+	glGetProgramiv(mProgram, GL_LINK_STATUS, &status);
+	return status == GL_TRUE;
+}
+
+void Shader::saveBinary(const std::string& path) const {
+	GLint length = 0;
+	glGetProgramiv(mProgram, GL_PROGRAM_BINARY_LENGTH, &length);
+	if (length <= 0) return;
+
+	std::vector<char> binary(length);
+	GLenum format = 0;
+	glGetProgramBinary(mProgram, length, &length, &format, binary.data());
+
+	std::error_code error;
+	std::filesystem::create_directories(std::filesystem::path(path).parent_path(), error);
+
+	std::ofstream file(path, std::ios::binary);
+	if (file.fail()) {
+		spdlog::warn("Cannot write program binary to {}", path);
+		return;
+	}
+	file.write((const char*)&format, sizeof(format));
+	file.write(binary.data(), length);
+}
+
+void Shader::setTransformFeedbackVaryings(const std::vector<std::string>& varyings) {
+	mFeedbackVaryings = varyings;
 }
 
 void Shader::link() {
+	bool cacheable = programBinariesSupported();
+	std::string cachePath;
+
+#ifdef PROGRAM_CACHE_DIR
+	if (cacheable) {
+		cachePath = fmt::format("{}{:016x}.bin", PROGRAM_CACHE_DIR, cacheKey());
+		if (loadBinary(cachePath)) {
+			programCacheHits++;
+			spdlog::info("Program cache hit for {} ({} hits, {} misses)", label(), programCacheHits, programCacheMisses);
+			finishLink();
+			return;
+		}
+		programCacheMisses++;
+		spdlog::info("Program cache miss for {} ({} hits, {} misses)", label(), programCacheHits, programCacheMisses);
+	}
+#endif
+
+	if (!compileSources()) return;
+
+	if (cacheable) {
+		glProgramParameteri(mProgram, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+	}
+
+	// Part of the linked program, so binaries loaded from the cache keep them.
+	if (!mFeedbackVaryings.empty()) {
+		std::vector<const char*> names;
+		for (const std::string& varying : mFeedbackVaryings) names.push_back(varying.c_str());
+		glTransformFeedbackVaryings(mProgram, names.size(), names.data(), GL_INTERLEAVED_ATTRIBS);
+	}
+
 	glLinkProgram(mProgram);
 
 	int logLength = 0;
@@ -70,26 +246,128 @@ void Shader::link() {
 		spdlog::critical("There are shader linking errors!\n{}", infoLogBuffer);
 		return;
 	}
+
+	if (cacheable) saveBinary(cachePath);
+
+	finishLink();
+}
+
+void Shader::finishLink() {
+	mSources.clear();
+
+	reflect();
+
+	if (mUniformBlocks.count("FrameBlock")) {
+		bindUniformBlock("FrameBlock", FRAME_BLOCK_BINDING);
+	}
+}
+
+// Uniform arrays are reported as "name[0]", but looked up as "name".
+std::string trimArraySuffix(const char* name) {
+	std::string result = name;
+	size_t bracket = result.find('[');
+	if (bracket != std::string::npos) result.resize(bracket);
+	return result;
+}
+
+void Shader::reflect() {
+	mUniforms.clear();
+	mAttributes.clear();
+	mUniformBlocks.clear();
+	mReportedMissing.clear();
+
+	char name[256];
+	GLsizei length;
+	GLint size;
+	GLenum type;
+
+	GLint uniformCount = 0;
+	glGetProgramiv(mProgram, GL_ACTIVE_UNIFORMS, &uniformCount);
+	for (GLint i = 0; i < uniformCount; i++) {
+		glGetActiveUniform(mProgram, i, sizeof(name), &length, &size, &type, name);
+
+		// Members of uniform blocks are set through buffers and have no location.
+		GLuint index = i;
+		GLint blockIndex = -1;
+		glGetActiveUniformsiv(mProgram, 1, &index, GL_UNIFORM_BLOCK_INDEX, &blockIndex);
+		if (blockIndex != -1) continue;
+
+		mUniforms[trimArraySuffix(name)] = { type, size, glGetUniformLocation(mProgram, name) };
+	}
+
+	GLint attributeCount = 0;
+	glGetProgramiv(mProgram, GL_ACTIVE_ATTRIBUTES, &attributeCount);
+	for (GLint i = 0; i < attributeCount; i++) {
+		glGetActiveAttrib(mProgram, i, sizeof(name), &length, &size, &type, name);
+		// Built-in inputs like gl_InstanceID are listed too, but have no location.
+		if (strncmp(name, "gl_", 3) == 0) continue;
+		mAttributes[name] = { type, size, glGetAttribLocation(mProgram, name) };
+	}
+
+	GLint blockCount = 0;
+	glGetProgramiv(mProgram, GL_ACTIVE_UNIFORM_BLOCKS, &blockCount);
+	for (GLint i = 0; i < blockCount; i++) {
+		glGetActiveUniformBlockName(mProgram, i, sizeof(name), &length, name);
+		GLint dataSize = 0;
+		glGetActiveUniformBlockiv(mProgram, i, GL_UNIFORM_BLOCK_DATA_SIZE, &dataSize);
+		mUniformBlocks[name] = { 0, dataSize, i };
+	}
+}
+
+void Shader::warnMissing(const char* kind, const std::string& name) const {
+	if (mReportedMissing.insert(name).second) {
+		spdlog::warn("{} \"{}\" not found!", kind, name);
+	}
 }
 
 int Shader::getAttribute(std::string name) const {
-	int location = glGetAttribLocation(mProgram, name.c_str());
+	auto attribute = mAttributes.find(name);
 
-	if (location == -1) {
-		spdlog::warn("Attribute location \"{}\" not found!", name);
+	if (attribute == mAttributes.end()) {
+		warnMissing("Attribute location", name);
+		return -1;
 	}
 
-	return location;
+	return attribute->second.location;
 }
 
 int Shader::getUniform(std::string name) const {
-	int location = glGetUniformLocation(mProgram, name.c_str());
+	auto uniform = mUniforms.find(name);
+
+	if (uniform == mUniforms.end()) {
+		warnMissing("Uniform location", name);
+		return -1;
+	}
+
+	return uniform->second.location;
+}
+
+GLint Shader::findUniform(const std::string& name, bool (*typeMatches)(GLenum)) const {
+	auto uniform = mUniforms.find(name);
+
+	if (uniform == mUniforms.end()) {
+		warnMissing("Uniform location", name);
+		return -1;
+	}
+
+	if (!typeMatches(uniform->second.type)) {
+		spdlog::warn("Uniform \"{}\" has GL type 0x{:x}, which doesn't match its handle", name, uniform->second.type);
+		return -1;
+	}
+
+	return uniform->second.location;
+}
+
+bool Shader::bindUniformBlock(const std::string& name, GLuint binding) {
+	auto block = mUniformBlocks.find(name);
 
-	if (location == -1) {
-		spdlog::warn("Uniform location \"{}\" not found!", name);
+	if (block == mUniformBlocks.end()) {
+		warnMissing("Uniform block", name);
+		return false;
 	}
 
-	return location;
+	glUniformBlockBinding(mProgram, block->second.location, binding);
+	return true;
 }
 
 void Shader::use() {
@@ -99,3 +377,43 @@ void Shader::use() {
 GLuint Shader::get() {
 	return mProgram;
 }
+
+template<> bool uniformTypeMatches<int>(GLenum type) {
+	switch (type) {
+	case GL_INT:
+	case GL_BOOL:
+	case GL_SAMPLER_2D:
+	case GL_SAMPLER_3D:
+	case GL_SAMPLER_CUBE:
+	case GL_SAMPLER_2D_SHADOW:
+	case GL_SAMPLER_2D_ARRAY:
+	case GL_SAMPLER_2D_ARRAY_SHADOW:
+	case GL_SAMPLER_CUBE_SHADOW:
+	case GL_INT_SAMPLER_2D:
+	case GL_INT_SAMPLER_3D:
+	case GL_INT_SAMPLER_CUBE:
+	case GL_INT_SAMPLER_2D_ARRAY:
+	case GL_UNSIGNED_INT_SAMPLER_2D:
+	case GL_UNSIGNED_INT_SAMPLER_3D:
+	case GL_UNSIGNED_INT_SAMPLER_CUBE:
+	case GL_UNSIGNED_INT_SAMPLER_2D_ARRAY:
+		return true;
+	default:
+		return false;
+	}
+}
+
+template<> bool uniformTypeMatches<float>(GLenum type) { return type == GL_FLOAT; }
+template<> bool uniformTypeMatches<glm::vec2>(GLenum type) { return type == GL_FLOAT_VEC2; }
+template<> bool uniformTypeMatches<glm::vec3>(GLenum type) { return type == GL_FLOAT_VEC3; }
+template<> bool uniformTypeMatches<glm::vec4>(GLenum type) { return type == GL_FLOAT_VEC4; }
+template<> bool uniformTypeMatches<glm::mat3>(GLenum type) { return type == GL_FLOAT_MAT3; }
+template<> bool uniformTypeMatches<glm::mat4>(GLenum type) { return type == GL_FLOAT_MAT4; }
+
+template<> void Uniform<int>::set(const int& value) const { glUniform1i(location, value); }
+template<> void Uniform<float>::set(const float& value) const { glUniform1f(location, value); }
+template<> void Uniform<glm::vec2>::set(const glm::vec2& value) const { glUniform2fv(location, 1, glm::value_ptr(value)); }
+template<> void Uniform<glm::vec3>::set(const glm::vec3& value) const { glUniform3fv(location, 1, glm::value_ptr(value)); }
+template<> void Uniform<glm::vec4>::set(const glm::vec4& value) const { glUniform4fv(location, 1, glm::value_ptr(value)); }
+template<> void Uniform<glm::mat3>::set(const glm::mat3& value) const { glUniformMatrix3fv(location, 1, GL_FALSE, glm::value_ptr(value)); }
+template<> void Uniform<glm::mat4>::set(const glm::mat4& value) const { glUniformMatrix4fv(location, 1, GL_FALSE, glm::value_ptr(value)); }
@@ -0,0 +1,31 @@
+#include "uniforms.hpp"
+
+FrameUniforms globalFrameUniforms;
+
+static_assert(sizeof(FrameBlock) == 3 * 64 + 16, "FrameBlock must match the std140 layout of the GLSL block");
+
+void FrameUniforms::update(const glm::mat4& projection, const glm::mat4& cameraInverse) {
+	mData.projectionMatrix = projection;
+	mData.cameraInverseMatrix = cameraInverse;
+	mData.viewProjectionMatrix = projection * cameraInverse;
+	mData.cameraPosition = glm::inverse(cameraInverse)[3];
+
+	if (mBuffer == 0) {
+		glGenBuffers(1, &mBuffer);
+		glBindBuffer(GL_UNIFORM_BUFFER, mBuffer);
+		glBufferData(GL_UNIFORM_BUFFER, sizeof(FrameBlock), nullptr, GL_DYNAMIC_DRAW);
+	}
+	else {
+		glBindBuffer(GL_UNIFORM_BUFFER, mBuffer);
+	}
+
+	glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(FrameBlock), &mData);
+	glBindBufferBase(GL_UNIFORM_BUFFER, FRAME_BLOCK_BINDING, mBuffer);
+}
+
+void FrameUniforms::destroy() {
+	if (mBuffer != 0) {
+		glDeleteBuffers(1, &mBuffer);
+		mBuffer = 0;
+	}
+}
@@ -0,0 +1,58 @@
+import csv
+import os
+import statistics
+import subprocess
+import sys
+import tempfile
+
+# Run the headless mesh app with each skinning mode and print the median CPU and GPU time of every profiler zone,
+# plus the whole frame. On software rasterizers like llvmpipe the GPU time is CPU time too.
+# Usage: python scripts/benchmark-skinning.py path/to/mesh [frames] [extra app arguments...]
+# Example: python scripts/benchmark-skinning.py build/mesh/mesh 600 --threads 8
+
+executable = sys.argv[1]
+frames = int(sys.argv[2]) if len(sys.argv) > 2 else 300
+extraArguments = sys.argv[3:]
+
+modes = {
+    "per-draw": [],
+    "skin-once": ["--skin-once"],
+    "cpu": ["--cpu-skinning"],
+}
+
+results = {}
+zoneNames = []
+for mode, arguments in modes.items():
+    csvPath = os.path.join(tempfile.gettempdir(), f"benchmark-skinning-{mode}.csv")
+    subprocess.run([executable, "--headless", "--frames", str(frames), "--profile-csv", csvPath] + arguments + extraArguments,
+                   check=True, cwd=os.path.dirname(os.path.abspath(executable)), stdout=subprocess.DEVNULL)
+
+    zones = {}
+    frameTimes = {}
+    with open(csvPath) as csvFile:
+        for row in csv.DictReader(csvFile):
+            times = (float(row["cpu_ms"]), float(row["gpu_ms"] or 0.0))
+            zones.setdefault(row["zone"], []).append(times)
+            if row["zone"] not in zoneNames:
+                zoneNames.append(row["zone"])
+            # Top level zones cover the frame without overlapping.
+            if row["depth"] == "0":
+                cpu, gpu = frameTimes.get(row["frame"], (0.0, 0.0))
+                frameTimes[row["frame"]] = (cpu + times[0], gpu + times[1])
+    zones["frame"] = list(frameTimes.values())
+    results[mode] = {name: (statistics.median(t[0] for t in times), statistics.median(t[1] for t in times)) for name, times in zones.items()}
+
+zoneNames.append("frame")
+print("zone," + ",".join(f"{mode} cpu_ms,{mode} gpu_ms" for mode in modes))
+for name in zoneNames:
+    columns = []
+    for mode in modes:
+        cpu, gpu = results[mode].get(name, (0.0, 0.0))
+        columns += [f"{cpu:.3f}", f"{gpu:.3f}"]
+    print(f"{name}," + ",".join(columns))
+
+print()
+baseline = results["per-draw"]["frame"]
+for mode in modes:
+    cpu, gpu = results[mode]["frame"]
+    print(f"{mode}: frame {cpu:.3f} ms CPU, {gpu:.3f} ms GPU, {cpu / baseline[0] if baseline[0] > 0.0 else 0.0:.2f}x CPU time of per-draw")
@@ -0,0 +1,39 @@
+import csv
+import os
+import statistics
+import subprocess
+import sys
+import tempfile
+
+# Run a headless app with 1 to N job threads and print the median CPU time of every profiler zone.
+# Usage: python scripts/benchmark-threads.py path/to/executable [max threads] [extra app arguments...]
+# Example: python scripts/benchmark-threads.py build/mesh/mesh 8 --crowd 2048
+
+executable = sys.argv[1]
+maxThreads = int(sys.argv[2]) if len(sys.argv) > 2 else os.cpu_count()
+extraArguments = sys.argv[3:]
+
+results = {}
+zoneNames = []
+for threads in range(1, maxThreads + 1):
+    csvPath = os.path.join(tempfile.gettempdir(), f"benchmark-threads-{threads}.csv")
+    subprocess.run([executable, "--headless", "--frames", "300", "--threads", str(threads), "--profile-csv", csvPath] + extraArguments,
+                   check=True, cwd=os.path.dirname(os.path.abspath(executable)), stdout=subprocess.DEVNULL)
+
+    zones = {}
+    with open(csvPath) as csvFile:
+        for row in csv.DictReader(csvFile):
+            zones.setdefault(row["zone"], []).append(float(row["cpu_ms"]))
+            if row["zone"] not in zoneNames:
+                zoneNames.append(row["zone"])
+    results[threads] = {name: statistics.median(times) for name, times in zones.items()}
+
+print("threads," + ",".join(zoneNames))
+for threads, zones in results.items():
+    print(f"{threads}," + ",".join(f"{zones.get(name, 0.0):.3f}" for name in zoneNames))
+
+print()
+for name in zoneNames:
+    if results[1].get(name, 0.0) > 0.0:
+        speedups = [f"{results[1][name] / results[t][name]:.2f}x" for t in results if results[t].get(name, 0.0) > 0.0]
+        print(f"{name}: speedup {' '.join(speedups)}")
@@ -0,0 +1,167 @@
+// Converts the models and images of an assets directory into the cooked files the apps load at runtime.
+// Only inputs whose hash differs from the one recorded in their cooked file are converted again.
+//
+// Usage: asset-cooker <assets directory> <cooked directory> [--threads N] [--force]
+
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <initializer_list>
+#include <optional>
+#include <string>
+#include <vector>
+#include <assimp/Importer.hpp>
+#include <spdlog/spdlog.h>
+
+#include "CookedAsset.hpp"
+#include "CookedTexture.hpp"
+#include "SkinnedMeshData.hpp"
+#include "fetch.hpp"
+#include "jobs.hpp"
+
+enum class AssetKind {
+	Model,
+	Texture
+};
+
+struct CookJob {
+	AssetKind kind;
+	std::filesystem::path source;
+	std::filesystem::path cooked;
+};
+
+enum class CookResult {
+	UpToDate,
+	Cooked,
+	// Not something the apps can use, like a model without an armature
+	Skipped,
+	Failed
+};
+
+static bool hasExtension(const std::filesystem::path& path, std::initializer_list<const char*> extensions) {
+	std::string extension = path.extension().string();
+	std::transform(extension.begin(), extension.end(), extension.begin(), [](unsigned char c) { return std::tolower(c); });
+	for (const char* candidate : extensions) {
+		if (extension == candidate) return true;
+	}
+	return false;
+}
+
+// Whether the cooked file exists and was made from a source with this hash.
+static bool upToDate(const std::filesystem::path& cooked, const char magic[4], uint32_t version, uint64_t sourceHash) {
+	FetchedData data;
+	return data.map(cooked.string()) && cookedHeaderMatches(data.data(), data.size(), magic, version, sourceHash);
+}
+
+static CookResult cookModel(const CookJob& job, bool force) {
+	std::string sourcePath = job.source.string();
+	if (!force) {
+		// The cooked file lists the other files the model was imported from, so they are checked too
+		FetchedData cooked;
+		std::optional<uint64_t> sourceHash;
+		if (cooked.map(job.cooked.string())) sourceHash = currentCookedMeshSourceHash(cooked.data(), cooked.size(), sourcePath);
+		if (sourceHash && cookedHeaderMatches(cooked.data(), cooked.size(), COOKED_MESH_MAGIC, COOKED_MESH_VERSION, *sourceHash)) {
+			return CookResult::UpToDate;
+		}
+	}
+
+	Assimp::Importer loader;
+	std::vector<std::string> dependencies;
+	std::optional<uint64_t> sourceHash;
+	const aiScene* scene = readSkinnedMeshFile(loader, sourcePath, dependencies, sourceHash);
+	if (!scene) {
+		spdlog::critical("Couldn't load model file {}! {}", sourcePath, loader.GetErrorString());
+		return CookResult::Failed;
+	}
+
+	SkinnedMeshData data;
+	if (!importSkinnedMesh(scene, data)) return CookResult::Skipped;
+	data.sourceDependencies = std::move(dependencies);
+
+	if (!sourceHash) {
+		spdlog::critical("Model file {} changed while it was imported", sourcePath);
+		return CookResult::Failed;
+	}
+	return writeCookedMesh(job.cooked.string(), data, *sourceHash) ? CookResult::Cooked : CookResult::Failed;
+}
+
+static CookResult cookImage(const CookJob& job, bool force) {
+	FetchedData source;
+	if (!source.map(job.source.string())) return CookResult::Failed;
+
+	uint64_t sourceHash = cookedTextureSourceHash(source.data(), source.size());
+	if (!force && upToDate(job.cooked, COOKED_TEXTURE_MAGIC, COOKED_TEXTURE_VERSION, sourceHash)) return CookResult::UpToDate;
+
+	CookedTexture texture;
+	if (!cookTexture(source.data(), source.size(), texture)) {
+		spdlog::critical("Failed to cook image {}", job.source.string());
+		return CookResult::Failed;
+	}
+	compressTexture(texture);
+
+	return writeCookedTexture(job.cooked.string(), texture, sourceHash) ? CookResult::Cooked : CookResult::Failed;
+}
+
+int main(int argc, char** argv) {
+	if (argc < 3) {
+		spdlog::critical("Usage: {} <assets directory> <cooked directory> [--threads N] [--force]", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	std::filesystem::path assetsDirectory = argv[1];
+	std::filesystem::path cookedDirectory = argv[2];
+	int workerThreads = -1;
+	bool force = false;
+	for (int i = 3; i < argc; i++) {
+		if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+			// Total threads, like the apps' --threads
+			workerThreads = std::max(1, atoi(argv[++i])) - 1;
+		}
+		else if (strcmp(argv[i], "--force") == 0) {
+			force = true;
+		}
+	}
+
+	auto start = std::chrono::steady_clock::now();
+
+	// Cooked files mirror the assets directory, with the format appended to the name.
+	std::vector<CookJob> jobs;
+	std::error_code error;
+	for (const auto& entry : std::filesystem::recursive_directory_iterator(assetsDirectory, error)) {
+		if (!entry.is_regular_file()) continue;
+
+		std::filesystem::path relative = std::filesystem::relative(entry.path(), assetsDirectory);
+		if (hasExtension(entry.path(), { ".dae", ".gltf", ".glb", ".fbx" })) {
+			jobs.push_back({ AssetKind::Model, entry.path(), cookedDirectory / (relative.string() + ".skm") });
+		}
+		else if (hasExtension(entry.path(), { ".png", ".jpg", ".jpeg", ".tga", ".bmp" })) {
+			jobs.push_back({ AssetKind::Texture, entry.path(), cookedDirectory / (relative.string() + ".tex") });
+		}
+	}
+	if (error) {
+		spdlog::critical("Cannot list {}: {}", assetsDirectory.string(), error.message());
+		return EXIT_FAILURE;
+	}
+
+	// One job per asset: a single model takes far longer than the images, so they are balanced by stealing.
+	std::vector<CookResult> results(jobs.size());
+	globalJobSystem.start(workerThreads);
+	globalJobSystem.parallelFor(jobs.size(), 1, [&](int begin, int end) {
+		for (int i = begin; i < end; i++) {
+			results[i] = jobs[i].kind == AssetKind::Model ? cookModel(jobs[i], force) : cookImage(jobs[i], force);
+			if (results[i] == CookResult::Cooked) spdlog::info("Cooked {}", jobs[i].cooked.string());
+		}
+	});
+	int threads = globalJobSystem.threadCount();
+	globalJobSystem.stop();
+
+	auto count = [&results](CookResult result) { return std::count(results.begin(), results.end(), result); };
+	double elapsed = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+	spdlog::info("Cooked {} assets, {} up to date, {} skipped, {} failed in {:.0f} ms on {} threads",
+		count(CookResult::Cooked), count(CookResult::UpToDate), count(CookResult::Skipped), count(CookResult::Failed), elapsed, threads);
+
+	return count(CookResult::Failed) > 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}